@@ -1,11 +1,16 @@
 #pragma once
 
 #include <cstdint>
+#include <string>
+#include <string_view>
 #include <atomic>
 #include <memory>
 #include <vector>
 #include <functional>
 #include <shared_mutex>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace combotree {
 
@@ -13,6 +18,7 @@ class ALevel;
 class BLevel;
 class Manifest;
 class PmemKV;
+class ValueLog;
 
 struct Pair {
   uint64_t key;
@@ -21,13 +27,77 @@ struct Pair {
 
 class ComboTree {
  public:
-  ComboTree(std::string pool_dir, size_t pool_size, bool create = true);
+  // tuning knobs, defaults are the values in combotree_config.h
+  struct Options {
+    Options();
+
+    int expand_buf_key;         // pairs per BLevel entry after expansion
+    int expansion_factor;       // expand when size >= factor * buf_key * entries
+    size_t pmemkv_threshold;    // migrate from pmemkv when size reaches it
+    double entry_size_factor;   // BLevel physical entries per expanded entry
+    int span;                   // BLevel entries per ALevel entry
+    size_t clevel_file_size;    // grow step of CLevel file
+    size_t value_log_size;      // bytes of value log, 0 disables *Value()
+    bool string_keys;           // tree holds *String() keys, needs value_log_size
+  };
+
+  // zero-copy view of a value in the value log, its space is not reused
+  // by gc while the view is held
+  class ValueRef {
+   public:
+    ValueRef() : log_(nullptr), handle_(0), data_(nullptr), size_(0) {}
+    ~ValueRef() { Reset(); }
+    ValueRef(const ValueRef&) = delete;
+    ValueRef& operator=(const ValueRef&) = delete;
+
+    const void* data() const { return data_; }
+    size_t size() const { return size_; }
+    void Reset();
+
+   private:
+    friend class ComboTree;
+    const ValueLog* log_;
+    uint64_t handle_;
+    const void* data_;
+    size_t size_;
+  };
+
+  ComboTree(std::string pool_dir, size_t pool_size, bool create = true,
+            const Options& options = Options());
   ~ComboTree();
 
   bool Put(uint64_t key, uint64_t value);
   bool Update(uint64_t key, uint64_t value);
   bool Get(uint64_t key, uint64_t& value) const;
   bool Delete(uint64_t key);
+  // batched point operations, lookups in a batch overlap their cache misses
+  void MultiGet(const uint64_t* keys, size_t n, uint64_t* values, bool* found) const;
+  void MultiPut(const uint64_t* keys, const uint64_t* values, size_t n);
+  // load sorted unique pairs into an empty tree, no other operation may
+  // run concurrently. return false if tree is not empty or data unsorted.
+  bool BulkLoad(const Pair* data, size_t size);
+  template <typename Iter>
+  bool BulkLoad(Iter first, Iter last) {
+    std::vector<Pair> data(first, last);
+    return BulkLoad(data.data(), data.size());
+  }
+  // variable-length values, kept in the value log and the tree stores a
+  // handle of them. do not mix with Put() and friends in one tree.
+  bool PutValue(uint64_t key, const void* data, size_t size);
+  bool UpdateValue(uint64_t key, const void* data, size_t size);
+  bool GetValue(uint64_t key, ValueRef& value) const;
+  bool DeleteValue(uint64_t key);
+  // string keys, the tree key is an order-preserving 8-byte prefix of the
+  // string. strings longer than 7 bytes are kept in the value log and
+  // only compared when their prefixes tie, they fail unless string_keys
+  // is set. do not mix with other keys.
+  bool PutString(std::string_view key, uint64_t value);
+  bool UpdateString(std::string_view key, uint64_t value);
+  bool GetString(std::string_view key, uint64_t& value) const;
+  bool DeleteString(std::string_view key);
+  // append at most max_size pairs with keys >= min_key in string order
+  size_t ScanString(std::string_view min_key, size_t max_size,
+      std::vector<std::pair<std::string, uint64_t>>& results);
   size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
       std::vector<std::pair<uint64_t, uint64_t>>& results);
   size_t Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
@@ -42,6 +112,21 @@ class ComboTree {
   int64_t CLevelTime() const;
   uint64_t Usage() const;
 
+  // counters of the whole process, all zero unless built with STATISTICS
+  struct Stats {
+    uint64_t flush;               // cacheline_flush calls
+    uint64_t fence;               // memory_fence calls
+    uint64_t flush_to_clevel;     // BLevel entries flushed to CLevel
+    uint64_t clevel_split;        // CLevel node splits
+    uint64_t alloc_bytes;         // bytes of CLevel nodes allocated
+    uint64_t expansion;           // expansions finished
+    uint64_t expansion_time_us;
+    uint64_t expand_wait;         // sleeps waiting for expansion
+    uint64_t put_retry;           // extra loops in Put
+  };
+  Stats GetStats() const;
+  const Options& GetOptions() const { return options_; }
+
   bool IsExpanding() const {
     return permit_delete_.load() == false;
   }
@@ -94,24 +179,40 @@ class ComboTree {
 
   std::string pool_dir_;
   size_t pool_size_;
+  const Options options_;
   ALevel* alevel_;
   BLevel* blevel_;
   BLevel* old_blevel_;
   PmemKV* pmemkv_;
   Manifest* manifest_;
-  std::shared_mutex alevel_lock_;
+  mutable std::shared_mutex alevel_lock_;
   std::atomic<State> status_;
   std::atomic<bool> permit_delete_;
   std::atomic<int> sleeped_threads_;
   std::atomic<bool> need_sleep_;
+  uint64_t expand_epoch_;  // guarded by BLevel::expand_wait_lock
+  // used with BACKGROUND_EXPAND
+  std::thread expand_thread_;
+  std::mutex expand_lock_;
+  std::condition_variable expand_cv_;
+  std::atomic<bool> expand_request_;
+  bool expand_stop_;
+  // used with Options::value_log_size
+  ValueLog* value_log_;
+  std::thread value_gc_thread_;
 
   bool IsKeyInOldBLevel(uint64_t key, uint64_t& begin, uint64_t& end) const;
   bool ValidPoolDir_();
   void ChangeToComboTree_();
+  void FinishMigration_(size_t replay_from);
   void ExpandComboTree_();
+  void RequestExpansion_();
+  void CheckExpansion_();
+  void ExpandWorker_();
+  void ValueGCWorker_();
+  bool SetChain_(uint64_t prefix, uint64_t prev, uint64_t node);
   size_t Scan_(uint64_t min_key, uint64_t max_key, size_t max_size,
-      size_t& count, void (*callback)(uint64_t,uint64_t,void*), void* arg,
-      std::function<uint64_t()> cur_max_key);
+      void (*callback)(uint64_t,uint64_t,void*), void* arg);
 };
 
 } // namespace combotree
\ No newline at end of file
@@ -1,10 +1,105 @@
 #include <iostream>
+#include <limits>
+#include <algorithm>
 #include "combotree_config.h"
 #include "alevel.h"
 
 namespace combotree {
 
-int ALevel::file_id_ = 0;
+#ifdef LEARNED_ALEVEL
+
+ALevel::ALevel(BLevel* blevel, int span)
+    : blevel_(blevel)
+{
+  std::vector<uint64_t> keys;
+  keys.reserve(blevel_->Entries());
+  for (uint64_t i = 0; i < blevel_->Entries(); ++i)
+    keys.push_back(blevel_->EntryKey(i));
+
+  while (true) {
+    levels_.push_back(Train_(keys, ALEVEL_MAX_ERROR));
+    max_error_.push_back(MaxError_(levels_.back(), keys));
+    if (levels_.back().size() == 1)
+      break;
+    keys.clear();
+    for (auto& seg : levels_.back())
+      keys.push_back(seg.key);
+  }
+}
+
+ALevel::~ALevel() {}
+
+// shrinking cone: extend current segment while there is a slope keeping
+// every point within max_error.
+std::vector<ALevel::Segment> ALevel::Train_(const std::vector<uint64_t>& keys, int max_error) {
+  std::vector<Segment> segments;
+  uint64_t start = 0;
+  double min_slope = 0.0;
+  double max_slope = std::numeric_limits<double>::infinity();
+
+  auto close_segment = [&]() {
+    double slope = (max_slope == std::numeric_limits<double>::infinity()) ?
+                   0.0 : (min_slope + max_slope) / 2.0;
+    segments.push_back({keys[start], start, slope});
+  };
+
+  for (uint64_t i = 1; i < keys.size(); ++i) {
+    assert(keys[i] > keys[i-1]);
+    double dx = (double)(keys[i] - keys[start]);
+    double dy = (double)(i - start);
+    double lo = (dy - max_error) / dx;
+    double hi = (dy + max_error) / dx;
+    if (lo > max_slope || hi < min_slope) {
+      close_segment();
+      start = i;
+      min_slope = 0.0;
+      max_slope = std::numeric_limits<double>::infinity();
+    } else {
+      min_slope = std::max(min_slope, lo);
+      max_slope = std::min(max_slope, hi);
+    }
+  }
+  close_segment();
+  return segments;
+}
+
+// the actual error, including floating point rounding
+uint64_t ALevel::MaxError_(const std::vector<Segment>& segments,
+                           const std::vector<uint64_t>& keys) {
+  uint64_t max_error = 0;
+  for (uint64_t i = 0; i < segments.size(); ++i) {
+    uint64_t last_pos = (i + 1 == segments.size()) ? keys.size() - 1 : segments[i+1].pos - 1;
+    for (uint64_t pos = segments[i].pos; pos <= last_pos; ++pos) {
+      uint64_t pred = segments[i].Predict(keys[pos], last_pos);
+      max_error = std::max(max_error, pred > pos ? pred - pos : pos - pred);
+    }
+  }
+  return max_error;
+}
+
+void ALevel::GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const {
+  uint64_t seg_idx = 0;
+  for (int level = levels_.size() - 1; level > 0; --level) {
+    const std::vector<Segment>& lower = levels_[level-1];
+    uint64_t left, right;
+    Window_(level, seg_idx, key, lower.size(), left, right);
+    // last segment whose first key is less than or equal to key
+    while (left < right) {
+      uint64_t middle = (left + right + 1) / 2;
+      if (lower[middle].key <= key)
+        left = middle;
+      else
+        right = middle - 1;
+    }
+    seg_idx = left;
+  }
+  Window_(0, seg_idx, key, blevel_->Entries(), begin, end);
+}
+
+// model is small and stays in cache
+void ALevel::PrefetchBLevelRange_(uint64_t key) const {}
+
+#else // LEARNED_ALEVEL
 
 ALevel::ALevel(BLevel* blevel, int span)
     : span_(span), blevel_(blevel)
@@ -16,47 +111,34 @@ ALevel::ALevel(BLevel* blevel, int span)
   max_key_ = blevel_->EntryKey(nr_blevel_entry_);
   nr_entry_ = ((nr_blevel_entry_ + 1) / span_) + 1;
 
-  size_t file_size = nr_entry_ * sizeof(Entry);
-  pmem_file_ = std::string(ALEVEL_PMEM_FILE) + std::to_string(file_id_++);
-  int is_pmem;
-  std::filesystem::remove(pmem_file_);
-  pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 64,
-               PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
-  assert(is_pmem == 1);
-  if (pmem_addr_ == nullptr) {
-    perror("BLevel::BLevel(): pmem_map_file");
-    exit(1);
-  }
-  // aligned at 64-bytes
-  entry_ = (Entry*)pmem_addr_;
-  if (((uintptr_t)entry_ & (uintptr_t)63) != 0) {
-    // not aligned
-    entry_ = (Entry*)(((uintptr_t)entry_+64) & ~(uintptr_t)63);
-  }
+  // offsets_ starts at a cache line
+  size_t keys_size = (nr_entry_ * sizeof(uint64_t) + 63) & ~(size_t)63;
+  addr_ = HugePageAlloc(keys_size + nr_entry_ * sizeof(uint64_t), mapped_len_);
+  keys_ = (uint64_t*)addr_;
+  offsets_ = (uint64_t*)((uint8_t*)addr_ + keys_size);
 
-  entry_[0].key = min_key_;
-  entry_[0].offset = 1;
+  keys_[0] = min_key_;
+  offsets_[0] = 1;
   for (uint64_t offset = 2; offset < blevel_->Entries(); ++offset) {
     // calculate cdf and index for every key
     uint64_t cur_key = blevel_->EntryKey(offset);
     int index = CDFIndex_(cur_key);
-    if (entry_[index].key == 0) {
-      entry_[index].key = cur_key;
-      entry_[index].offset = offset;
+    if (keys_[index] == 0) {
+      keys_[index] = cur_key;
+      offsets_[index] = offset;
       for (int i = index - 1; i > 0; --i) {
-        if (entry_[i].key != 0) break;
-        entry_[i].key = cur_key;
-        entry_[i].offset = offset;
+        if (keys_[i] != 0) break;
+        keys_[i] = cur_key;
+        offsets_[i] = offset;
       }
     }
   }
-  entry_[nr_entry_ - 1].key = max_key_;
-  entry_[nr_entry_ - 1].offset = nr_blevel_entry_;
+  keys_[nr_entry_ - 1] = max_key_;
+  offsets_[nr_entry_ - 1] = nr_blevel_entry_;
 }
 
 ALevel::~ALevel() {
-  pmem_unmap(pmem_addr_, mapped_len_);
-  std::filesystem::remove(pmem_file_);
+  HugePageFree(addr_, mapped_len_);
 }
 
 void ALevel::GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const {
@@ -66,24 +148,75 @@ void ALevel::GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const
     return;
   }
   if (key >= max_key_) {
-    begin = entry_[nr_entry_ - 1].offset;
-    end = entry_[nr_entry_ - 1].offset;
+    begin = offsets_[nr_entry_ - 1];
+    end = offsets_[nr_entry_ - 1];
     return;
   }
 
   uint64_t cdf_index = CDFIndex_(key);
-  if (key >= entry_[cdf_index].key) {
-    begin = entry_[cdf_index].offset;
+  if (key >= keys_[cdf_index]) {
+    begin = offsets_[cdf_index];
     if (cdf_index == nr_entry_ - 1)
       end = begin;
     else
-      end = entry_[cdf_index + 1].offset;
+      end = offsets_[cdf_index + 1];
   } else {
-    begin = entry_[cdf_index - 1].offset;
-    end = entry_[cdf_index].offset;
+    begin = offsets_[cdf_index - 1];
+    end = offsets_[cdf_index];
     // assert(begin != end);
     if (begin == end) begin--;
   }
 }
 
+void ALevel::PrefetchBLevelRange_(uint64_t key) const {
+  uint64_t index = CDFIndex_(key);
+  _mm_prefetch((const char*)&keys_[index], _MM_HINT_T0);
+  _mm_prefetch((const char*)&offsets_[index], _MM_HINT_T0);
+}
+
+#endif // LEARNED_ALEVEL
+
+uint64_t ALevel::MultiGet(const uint64_t* keys, int n, uint64_t* values, bool* found) const {
+  assert(n <= 64);
+  uint64_t begin[64], end[64], idx[64];
+  for (int i = 0; i < n; ++i)
+    PrefetchBLevelRange_(keys[i]);
+  for (int i = 0; i < n; ++i) {
+    GetBLevelRange_(keys[i], begin[i], end[i]);
+    blevel_->PrefetchSearch(keys[i], begin[i], end[i]);
+  }
+  for (int i = 0; i < n; ++i)
+    idx[i] = blevel_->PrefetchEntry(keys[i], begin[i], end[i]);
+  for (int i = 0; i < n; ++i)
+    blevel_->PrefetchCLevel(idx[i]);
+
+  uint64_t retry = 0;
+  for (int i = 0; i < n; ++i) {
+    bool moved = false;
+    found[i] = blevel_->GetEntry(keys[i], values[i], idx[i], &moved);
+    if (moved)
+      retry |= 1UL << i;
+  }
+  return retry;
+}
+
+uint64_t ALevel::MultiPut(const uint64_t* keys, const uint64_t* values, int n) {
+  assert(n <= 64);
+  uint64_t begin[64], end[64];
+  for (int i = 0; i < n; ++i)
+    PrefetchBLevelRange_(keys[i]);
+  for (int i = 0; i < n; ++i) {
+    GetBLevelRange_(keys[i], begin[i], end[i]);
+    blevel_->PrefetchSearch(keys[i], begin[i], end[i]);
+  }
+  for (int i = 0; i < n; ++i)
+    blevel_->PrefetchEntry(keys[i], begin[i], end[i]);
+
+  uint64_t retry = 0;
+  for (int i = 0; i < n; ++i)
+    if (!blevel_->Put(keys[i], values[i], begin[i], end[i]))
+      retry |= 1UL << i;
+  return retry;
+}
+
 } // namespace combotree
\ No newline at end of file
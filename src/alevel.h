@@ -2,14 +2,17 @@
 
 #include <cstdint>
 #include <cassert>
+#include <vector>
 #include "combotree_config.h"
 #include "blevel.h"
+#include "hugepage.h"
 
 namespace combotree {
 
 class ComboTree;
 
-// in-memory
+// in DRAM, rebuilt from blevel entry keys when blevel changes or is
+// recovered
 class ALevel {
  public:
   ALevel(BLevel* blevel, int span = DEFAULT_SPAN);
@@ -27,10 +30,10 @@ class ALevel {
     return blevel_->Update(key, value, begin, end);
   }
 
-  ALWAYS_INLINE bool Get(uint64_t key, uint64_t& value) const {
+  ALWAYS_INLINE bool Get(uint64_t key, uint64_t& value, bool* moved = nullptr) const {
     uint64_t begin, end;
     GetBLevelRange_(key, begin, end);
-    return blevel_->Get(key, value, begin, end);
+    return blevel_->Get(key, value, begin, end, moved);
   }
 
   ALWAYS_INLINE bool Delete(uint64_t key, uint64_t* value) {
@@ -39,37 +42,93 @@ class ALevel {
     return blevel_->Delete(key, value, begin, end);
   }
 
+  ALWAYS_INLINE bool Scan(uint64_t& min_key, uint64_t max_key, size_t max_size,
+                          size_t& count, void (*callback)(uint64_t,uint64_t,void*),
+                          void* arg) const {
+    uint64_t begin, end;
+    GetBLevelRange_(min_key, begin, end);
+    return blevel_->Scan(min_key, max_key, max_size, count, callback, arg, begin, end);
+  }
+
+  // lookups of a group are interleaved stage by stage (alevel, blevel
+  // search, blevel entry, clevel root) so that their cache misses overlap.
+  // return bitmask of keys which should be retried one by one.
+  uint64_t MultiGet(const uint64_t* keys, int n, uint64_t* values, bool* found) const;
+  uint64_t MultiPut(const uint64_t* keys, const uint64_t* values, int n);
+
   size_t Size() const {
     return blevel_->Size();
   }
 
+  // blevel entries searched for key
+  ALWAYS_INLINE void BLevelRange(uint64_t key, uint64_t& begin, uint64_t& end) const {
+    GetBLevelRange_(key, begin, end);
+  }
+
   uint64_t Usage() const {
-    return nr_entry_ * sizeof(Entry);
+#ifdef LEARNED_ALEVEL
+    uint64_t usage = 0;
+    for (auto& level : levels_)
+      usage += level.size() * sizeof(Segment);
+    return usage;
+#else
+    return nr_entry_ * (sizeof(uint64_t) * 2);
+#endif
   }
 
   friend ComboTree;
 
  private:
-  struct Entry {
-    Entry() : key(0), offset(0) {}
-
-    uint64_t key;
-    uint64_t offset;
+#ifdef LEARNED_ALEVEL
+  // piecewise linear model, predicts the index of the last key which is
+  // less than or equal to the target key.
+  struct Segment {
+    uint64_t key;   // first key
+    uint64_t pos;   // index of first key
+    double slope;
+
+    ALWAYS_INLINE uint64_t Predict(uint64_t target, uint64_t last_pos) const {
+      double pred = (double)pos + slope * (double)(target - key);
+      return pred >= (double)last_pos ? last_pos : (uint64_t)pred;
+    }
   };
 
+  BLevel* blevel_;
+  // levels_[0] is trained on blevel entry keys, levels_[i] on the first keys
+  // of segments in levels_[i-1]. the top level has only one segment.
+  std::vector<std::vector<Segment>> levels_;
+  std::vector<uint64_t> max_error_;
+
+  static std::vector<Segment> Train_(const std::vector<uint64_t>& keys, int max_error);
+  static uint64_t MaxError_(const std::vector<Segment>& segments,
+                            const std::vector<uint64_t>& keys);
+
+  // [begin, end] is the search window in the level below (or in blevel),
+  // which contains the predecessor of key.
+  ALWAYS_INLINE void Window_(int level, uint64_t seg_idx, uint64_t key,
+                             uint64_t nr_keys, uint64_t& begin, uint64_t& end) const {
+    const Segment& seg = levels_[level][seg_idx];
+    uint64_t last_pos = (seg_idx + 1 == levels_[level].size()) ?
+                        nr_keys - 1 : levels_[level][seg_idx+1].pos - 1;
+    uint64_t pred = seg.Predict(key, last_pos);
+    begin = (pred >= seg.pos + max_error_[level] + 1) ? pred - max_error_[level] - 1 : seg.pos;
+    end = std::min(pred + max_error_[level], last_pos);
+  }
+#else
   int span_;
   BLevel* blevel_;
   uint64_t min_key_;
   uint64_t max_key_;
   uint64_t nr_blevel_entry_;
   uint64_t nr_entry_;
-  Entry* entry_;
+  // keys and blevel offsets are kept apart, a lookup reads one or two
+  // adjacent keys and offsets, so at most two cache lines
+  uint64_t* keys_;
+  uint64_t* offsets_;
 
-  // pmem
-  void* pmem_addr_;
+  // hugepage
+  void* addr_;
   size_t mapped_len_;
-  std::string pmem_file_;
-  static int file_id_;
 
   double CalculateCDF_(uint64_t key) const {
     return (double)(key - min_key_) / (double)(max_key_ - min_key_);
@@ -81,7 +140,10 @@ class ALevel {
     return (uint64_t)((CalculateCDF_(key) * nr_blevel_entry_ + 1.0) / span_);
   }
 
+#endif // LEARNED_ALEVEL
+
   void GetBLevelRange_(uint64_t key, uint64_t& begin, uint64_t& end) const;
+  void PrefetchBLevelRange_(uint64_t key) const;
 };
 
 } // namespace combotree
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <cstring>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <chrono>
@@ -6,6 +7,7 @@
 #include <condition_variable>
 #include <thread>
 #include "combotree_config.h"
+#include "combotree/combotree.h"
 #include "blevel.h"
 
 namespace combotree {
@@ -25,6 +27,11 @@ namespace { // anonymous namespace
 
 std::atomic<int64_t> clevel_time = 0;
 
+ALWAYS_INLINE uint64_t KVKey(const std::pair<uint64_t,uint64_t>& kv) { return kv.first; }
+ALWAYS_INLINE uint64_t KVValue(const std::pair<uint64_t,uint64_t>& kv) { return kv.second; }
+ALWAYS_INLINE uint64_t KVKey(const Pair& kv) { return kv.key; }
+ALWAYS_INLINE uint64_t KVValue(const Pair& kv) { return kv.value; }
+
 ALWAYS_INLINE int CommonPrefixBytes(uint64_t a, uint64_t b) {
   // the result of clz is undefined if arg is 0
   int leading_zero_cnt = (a ^ b) == 0 ? 64 : __builtin_clzll(a ^ b);
@@ -72,36 +79,42 @@ void stream_store_entry(void* dest, void* source) {
 } // anonymous namespace
 
 void BLevel::ExpandData::FlushToEntry(Entry* entry, int prefix_len, CLevel::MemControl* mem) {
-  while (buf_count > entry->buf.max_entries) {
-    // flush last entry.max_entries data to clevel
+  while (buf_count >= entry->buf.max_entries) {
+    // flush last max_entries-1 data to clevel, the first clevel leaf
+    // is set up from entry buffer and must not be full
+    int flush_count = entry->buf.max_entries - 1;
     // copy value
-    memcpy(entry->buf.pvalue(entry->buf.max_entries-1),
-           &value_buf[BLEVEL_EXPAND_BUF_KEY-buf_count], 8*entry->buf.max_entries);
+    memcpy(entry->buf.pvalue(flush_count-1),
+           &value_buf[MAX_EXPAND_BUF_KEY-buf_count], 8*flush_count);
     // copy key
-    for (int i = 0; i < entry->buf.max_entries; ++i)
-      memcpy(entry->buf.pkey(i), &key_buf[i+buf_count-entry->buf.max_entries], 8 - prefix_len);
-    entry->buf.entries = entry->buf.max_entries;
-    entry->FlushToCLevel(mem);
-    buf_count -= entry->buf.max_entries;
+    for (int i = 0; i < flush_count; ++i)
+      memcpy(entry->buf.pkey(i), &key_buf[i+buf_count-flush_count], 8 - prefix_len);
+    entry->buf.SetSorted(flush_count);
+    // expansion can not be rolled back
+    if (!entry->FlushToCLevel(mem)) {
+      LOG(Debug::ERROR, "no space for clevel during expansion!");
+      exit(1);
+    }
+    buf_count -= flush_count;
   }
 #ifdef STREAMING_STORE
   Entry in_mem(entry->entry_key, prefix_len);
   // copy value
   memcpy(in_mem.buf.pvalue(buf_count-1),
-         &value_buf[BLEVEL_EXPAND_BUF_KEY-buf_count], 8*buf_count);
+         &value_buf[MAX_EXPAND_BUF_KEY-buf_count], 8*buf_count);
   // copy key
   for (int i = 0; i < buf_count; ++i)
     memcpy(in_mem.buf.pkey(i), &key_buf[i], 8 - prefix_len);
-  in_mem.buf.entries = buf_count;
+  in_mem.buf.SetSorted(buf_count);
   stream_store_entry(entry, &in_mem);
 #else
   // copy value
   memcpy(entry->buf.pvalue(buf_count-1),
-         &value_buf[BLEVEL_EXPAND_BUF_KEY-buf_count], 8*buf_count);
+         &value_buf[MAX_EXPAND_BUF_KEY-buf_count], 8*buf_count);
   // copy key
   for (int i = 0; i < buf_count; ++i)
     memcpy(entry->buf.pkey(i), &key_buf[i], 8 - prefix_len);
-  entry->buf.entries = buf_count;
+  entry->buf.SetSorted(buf_count);
   cacheline_flush(entry);
   cacheline_flush((uint8_t*)entry+64);
   memory_fence();
@@ -131,9 +144,23 @@ BLevel::Entry::Entry(uint64_t key, int prefix_len)
   buf.max_entries = buf.MaxEntries();
 }
 
-// return true if not exist before, return false if update.
+// return false if buffer is full and clevel file can not grow
 bool BLevel::Entry::Put(CLevel::MemControl* mem, uint64_t key, uint64_t value) {
-#ifdef BUF_SORT
+#ifdef BLEVEL_SORT_BUFFER
+  bool exist;
+  int pos = buf.Find(key, exist);
+  if (exist) {
+    buf.Update(pos, value);
+    return true;
+  }
+  // the first clevel leaf is set up from entry buffer and must not be full
+  if ((!clevel.HasSetup() && buf.entries == buf.max_entries - 1) || buf.Full()) {
+    if (!FlushToCLevel(mem))
+      return false;
+    pos = 0;
+  }
+  return buf.Put(pos, key, value);
+#elif defined(BUF_SORT)
   bool exist;
   int pos = buf.Find(key, exist);
   // already in, update
@@ -141,17 +168,19 @@ bool BLevel::Entry::Put(CLevel::MemControl* mem, uint64_t key, uint64_t value) {
     *(uint64_t*)buf.pvalue(pos) = value;
     cacheline_flush(buf.pvalue(pos));
     memory_fence();
-    return false;
+    return true;
   } else {
     if (buf.Full()) {
-      FlushToCLevel(mem);
+      if (!FlushToCLevel(mem))
+        return false;
       pos = 0;
     }
     return buf.Put(pos, key, value);
   }
 #else
-  if ((!clevel.HasSetup() && buf.entries == buf.max_entries - 1) || buf.Full())
-    FlushToCLevel(mem);
+  if (((!clevel.HasSetup() && buf.entries == buf.max_entries - 1) || buf.Full()) &&
+      !FlushToCLevel(mem))
+    return false;
   return buf.Put(buf.entries, key, value);
 #endif
 };
@@ -173,7 +202,7 @@ bool BLevel::Entry::Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value)
   bool exist;
   int pos = buf.Find(key, exist);
   if (exist) {
-    value = buf.value(pos);
+    value = this->value(pos);
     return true;
   } else {
     return clevel.HasSetup() ? clevel.Get(mem, key, value) : false;
@@ -185,90 +214,356 @@ bool BLevel::Entry::Delete(CLevel::MemControl* mem, uint64_t key, uint64_t* valu
   int pos = buf.Find(key, exist);
   if (exist) {
     if (value)
-      *value = buf.value(pos);
+      *value = this->value(pos);
     return buf.Delete(pos);
   } else {
     return clevel.HasSetup() ? clevel.Delete(mem, key, value) : false;
   }
 }
 
-void BLevel::Entry::FlushToCLevel(CLevel::MemControl* mem) {
-  // TODO: let anothor thread do this? e.g. a little thread pool
+bool BLevel::Entry::FlushToCLevel(CLevel::MemControl* mem) {
+  // with ASYNC_FLUSH this mostly runs in BLevel::FlushThread_()
+  STATS_INC(FLUSH_TO_CLEVEL);
   Timer timer;
   timer.Start();
 
   if (!clevel.HasSetup()) {
-    clevel.Setup(mem, buf);
+    if (!clevel.Setup(mem, buf))
+      return false;
   } else {
-    for (int i = 0; i < buf.entries; ++i) {
-      if (clevel.Put(mem, buf.key(i, entry_key), buf.value(i)) != true) {
-        assert(0);
-      }
-    }
+    uint64_t keys[16];
+    uint64_t values[16];
+    int n = SortedPairs(keys, values);
+    if (!clevel.PutBatch(mem, keys, values, n))
+      return false;
   }
   buf.Clear();
 
   clevel_time.fetch_add(timer.End());
+  return true;
 }
 
+int BLevel::Entry::SortedPairs(uint64_t* keys, uint64_t* values) const {
+#if defined(BUF_SORT) || defined(BLEVEL_SORT_BUFFER)
+  for (int i = 0; i < buf.entries; ++i) {
+    keys[i] = key(i);
+    values[i] = value(i);
+  }
+#else
+  int sorted_index[16];
+  buf.GetSortedIndex(sorted_index);
+  for (int i = 0; i < buf.entries; ++i) {
+    keys[i] = key(sorted_index[i]);
+    values[i] = value(sorted_index[i]);
+  }
+#endif
+  return buf.entries;
+}
+
+#ifdef ASYNC_FLUSH
+bool BLevel::Entry::MergeToCLevel(CLevel::MemControl* mem, const uint64_t* keys,
+                                  const uint64_t* values, int n) {
+  STATS_INC(FLUSH_TO_CLEVEL);
+  Timer timer;
+  timer.Start();
+  bool ret = clevel.PutBatch(mem, keys, values, n);
+  clevel_time.fetch_add(timer.End());
+  return ret;
+}
+
+// writers may have changed merged pairs in buffer during the merge, clevel
+// takes their current state before they are dropped.
+void BLevel::Entry::DropMerged(CLevel::MemControl* mem, const uint64_t* keys,
+                               const uint64_t* values, int n) {
+  if (buf.entries == n) {
+    uint64_t cur_keys[16];
+    uint64_t cur_values[16];
+    SortedPairs(cur_keys, cur_values);
+    if (memcmp(cur_keys, keys, n * sizeof(uint64_t)) == 0 &&
+        memcmp(cur_values, values, n * sizeof(uint64_t)) == 0) {
+      buf.Clear();
+      return;
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    bool exist;
+    int pos = buf.Find(keys[i], exist);
+    if (!exist) {
+      // deleted from buffer
+      clevel.Delete(mem, keys[i], nullptr);
+      continue;
+    }
+    if (value(pos) != values[i])
+      clevel.Update(mem, keys[i], value(pos));
+    buf.Delete(pos);
+  }
+}
+#endif
+
 
 /****************************** BLevel ******************************/
-BLevel::BLevel(size_t data_size)
-  : nr_entries_(0), size_(0),
-    clevel_mem_(CLEVEL_PMEM_FILE, CLEVEL_PMEM_FILE_SIZE)
+BLevel::BLevel(size_t data_size, int expand_buf_key, double entry_size_factor,
+               size_t clevel_file_size)
+  : nr_entries_(0), expand_buf_key_(expand_buf_key), size_(0),
+    clevel_mem_(CLEVEL_PMEM_FILE, clevel_file_size)
 #ifndef NO_LOCK
     , lock_(nullptr)
 #endif
 {
-  physical_nr_entries_ = ((data_size+1+BLEVEL_EXPAND_BUF_KEY-1)/BLEVEL_EXPAND_BUF_KEY) * ENTRY_SIZE_FACTOR;
-  size_t file_size = sizeof(Entry) * physical_nr_entries_;
+  assert(expand_buf_key > 0 && expand_buf_key <= MAX_EXPAND_BUF_KEY);
+  physical_nr_entries_ = ((data_size+1+expand_buf_key-1)/expand_buf_key) * entry_size_factor;
+  size_t file_size = sizeof(Meta) + sizeof(Entry) * physical_nr_entries_;
 #ifdef USE_LIBPMEM
-  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(file_id_++);
+  pmem_file_id_ = file_id_++;
+  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(pmem_file_id_);
   int is_pmem;
   std::filesystem::remove(pmem_file_);
   pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 64,
                PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
+#ifdef PERSIST_PMEM
   assert(is_pmem == 1);
+#endif
   if (pmem_addr_ == nullptr) {
     perror("BLevel::BLevel(): pmem_map_file");
     exit(1);
   }
   // aligned at 64-bytes
-  entries_ = (Entry*)pmem_addr_;
-  if (((uintptr_t)entries_ & (uintptr_t)63) != 0) {
+  meta_ = (Meta*)pmem_addr_;
+  if (((uintptr_t)meta_ & (uintptr_t)63) != 0) {
     // not aligned
-    entries_ = (Entry*)(((uintptr_t)entries_+64) & ~(uintptr_t)63);
+    meta_ = (Meta*)(((uintptr_t)meta_+64) & ~(uintptr_t)63);
   }
-
-  entries_offset_ = (uint64_t)entries_ - (uint64_t)pmem_addr_;
 #else // libvmmalloc
+  pmem_file_id_ = -1;
   pmem_file_ = "";
   pmem_addr_ = nullptr;
-  entries_offset_ = 0;
-  entries_ = (Entry*)new (std::align_val_t{64}) uint8_t[file_size];
-  assert(((uint64_t)entries_ & 63) == 0);
+  meta_ = (Meta*)new (std::align_val_t{64}) uint8_t[file_size];
+  assert(((uint64_t)meta_ & 63) == 0);
 #endif
+  entries_ = (Entry*)(meta_ + 1);
+  entries_offset_ = (uint64_t)entries_ - (uint64_t)(pmem_addr_ ? pmem_addr_ : meta_);
+  meta_->nr_entries = 0;
+  meta_->physical_nr_entries = physical_nr_entries_;
+  cacheline_flush(meta_);
+  memory_fence();
 
 #ifndef NO_LOCK
   // plus one because of scan
-  lock_ = new std::shared_mutex[physical_nr_entries_+1];
+  lock_ = new EntryLock[physical_nr_entries_+1];
+#endif
+#ifdef ASYNC_FLUSH
+  merging_ = new std::atomic<bool>[physical_nr_entries_+1]();
+#endif
+#ifdef ASYNC_FLUSH
+  StartFlushThreads_();
+#endif
+}
+
+BLevel::BLevel(int file_id, int clevel_file_id, int expand_buf_key,
+               size_t clevel_file_size)
+  : nr_entries_(0), expand_buf_key_(expand_buf_key), size_(0),
+    clevel_mem_(CLEVEL_PMEM_FILE, clevel_file_id, clevel_file_size)
+#ifndef NO_LOCK
+    , lock_(nullptr)
+#endif
+{
+  pmem_file_id_ = file_id;
+  file_id_ = std::max(file_id_, file_id + 1);
+  pmem_file_ = std::string(BLEVEL_PMEM_FILE) + std::to_string(pmem_file_id_);
+  int is_pmem;
+  pmem_addr_ = pmem_map_file(pmem_file_.c_str(), 0, 0, 0666, &mapped_len_, &is_pmem);
+#ifdef PERSIST_PMEM
+  assert(is_pmem == 1);
+#endif
+  if (pmem_addr_ == nullptr) {
+    perror("BLevel::BLevel(): pmem_map_file");
+    exit(1);
+  }
+  meta_ = (Meta*)pmem_addr_;
+  if (((uintptr_t)meta_ & (uintptr_t)63) != 0)
+    meta_ = (Meta*)(((uintptr_t)meta_+64) & ~(uintptr_t)63);
+  entries_ = (Entry*)(meta_ + 1);
+  entries_offset_ = (uint64_t)entries_ - (uint64_t)pmem_addr_;
+
+  nr_entries_ = meta_->nr_entries;
+  physical_nr_entries_ = meta_->physical_nr_entries;
+  assert(nr_entries_ != 0);
+
+#ifndef NO_LOCK
+  lock_ = new EntryLock[physical_nr_entries_+1];
+#endif
+#ifdef ASYNC_FLUSH
+  merging_ = new std::atomic<bool>[physical_nr_entries_+1]();
+#endif
+
+  // fix interrupted deletes and count pairs, one thread per brange
+  std::vector<std::thread> threads;
+#ifdef BRANGE
+  interval_size_ = meta_->interval_size;
+  memcpy(ranges_, meta_->ranges, sizeof(ranges_));
+  for (int i = 0; i < EXPAND_THREADS; ++i) {
+    intervals_[i] = (ranges_[i].entries+interval_size_-1) / interval_size_;
+    size_per_interval_[i] = new std::atomic<size_t>[intervals_[i]]{};
+    for (uint64_t j = 0; j < intervals_[i]; ++j) {
+      uint64_t begin = ranges_[i].physical_entry_start + j*interval_size_;
+      uint64_t end = std::min<uint64_t>(begin+interval_size_,
+                                        ranges_[i].physical_entry_start+ranges_[i].entries);
+      threads.emplace_back(&BLevel::RecoverEntries_, this, begin, end, &size_per_interval_[i][j]);
+      if (threads.size() == std::thread::hardware_concurrency()) {
+        for (auto& t : threads)
+          t.join();
+        threads.clear();
+      }
+    }
+  }
+  for (auto& t : threads)
+    t.join();
+  for (int i = 0; i < EXPAND_THREADS; ++i)
+    for (uint64_t j = 0; j < intervals_[i]; ++j)
+      size_ += size_per_interval_[i][j];
+#else
+  int nr_threads = std::max(1U, std::thread::hardware_concurrency());
+  uint64_t per_thread = (nr_entries_+nr_threads-1) / nr_threads;
+  std::vector<std::atomic<size_t>> sizes(nr_threads);
+  for (int i = 0; i < nr_threads; ++i) {
+    uint64_t begin = std::min<uint64_t>(i*per_thread, nr_entries_);
+    uint64_t end = std::min<uint64_t>(begin+per_thread, nr_entries_);
+    threads.emplace_back(&BLevel::RecoverEntries_, this, begin, end, &sizes[i]);
+  }
+  for (auto& t : threads)
+    t.join();
+  for (auto& s : sizes)
+    size_ += s;
+#endif
+#ifdef ASYNC_FLUSH
+  StartFlushThreads_();
 #endif
 }
 
 BLevel::~BLevel() {
+#ifdef ASYNC_FLUSH
+  // pending entries are still in their buffers, nothing is lost
+  StopFlushThreads_();
+#endif
   if (!pmem_file_.empty() && pmem_addr_) {
     pmem_unmap(pmem_addr_, mapped_len_);
-    std::filesystem::remove(pmem_file_);
   } else {
-    delete (uint8_t*)entries_;
+    delete (uint8_t*)meta_;
   }
 #ifndef NO_LOCK
-  if (lock_) delete lock_;
+  if (lock_) delete[] lock_;
+#endif
+#ifdef ASYNC_FLUSH
+  delete[] merging_;
+#endif
+}
+
+#ifdef ASYNC_FLUSH
+void BLevel::StartFlushThreads_() {
+  flush_stop_ = false;
+  for (int i = 0; i < FLUSH_THREADS; ++i)
+    flush_threads_.emplace_back(&BLevel::FlushThread_, this);
+}
+
+void BLevel::StopFlushThreads_() {
+  {
+    std::lock_guard<std::mutex> lock(flush_lock_);
+    flush_stop_ = true;
+  }
+  flush_cv_.notify_all();
+  for (auto& t : flush_threads_)
+    t.join();
+  flush_threads_.clear();
+}
+
+void BLevel::PushFlush_(uint64_t physical_idx) {
+  {
+    std::lock_guard<std::mutex> lock(flush_lock_);
+    flush_queue_.push_back(physical_idx);
+  }
+  flush_cv_.notify_one();
+}
+
+void BLevel::FlushThread_() {
+  std::vector<uint64_t> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(flush_lock_);
+      flush_cv_.wait(lock, [&]{ return flush_stop_ || !flush_queue_.empty(); });
+      if (flush_stop_)
+        return;
+      batch.swap(flush_queue_);
+    }
+    for (uint64_t idx : batch) {
+      Entry& entry = entries_[idx];
+      uint64_t keys[16];
+      uint64_t values[16];
+      int n;
+      {
+        std::lock_guard<EntryLock> lock(lock_[idx]);
+        // moved by expansion, flushed inline by writer, or queued twice
+        if (!entry.IsValid() || entry.FreeSlots() > FLUSH_AHEAD || Merging_(idx))
+          continue;
+        if (!entry.clevel.HasSetup()) {
+          // first leaf is built from buffer, nothing to merge
+          if (!entry.FlushToCLevel(&clevel_mem_))
+            LOG(Debug::WARNING, "no space for clevel, entry %lu kept in buffer", idx);
+          continue;
+        }
+        n = entry.SortedPairs(keys, values);
+        merging_[idx].store(true, std::memory_order_release);
+      }
+      // pairs stay in buffer, writers go on with the free slots
+      bool merged = entry.MergeToCLevel(&clevel_mem_, keys, values, n);
+      std::lock_guard<EntryLock> lock(lock_[idx]);
+      if (merged)
+        entry.DropMerged(&clevel_mem_, keys, values, n);
+      else
+        LOG(Debug::WARNING, "no space for clevel, entry %lu kept in buffer", idx);
+      merging_[idx].store(false, std::memory_order_release);
+    }
+    batch.clear();
+  }
+}
+#endif // ASYNC_FLUSH
+
+void BLevel::RemoveFile() {
+  if (!pmem_file_.empty())
+    std::filesystem::remove(pmem_file_);
+  clevel_mem_.RemoveFile();
+}
+
+void BLevel::RecoverEntries_(uint64_t begin, uint64_t end, std::atomic<size_t>* size) {
+  size_t cnt = 0;
+  for (uint64_t i = begin; i < end; ++i) {
+#if !defined(BUF_SORT) && !defined(BLEVEL_SORT_BUFFER)
+    entries_[i].buf.Recover();
+#endif
+    cnt += entries_[i].buf.entries;
+    if (entries_[i].clevel.HasSetup())
+      cnt += entries_[i].clevel.Size(&clevel_mem_);
+  }
+  size->store(cnt);
+}
+
+// persist entries layout, nr_entries is written last so that a blevel
+// with nr_entries == 0 is never used by recovery.
+void BLevel::PersistMeta_() {
+  meta_->physical_nr_entries = physical_nr_entries_;
+#ifdef BRANGE
+  meta_->interval_size = interval_size_;
+  memcpy(meta_->ranges, ranges_, sizeof(ranges_));
 #endif
+  for (size_t i = 0; i < sizeof(Meta); i += 64)
+    cacheline_flush((uint8_t*)meta_ + i);
+  memory_fence();
+  meta_->nr_entries = nr_entries_;
+  cacheline_flush(&meta_->nr_entries);
+  memory_fence();
 }
 
 void BLevel::ExpandPut_(ExpandData& data, uint64_t key, uint64_t value) {
-  if (data.buf_count == BLEVEL_EXPAND_BUF_KEY) {
+  if (data.buf_count == expand_buf_key_) {
     // buf full, add a new entry
     if (data.new_addr < data.max_addr) {
       int prefix_len = CommonPrefixBytes(data.entry_key, (data.new_addr == data.max_addr - 1) ? data.last_entry_key : key);
@@ -283,16 +578,24 @@ void BLevel::ExpandPut_(ExpandData& data, uint64_t key, uint64_t value) {
       Entry* entry = data.new_addr - 1;
 #ifdef BRANGE
       uint64_t entry_idx = ranges_[data.target_range].physical_entry_start+ranges_[data.target_range].entries-1;
-      std::lock_guard<std::shared_mutex> lock(lock_[entry_idx]);
+      std::unique_lock<EntryLock> lock(lock_[entry_idx]);
+#ifdef ASYNC_FLUSH
+      while (Merging_(entry_idx))
+        WaitMerge_(lock, entry_idx);
 #endif
-      for (int i = 0; i < data.buf_count; ++i)
-        entry->Put(&clevel_mem_, data.key_buf[i], data.value_buf[BLEVEL_EXPAND_BUF_KEY-i-1]);
+#endif
+      for (int i = 0; i < data.buf_count; ++i) {
+        if (!entry->Put(&clevel_mem_, data.key_buf[i], data.value_buf[MAX_EXPAND_BUF_KEY-i-1])) {
+          LOG(Debug::ERROR, "no space for clevel during expansion!");
+          exit(1);
+        }
+      }
       data.buf_count = 0;
     }
     data.max_key->store(key, std::memory_order_release);
   }
   data.key_buf[data.buf_count] = key;
-  data.value_buf[BLEVEL_EXPAND_BUF_KEY-data.buf_count-1] = value;
+  data.value_buf[MAX_EXPAND_BUF_KEY-data.buf_count-1] = value;
   data.buf_count++;
   data.size++;
 }
@@ -310,10 +613,18 @@ void BLevel::ExpandFinish_(ExpandData& data) {
       Entry* entry = data.new_addr - 1;
 #ifdef BRANGE
       uint64_t entry_idx = ranges_[data.target_range].physical_entry_start+ranges_[data.target_range].entries-1;
-      std::lock_guard<std::shared_mutex> lock(lock_[entry_idx]);
+      std::unique_lock<EntryLock> lock(lock_[entry_idx]);
+#ifdef ASYNC_FLUSH
+      while (Merging_(entry_idx))
+        WaitMerge_(lock, entry_idx);
 #endif
-      for (int i = 0; i < data.buf_count; ++i)
-        entry->Put(&clevel_mem_, data.key_buf[i], data.value_buf[BLEVEL_EXPAND_BUF_KEY-i-1]);
+#endif
+      for (int i = 0; i < data.buf_count; ++i) {
+        if (!entry->Put(&clevel_mem_, data.key_buf[i], data.value_buf[MAX_EXPAND_BUF_KEY-i-1])) {
+          LOG(Debug::ERROR, "no space for clevel during expansion!");
+          exit(1);
+        }
+      }
       data.buf_count = 0;
     }
     data.max_key->store(data.last_entry_key, std::memory_order_release);
@@ -321,19 +632,54 @@ void BLevel::ExpandFinish_(ExpandData& data) {
 }
 
 void BLevel::Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data) {
-  if (data.empty())
+  Expansion(data.data(), data.size(), 1);
+}
+
+template <typename KV>
+void BLevel::Expansion(const KV* data, size_t size, int partitions) {
+  if (size == 0)
     return;
 
-  ExpandData expand_meta(entries_, entries_ + physical_nr_entries_, 0);
-  expand_meta.last_entry_key = UINT64_MAX;
+  // every entry takes expand_buf_key_ pairs, so a partition of whole
+  // entries knows where its entries start
+  size_t entries = (size + expand_buf_key_ - 1) / expand_buf_key_;
+  partitions = std::max(1, std::min<int>(partitions, entries));
+  size_t per_partition = (entries + partitions - 1) / partitions * expand_buf_key_;
+  partitions = (size + per_partition - 1) / per_partition;
+  assert(entries <= physical_nr_entries_);
+
   std::atomic<uint64_t> entry_count(0);
-  std::atomic<uint64_t> max_key(0);
-  expand_meta.expanded_entries = &entry_count;
-  expand_meta.max_key = &max_key;
+  std::vector<ExpandData> expand_meta(partitions);
+  std::vector<std::atomic<uint64_t>> max_key(partitions);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < partitions; ++i) {
+    size_t begin = i * per_partition;
+    size_t end = std::min(size, begin + per_partition);
+    Entry* begin_addr = entries_ + begin / expand_buf_key_;
+    Entry* end_addr = (i == partitions - 1) ? entries_ + physical_nr_entries_
+                                            : entries_ + end / expand_buf_key_;
+    ExpandData& meta = expand_meta[i];
+    meta = ExpandData(begin_addr, end_addr, i == 0 ? 0 : KVKey(data[begin]));
+    meta.last_entry_key = (i == partitions - 1) ? UINT64_MAX : KVKey(data[end]);
+    meta.expanded_entries = &entry_count;
+    meta.max_key = &max_key[i];
+    auto expand = [this, data, begin, end, &meta]() {
+      for (size_t j = begin; j < end; ++j)
+        ExpandPut_(meta, KVKey(data[j]), KVValue(data[j]));
+      ExpandFinish_(meta);
+    };
+    if (partitions == 1)
+      expand();
+    else
+      threads.emplace_back(expand);
+  }
+  for (auto& t : threads)
+    t.join();
+  assert(entry_count == entries);
 
-  for (size_t i = 0; i < data.size(); ++i)
-    ExpandPut_(expand_meta, data[i].first, data[i].second);
-  ExpandFinish_(expand_meta);
+  size_t data_size = 0;
+  for (auto& meta : expand_meta)
+    data_size += meta.size;
 
 #ifdef BRANGE
   uint64_t range_size = entry_count / EXPAND_THREADS;
@@ -349,9 +695,9 @@ void BLevel::Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data) {
     intervals_[i] = (ranges_[i].entries+interval_size_-1) / interval_size_;
     size_per_interval_[i] = new std::atomic<size_t>[intervals_[i]]{};
     for (uint64_t j = 0; j < intervals_[i] - 1; ++j)
-      size_per_interval_[i][j].fetch_add(interval_size_*BLEVEL_EXPAND_BUF_KEY);
+      size_per_interval_[i][j].fetch_add(interval_size_*expand_buf_key_);
     size_per_interval_[i][intervals_[i]-1].fetch_add(
-      (ranges_[i].entries-(interval_size_*(intervals_[i]-1)))*BLEVEL_EXPAND_BUF_KEY);
+      (ranges_[i].entries-(interval_size_*(intervals_[i]-1)))*expand_buf_key_);
   }
   ranges_[EXPAND_THREADS].entries = -1;
   ranges_[EXPAND_THREADS].logical_entry_start = nr_entries_;
@@ -360,10 +706,14 @@ void BLevel::Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data) {
 #endif
 
   nr_entries_ = entry_count;
-  size_.fetch_add(expand_meta.size, std::memory_order_release);
-  assert(size_ == data.size());
+  size_.fetch_add(data_size, std::memory_order_release);
+  assert(size_ == size);
+  PersistMeta_();
 }
 
+template void BLevel::Expansion(const std::pair<uint64_t,uint64_t>*, size_t, int);
+template void BLevel::Expansion(const Pair*, size_t, int);
+
 #ifdef BRANGE
 void BLevel::PrepareExpansion(BLevel* old_blevel) {
   uint64_t sum_interval = 0;
@@ -451,8 +801,6 @@ void BLevel::Expansion(BLevel* old_blevel) {
   for (auto& t : expand_thread)
     t.join();
   FinishExpansion_();
-
-  expand_wait_cv.notify_all();
 }
 
 void BLevel::ExpandRange_(BLevel* old_blevel, int thread_id) {
@@ -484,7 +832,11 @@ void BLevel::ExpandRange_(BLevel* old_blevel, int thread_id) {
 
     for (uint64_t old_index = range_begin; old_index < range_end; ++old_index) {
 #ifndef NO_LOCK
-      std::lock_guard<std::shared_mutex> lock(old_blevel->lock_[old_index]);
+      std::unique_lock<EntryLock> lock(old_blevel->lock_[old_index]);
+#endif
+#ifdef ASYNC_FLUSH
+      while (old_blevel->Merging_(old_index))
+        old_blevel->WaitMerge_(lock, old_index);
 #endif
 #ifdef STREAMING_LOAD
       stream_load_entry(&in_mem_entry, &old_blevel->entries_[old_index]);
@@ -502,7 +854,7 @@ void BLevel::ExpandRange_(BLevel* old_blevel, int thread_id) {
         } while(biter.next());
         expand_meta.clevel_data_count += total_cnt - old_entry->buf.entries;
       } else if (!old_entry->buf.Empty()) {
-#ifdef BUF_SORT
+#if defined(BUF_SORT) || defined(BLEVEL_SORT_BUFFER)
         for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
           ExpandPut_(expand_meta, old_entry->key(i), old_entry->value(i));
 #else
@@ -523,9 +875,9 @@ void BLevel::ExpandRange_(BLevel* old_blevel, int thread_id) {
 
   intervals_[target_range] = (ranges_[target_range].entries+interval_size_-1)/interval_size_;
   for (uint64_t i = 0; i < intervals_[target_range] - 1; ++i)
-    size_per_interval_[target_range][i].fetch_add(interval_size_*BLEVEL_EXPAND_BUF_KEY);
+    size_per_interval_[target_range][i].fetch_add(interval_size_*expand_buf_key_);
   size_per_interval_[target_range][intervals_[target_range]-1].fetch_add(
-    (ranges_[target_range].entries-(interval_size_*(intervals_[target_range]-1)))*BLEVEL_EXPAND_BUF_KEY);
+    (ranges_[target_range].entries-(interval_size_*(intervals_[target_range]-1)))*expand_buf_key_);
 
   LOG(Debug::INFO, "data in clevel: %ld, clevel count: %ld, pairs per clevel: %lf",
       expand_meta.clevel_data_count, expand_meta.clevel_count, (double)expand_meta.clevel_data_count/(double)expand_meta.clevel_count);
@@ -540,6 +892,7 @@ void BLevel::FinishExpansion_() {
     assert(ranges_[i].start_key == entries_[ranges_[i].physical_entry_start].entry_key);
   }
   ranges_[EXPAND_THREADS].logical_entry_start = nr_entries_;
+  PersistMeta_();
   // for (uint64_t i = 0; i < nr_entries_ - 1; ++i) {
   //   assert(EntryKey(i) < EntryKey(i + 1));
   // }
@@ -577,7 +930,11 @@ void BLevel::Expansion(BLevel* old_blevel) {
   while (old_index < old_blevel->Entries()) {
 #ifndef NO_LOCK
     // lock before streaming load
-    std::lock_guard<std::shared_mutex> lock(old_blevel->lock_[old_index]);
+    std::unique_lock<EntryLock> lock(old_blevel->lock_[old_index]);
+#endif
+#ifdef ASYNC_FLUSH
+    while (old_blevel->Merging_(old_index))
+      old_blevel->WaitMerge_(lock, old_index);
 #endif
 #ifdef STREAMING_LOAD
     stream_load_entry(&in_mem_entry, &old_blevel->entries_[old_index]);
@@ -595,7 +952,7 @@ void BLevel::Expansion(BLevel* old_blevel) {
       } while(biter.next());
       expand_meta.clevel_data_count += total_cnt - old_entry->buf.entries;
     } else if (!old_entry->buf.Empty()) {
-#ifdef BUF_SORT
+#if defined(BUF_SORT) || defined(BLEVEL_SORT_BUFFER)
       for (uint64_t i = 0; i < old_entry->buf.entries; ++i)
         ExpandPut_(expand_meta, old_entry->key(i), old_entry->value(i));
 #else
@@ -612,12 +969,60 @@ void BLevel::Expansion(BLevel* old_blevel) {
 
   nr_entries_ = entry_count;
   size_.fetch_add(expand_meta.size);
+  PersistMeta_();
 
   LOG(Debug::INFO, "data in clevel: %ld, clevel count: %ld, pairs per clevel: %lf",
       expand_meta.clevel_data_count, expand_meta.clevel_count, (double)expand_meta.clevel_data_count/(double)expand_meta.clevel_count);
 }
 #endif // BRANGE
 
+#ifdef BRANGE
+// change logical index [begin, end] to physical index
+// after this, begin and end are in the same brange.
+int BLevel::ToPhysical_(uint64_t key, uint64_t& begin, uint64_t& end) const {
+  int target_range = FindBRangeByKey_(key);
+  // assert(begin < ranges_[target_range+1].logical_entry_start);
+  // assert(end >= ranges_[target_range].logical_entry_start);
+  begin = (begin >= ranges_[target_range].logical_entry_start) ?
+            GetPhysical_(ranges_[target_range], begin) :
+            ranges_[target_range].physical_entry_start;
+  end   = (end < ranges_[target_range+1].logical_entry_start) ?
+            GetPhysical_(ranges_[target_range], end) :
+            ranges_[target_range].physical_entry_start+ranges_[target_range].entries-1;
+  return target_range;
+}
+#endif // BRANGE
+
+void BLevel::PrefetchSearch(uint64_t key, uint64_t begin, uint64_t end) const {
+#ifdef BRANGE
+  ToPhysical_(key, begin, end);
+#endif
+  // small window is fetched at once, otherwise only the first probe
+  if (end - begin < 8) {
+    for (uint64_t i = begin; i <= end; ++i)
+      _mm_prefetch((const char*)&entries_[i], _MM_HINT_T0);
+  } else {
+    _mm_prefetch((const char*)&entries_[(begin + end) / 2], _MM_HINT_T0);
+  }
+}
+
+uint64_t BLevel::PrefetchEntry(uint64_t key, uint64_t begin, uint64_t end) const {
+#ifdef BRANGE
+  uint64_t idx = Find_(key, begin, end, nullptr);
+#else
+  uint64_t idx = Find_(key, begin, end);
+#endif
+  _mm_prefetch((const char*)&entries_[idx], _MM_HINT_T0);
+  _mm_prefetch((const char*)&entries_[idx] + 64, _MM_HINT_T0);
+  return idx;
+}
+
+void BLevel::PrefetchCLevel(uint64_t physical_idx) const {
+  const Entry& entry = entries_[physical_idx];
+  if (entry.clevel.HasSetup())
+    entry.clevel.PrefetchRoot(&clevel_mem_);
+}
+
 uint64_t BLevel::Find_(uint64_t key, uint64_t begin, uint64_t end
 #ifdef BRANGE
                        , std::atomic<size_t>** interval
@@ -633,17 +1038,7 @@ uint64_t BLevel::Find_(uint64_t key, uint64_t begin, uint64_t end
   // assert(key >= min_key);
   // assert(key <= max_key);
 #ifdef BRANGE
-  // change logical index [begin, end] to physical index
-  // after this, begin and end are in the same brange.
-  int target_range = FindBRangeByKey_(key);
-  // assert(begin < ranges_[target_range+1].logical_entry_start);
-  // assert(end >= ranges_[target_range].logical_entry_start);
-  begin = (begin >= ranges_[target_range].logical_entry_start) ?
-            GetPhysical_(ranges_[target_range], begin) :
-            ranges_[target_range].physical_entry_start;
-  end   = (end < ranges_[target_range+1].logical_entry_start) ?
-            GetPhysical_(ranges_[target_range], end) :
-            ranges_[target_range].physical_entry_start+ranges_[target_range].entries-1;
+  int target_range = ToPhysical_(key, begin, end);
 #endif // BRANGE
 
   // binary search
@@ -730,18 +1125,18 @@ bool BLevel::PutRange(uint64_t key, uint64_t value, int range, uint64_t end) {
 }
 
 bool BLevel::UpdateRange(uint64_t key, uint64_t value, int range, uint64_t end) {
-  uint64_t idx = Find_(key, range, end, nullptr);
+  uint64_t idx = FindByRange_(key, range, end, nullptr);
   return Update_(key, value, idx);
 }
 
 bool BLevel::GetRange(uint64_t key, uint64_t& value, int range, uint64_t end) const {
-  uint64_t idx = Find_(key, range, end, nullptr);
-  return Get_(key, value, idx);
+  uint64_t idx = FindByRange_(key, range, end, nullptr);
+  return Get_(key, value, idx, nullptr);
 }
 
 bool BLevel::DeleteRange(uint64_t key, uint64_t* value, int range, uint64_t end) {
   std::atomic<size_t>* interval_size;
-  uint64_t idx = Find_(key, range, end, &interval_size);
+  uint64_t idx = FindByRange_(key, range, end, &interval_size);
   return Delete_(key, value, idx, interval_size);
 }
 #endif // BRANGE
@@ -766,13 +1161,14 @@ bool BLevel::Update(uint64_t key, uint64_t value, uint64_t begin, uint64_t end)
   return Update_(key, value, idx);
 }
 
-bool BLevel::Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end) const {
+bool BLevel::Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end,
+                 bool* moved) const {
 #ifdef BRANGE
   uint64_t idx = Find_(key, begin, end, nullptr);
 #else
   uint64_t idx = Find_(key, begin, end);
 #endif
-  return Get_(key, value, idx);
+  return Get_(key, value, idx, moved);
 }
 
 bool BLevel::Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end) {
@@ -786,6 +1182,159 @@ bool BLevel::Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end)
 #endif
 }
 
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+// copy at most n pairs of entry with keys >= start_key in order, without
+// lock. false if the entry is moved by expansion.
+bool BLevel::ReadEntry_(uint64_t physical_idx, uint64_t start_key, size_t n,
+                        std::vector<std::pair<uint64_t,uint64_t>>& kv) const {
+  const Entry& entry = entries_[physical_idx];
+  std::pair<uint64_t,uint64_t> buf_kv[16];
+  while (true) {
+    kv.clear();
+    uint64_t version = lock_[physical_idx].ReadBegin();
+    bool valid = entry.IsValid();
+    // keys of clevel are built from the prefix of start
+    uint64_t start = std::max(start_key, entry.entry_key);
+    int cnt = 0;
+    int entries = std::min<int>(entry.buf.entries, entry.buf.max_entries);
+    for (int i = 0; i < entries; ++i) {
+      uint64_t key = entry.key(i);
+      if (key >= start)
+        buf_kv[cnt++] = {key, entry.value(i)};
+    }
+#ifdef ASYNC_FLUSH
+    if (valid && Merging_(physical_idx)) {
+      WaitMerge_(physical_idx);
+      continue;
+    }
+#endif
+    if (entry.clevel.HasSetup() &&
+        !entry.clevel.TryScan(&clevel_mem_, entry.entry_key, start, n, kv))
+      continue;
+    if (!lock_[physical_idx].ReadValidate(version))
+      continue;
+#if !defined(BUF_SORT) && !defined(BLEVEL_SORT_BUFFER)
+    std::sort(buf_kv, buf_kv + cnt);
+#endif
+    // pairs of buffer go first on equal keys, as Entry::Iter
+    kv.insert(kv.begin(), buf_kv, buf_kv + cnt);
+    std::inplace_merge(kv.begin(), kv.begin() + cnt, kv.end(),
+        [](const std::pair<uint64_t,uint64_t>& a, const std::pair<uint64_t,uint64_t>& b) {
+          return a.first < b.first;
+        });
+    if (kv.size() > n)
+      kv.resize(n);
+    return valid;
+  }
+}
+#endif
+
+// keys greater than bound are not scanned in this blevel, scan stops at
+// last_idx (physical index).
+bool BLevel::ScanEntries_(uint64_t& min_key, uint64_t max_key, uint64_t bound,
+                          size_t max_size, size_t& count,
+                          void (*callback)(uint64_t,uint64_t,void*), void* arg,
+                          uint64_t physical_idx, uint64_t last_idx, int range) const {
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+  static thread_local std::vector<std::pair<uint64_t,uint64_t>> kv;
+#endif
+  while (true) {
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+    // copied without lock, callback runs on the copy
+    if (!ReadEntry_(physical_idx, min_key, max_size - count, kv))
+      return false;
+    for (auto& p : kv) {
+      if (p.first > max_key)
+        return true;
+      if (p.first > bound) {
+        min_key = p.first;
+        return false;
+      }
+      callback(p.first, p.second, arg);
+      if (++count >= max_size || p.first == UINT64_MAX)
+        return true;
+      min_key = p.first + 1;
+    }
+#else
+    {
+#ifndef NO_LOCK
+      std::shared_lock<EntryLock> lock(lock_[physical_idx]);
+#endif
+#ifdef ASYNC_FLUSH
+      while (Merging_(physical_idx))
+        WaitMerge_(lock, physical_idx);
+#endif
+      const Entry* entry = &entries_[physical_idx];
+      if (!entry->IsValid())
+        return false;
+      Entry::Iter iter(entry, &clevel_mem_, min_key);
+      if (!iter.end()) {
+        do {
+          uint64_t key = iter.key();
+          if (key > max_key)
+            return true;
+          if (key > bound) {
+            min_key = key;
+            return false;
+          }
+          callback(key, iter.value(), arg);
+          if (++count >= max_size || key == UINT64_MAX)
+            return true;
+          min_key = key + 1;
+        } while (iter.next());
+      }
+    }
+#endif
+
+    if (physical_idx == last_idx) {
+      if (bound >= max_key)
+        return true;
+      min_key = bound + 1;
+      return false;
+    }
+#ifdef BRANGE
+    if (++physical_idx == ranges_[range].physical_entry_start + ranges_[range].entries) {
+      if (++range == EXPAND_THREADS)
+        return true;
+      physical_idx = ranges_[range].physical_entry_start;
+    }
+#else
+    physical_idx++;
+#endif
+  }
+}
+
+bool BLevel::Scan(uint64_t& min_key, uint64_t max_key, size_t max_size, size_t& count,
+                  void (*callback)(uint64_t,uint64_t,void*), void* arg,
+                  uint64_t begin, uint64_t end) const {
+#ifdef BRANGE
+  uint64_t idx = Find_(min_key, begin, end, nullptr);
+  uint64_t last_idx = ranges_[EXPAND_THREADS-1].physical_entry_start +
+                      ranges_[EXPAND_THREADS-1].entries - 1;
+  return ScanEntries_(min_key, max_key, UINT64_MAX, max_size, count, callback,
+                      arg, idx, last_idx, FindBRangeByKey_(min_key));
+#else
+  uint64_t idx = Find_(min_key, begin, end);
+  return ScanEntries_(min_key, max_key, UINT64_MAX, max_size, count, callback,
+                      arg, idx, nr_entries_ - 1, 0);
+#endif
+}
+
+#ifdef BRANGE
+bool BLevel::ScanRange(uint64_t& min_key, uint64_t max_key, size_t max_size, size_t& count,
+                       void (*callback)(uint64_t,uint64_t,void*), void* arg,
+                       int range) const {
+  // load max_key before expanded_entries, keys less than max_key are
+  // guaranteed to be in the expanded entries.
+  uint64_t expanded_max_key = expanded_max_key_[range].load(std::memory_order_acquire);
+  uint64_t end = ranges_[range].physical_entry_start +
+                 expanded_entries_[range].load(std::memory_order_acquire) - 1;
+  uint64_t idx = BinarySearch_(min_key, ranges_[range].physical_entry_start, end);
+  return ScanEntries_(min_key, max_key, expanded_max_key - 1, max_size, count,
+                      callback, arg, idx, end, range);
+}
+#endif // BRANGE
+
 size_t BLevel::CountCLevel() const {
   size_t cnt = 0;
   for (uint64_t i = 0; i < Entries(); ++i)
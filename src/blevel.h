@@ -4,34 +4,59 @@
 #include <cstdint>
 #include <cstddef>
 #include <vector>
+#include <mutex>
+#include <thread>
 #include <shared_mutex>
+#include <condition_variable>
 #include "combotree_config.h"
 #include "kvbuffer.h"
 #include "clevel.h"
 #include "pmem.h"
+#include "version_lock.h"
 
 namespace combotree {
 
 class Test;
 
+#ifdef OPTIMISTIC_LOCK
+using EntryLock = VersionLock;
+#else
+using EntryLock = std::shared_mutex;
+#endif
+
 class BLevel {
  private:
   struct __attribute__((aligned(64))) Entry {
     uint64_t entry_key;
     CLevel clevel;
+#ifdef BLEVEL_SORT_BUFFER
+    // sorted by permutation in header, smaller buf keeps entry in 128 bytes
+    SortBuffer<104,8> buf;  // contains 8 bytes header
+#else
     KVBuffer<112,8> buf;  // contains 2 bytes meta
+#endif
 
     Entry(uint64_t key, int prefix_len);
     Entry(uint64_t key, uint64_t value, int prefix_len);
 
+    // idx is in sorted order with BLEVEL_SORT_BUFFER
     ALWAYS_INLINE uint64_t key(int idx) const {
+#ifdef BLEVEL_SORT_BUFFER
+      return buf.sort_key(idx, entry_key);
+#else
       return buf.key(idx, entry_key);
+#endif
     }
 
     ALWAYS_INLINE uint64_t value(int idx) const {
+#ifdef BLEVEL_SORT_BUFFER
+      return buf.sort_value(idx);
+#else
       return buf.value(idx);
+#endif
     }
 
+    // false if buffer is full and clevel file can not grow
     bool Put(CLevel::MemControl* mem, uint64_t key, uint64_t value);
     bool Update(CLevel::MemControl* mem, uint64_t key, uint64_t value);
     bool Get(CLevel::MemControl* mem, uint64_t key, uint64_t& value) const;
@@ -39,12 +64,35 @@ class BLevel {
 
     // FIXME: flush and fence?
     void SetInvalid() { buf.meta = 0; }
-    bool IsValid()    { return buf.meta != 0; }
+    bool IsValid() const { return buf.meta != 0; }
+
+    // buffer is kept if clevel file can not grow
+    bool FlushToCLevel(CLevel::MemControl* mem);
+    // pairs of buffer in key order, return the count
+    int SortedPairs(uint64_t* keys, uint64_t* values) const;
+
+#ifdef ASYNC_FLUSH
+    // puts left before Put() has to flush inline
+    ALWAYS_INLINE int FreeSlots() const {
+      return (clevel.HasSetup() ? buf.max_entries : buf.max_entries - 1) - buf.entries;
+    }
+
+    ALWAYS_INLINE bool InBuffer(uint64_t key) const {
+      bool exist;
+      buf.Find(key, exist);
+      return exist;
+    }
 
-    void FlushToCLevel(CLevel::MemControl* mem);
+    // pairs copied by SortedPairs() are merged into clevel without the
+    // entry lock, then dropped from buffer with it
+    bool MergeToCLevel(CLevel::MemControl* mem, const uint64_t* keys,
+                       const uint64_t* values, int n);
+    void DropMerged(CLevel::MemControl* mem, const uint64_t* keys,
+                    const uint64_t* values, int n);
+#endif
 
     class Iter {
-#ifdef BUF_SORT
+#if defined(BUF_SORT) || defined(BLEVEL_SORT_BUFFER)
 #define entry_key(idx)    entry_->key((idx))
 #define entry_value(idx)  entry_->value((idx))
 #else
@@ -58,7 +106,7 @@ class BLevel {
       Iter(const Entry* entry, const CLevel::MemControl* mem)
         : entry_(entry), buf_idx_(0)
       {
-#ifndef BUF_SORT
+#if !defined(BUF_SORT) && !defined(BLEVEL_SORT_BUFFER)
         entry->buf.GetSortedIndex(sorted_index_);
 #endif
         if (entry_->clevel.HasSetup()) {
@@ -74,7 +122,7 @@ class BLevel {
       Iter(const Entry* entry, const CLevel::MemControl* mem, uint64_t start_key)
         : entry_(entry), buf_idx_(0)
       {
-#ifndef BUF_SORT
+#if !defined(BUF_SORT) && !defined(BLEVEL_SORT_BUFFER)
         entry->buf.GetSortedIndex(sorted_index_);
 #endif
         if (start_key <= entry->entry_key) {
@@ -141,7 +189,7 @@ class BLevel {
       bool has_clevel_;
       bool point_to_clevel_;
       CLevel::Iter citer_;
-#ifndef BUF_SORT
+#if !defined(BUF_SORT) && !defined(BLEVEL_SORT_BUFFER)
       int sorted_index_[16];
 #endif
 
@@ -223,20 +271,65 @@ class BLevel {
   static_assert(sizeof(BLevel::Entry) == 128, "sizeof(BLevel::Entry) != 128");
 
  public:
-  BLevel(size_t entries);
+  // upper bound of expand_buf_key
+  static constexpr int MAX_EXPAND_BUF_KEY = 16;
+  static_assert(BLEVEL_EXPAND_BUF_KEY <= MAX_EXPAND_BUF_KEY, "BLEVEL_EXPAND_BUF_KEY too large");
+
+  BLevel(size_t entries, int expand_buf_key = BLEVEL_EXPAND_BUF_KEY,
+         double entry_size_factor = ENTRY_SIZE_FACTOR,
+         size_t clevel_file_size = CLEVEL_PMEM_FILE_SIZE);
+  // reopen blevel and clevel files written before
+  BLevel(int file_id, int clevel_file_id, int expand_buf_key = BLEVEL_EXPAND_BUF_KEY,
+         size_t clevel_file_size = CLEVEL_PMEM_FILE_SIZE);
   ~BLevel();
 
+  // files are kept after destruction unless removed
+  void RemoveFile();
+  int FileId() const { return pmem_file_id_; }
+  int CLevelFileId() const { return clevel_mem_.FileId(); }
+
   bool Put(uint64_t key, uint64_t value, uint64_t begin, uint64_t end);
   bool Update(uint64_t key, uint64_t value, uint64_t begin, uint64_t end);
-  bool Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end) const;
+  // moved is set if the entry has been invalidated by expansion,
+  // the key should be looked up again after rerouting.
+  bool Get(uint64_t key, uint64_t& value, uint64_t begin, uint64_t end,
+           bool* moved = nullptr) const;
+  // return false if the entry has been invalidated by expansion
   bool Delete(uint64_t key, uint64_t* value, uint64_t begin, uint64_t end);
 
+  // stages of batched lookup, see ALevel::MultiGet. PrefetchEntry returns
+  // the physical index of the target entry.
+  void PrefetchSearch(uint64_t key, uint64_t begin, uint64_t end) const;
+  uint64_t PrefetchEntry(uint64_t key, uint64_t begin, uint64_t end) const;
+  void PrefetchCLevel(uint64_t physical_idx) const;
+  bool GetEntry(uint64_t key, uint64_t& value, uint64_t physical_idx, bool* moved) const {
+    return Get_(key, value, physical_idx, moved);
+  }
+
   bool PutRange(uint64_t key, uint64_t value, int range, uint64_t end);
   bool UpdateRange(uint64_t key, uint64_t value, int range, uint64_t end);
   bool GetRange(uint64_t key, uint64_t& value, int range, uint64_t end) const;
   bool DeleteRange(uint64_t key, uint64_t* value, int range, uint64_t end);
 
+  // scan pairs in [min_key, max_key] in sorted order until max_size pairs are
+  // collected. return true if scan is done, otherwise an invalid (expanded)
+  // entry is reached and min_key is set to the key to resume from.
+  bool Scan(uint64_t& min_key, uint64_t max_key, size_t max_size, size_t& count,
+            void (*callback)(uint64_t,uint64_t,void*), void* arg,
+            uint64_t begin, uint64_t end) const;
+#ifdef BRANGE
+  // scan the expanded part of range during expansion, return false and set
+  // min_key to the expanded max key if the expanded part is exhausted.
+  bool ScanRange(uint64_t& min_key, uint64_t max_key, size_t max_size, size_t& count,
+                 void (*callback)(uint64_t,uint64_t,void*), void* arg,
+                 int range) const;
+#endif
+
   void Expansion(std::vector<std::pair<uint64_t,uint64_t>>& data);
+  // build entries from sorted unique pairs, data is cut into `partitions`
+  // parts which are laid out in parallel. KV is std::pair or Pair.
+  template <typename KV>
+  void Expansion(const KV* data, size_t size, int partitions);
 #ifdef BRANGE
   bool IsKeyExpanded(uint64_t key, int& range, uint64_t& end) const;
   void PrepareExpansion(BLevel* old_blevel);
@@ -252,6 +345,8 @@ class BLevel {
   uint64_t Usage() const;
 
   ALWAYS_INLINE size_t Size() const { return size_; }
+  // Put() failed because clevel file can not grow
+  ALWAYS_INLINE bool NoSpace() const { return clevel_mem_.NoSpace(); }
   ALWAYS_INLINE size_t Entries() const { return nr_entries_; }
   ALWAYS_INLINE uint64_t EntryKey(int logical_idx) const {
 #ifdef BRANGE
@@ -261,6 +356,29 @@ class BLevel {
 #endif
   }
 
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+  // pairs of an entry in order, iterators hold a copy instead of the
+  // shared lock of the entry
+  class EntryCopy {
+   public:
+    EntryCopy() : pos_(0) {}
+
+    void Load(const BLevel* blevel, uint64_t physical_idx, uint64_t start_key) {
+      blevel->ReadEntry_(physical_idx, start_key, SIZE_MAX, kv_);
+      pos_ = 0;
+    }
+
+    ALWAYS_INLINE uint64_t key() const { return kv_[pos_].first; }
+    ALWAYS_INLINE uint64_t value() const { return kv_[pos_].second; }
+    ALWAYS_INLINE bool next() { return ++pos_ < kv_.size(); }
+    ALWAYS_INLINE bool end() const { return pos_ >= kv_.size(); }
+
+   private:
+    std::vector<std::pair<uint64_t,uint64_t>> kv_;
+    size_t pos_;
+  };
+#endif
+
   class Iter {
    public:
     Iter(const BLevel* blevel)
@@ -270,24 +388,11 @@ class BLevel {
 #endif
         locked_(false)
     {
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-      uint64_t last_idx = entry_idx_;
-#endif
-      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-        blevel_->lock_[last_idx].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-        last_idx = entry_idx_;
-#endif
-        new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      }
-      if (end()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
-      }
+      Enter_(0);
+      while (iter_.end() && NextIndex_())
+        Enter_(0);
+      if (end())
+        Leave_();
     }
 
     Iter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end)
@@ -306,29 +411,15 @@ class BLevel {
 #else
       entry_idx_ = blevel_->Find_(start_key, begin, end);
 #endif
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-      uint64_t last_idx = entry_idx_;
-#endif
-      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-        blevel_->lock_[last_idx].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-        last_idx = entry_idx_;
-#endif
-        new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      }
-      if (this->end()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
-      }
+      Enter_(start_key);
+      while (iter_.end() && NextIndex_())
+        Enter_(start_key);
+      if (this->end())
+        Leave_();
     }
 
     ~Iter() {
-      if (locked_)
-        blevel_->lock_[entry_idx_].unlock_shared();
+      Leave_();
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -340,28 +431,15 @@ class BLevel {
     }
 
     ALWAYS_INLINE bool next() {
-      if (!iter_.next()) {
-#ifndef NO_LOCK
-        uint64_t last_idx = entry_idx_;
-#endif
-        while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-          blevel_->lock_[last_idx].unlock_shared();
-          blevel_->lock_[entry_idx_].lock_shared();
-          last_idx = entry_idx_;
-#endif
-          new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-        }
-        if (end()) {
-          blevel_->lock_[entry_idx_].unlock_shared();
-          locked_ = false;
-          return false;
-        } else {
-          return true;
-        }
-      } else {
+      if (iter_.next())
         return true;
+      while (iter_.end() && NextIndex_())
+        Enter_(0);
+      if (end()) {
+        Leave_();
+        return false;
       }
+      return true;
     }
 
     ALWAYS_INLINE bool end() const {
@@ -373,6 +451,37 @@ class BLevel {
     }
 
    private:
+    // iterate entry_idx_ from start_key, the entry is locked shared until
+    // the next Enter_() or Leave_(). with OPTIMISTIC_LOCK its pairs are
+    // copied without lock instead.
+    ALWAYS_INLINE void Enter_(uint64_t start_key) {
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+      iter_.Load(blevel_, entry_idx_, start_key);
+#else
+      Leave_();
+#ifndef NO_LOCK
+      blevel_->lock_[entry_idx_].lock_shared();
+#ifdef ASYNC_FLUSH
+      while (blevel_->Merging_(entry_idx_)) {
+        blevel_->lock_[entry_idx_].unlock_shared();
+        blevel_->WaitMerge_(entry_idx_);
+        blevel_->lock_[entry_idx_].lock_shared();
+      }
+#endif
+      locked_idx_ = entry_idx_;
+      locked_ = true;
+#endif
+      new (&iter_) BLevel::Entry::Iter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
+#endif
+    }
+
+    ALWAYS_INLINE void Leave_() {
+      if (locked_) {
+        blevel_->lock_[locked_idx_].unlock_shared();
+        locked_ = false;
+      }
+    }
+
     ALWAYS_INLINE bool NextIndex_() {
 #ifdef BRANGE
       if (++entry_idx_ < range_end_) {
@@ -389,11 +498,18 @@ class BLevel {
 #endif
     }
 
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+    EntryCopy iter_;
+#else
     BLevel::Entry::Iter iter_;
+#endif
     const BLevel* blevel_;
     uint64_t entry_idx_;
+#ifdef BRANGE
     uint64_t range_end_;
     int range_;
+#endif
+    uint64_t locked_idx_;
     bool locked_;
   };
 
@@ -406,24 +522,11 @@ class BLevel {
 #endif
         locked_(false)
     {
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-      uint64_t last_idx = entry_idx_;
-#endif
-      new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-        blevel_->lock_[last_idx].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-        last_idx = entry_idx_;
-#endif
-        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-      }
-      if (end()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
-      }
+      Enter_(nullptr);
+      while (iter_.end() && NextIndex_())
+        Enter_(nullptr);
+      if (end())
+        Leave_();
     }
 
     NoSortIter(const BLevel* blevel, uint64_t start_key, uint64_t begin, uint64_t end)
@@ -442,29 +545,15 @@ class BLevel {
 #else
       entry_idx_ = blevel_->Find_(start_key, begin, end);
 #endif
-#ifndef NO_LOCK
-      blevel_->lock_[entry_idx_].lock_shared();
-      locked_ = true;
-      uint64_t last_idx = entry_idx_;
-#endif
-      new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-        blevel_->lock_[last_idx].unlock_shared();
-        blevel_->lock_[entry_idx_].lock_shared();
-        last_idx = entry_idx_;
-#endif
-        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, start_key);
-      }
-      if (this->end()) {
-        blevel_->lock_[entry_idx_].unlock_shared();
-        locked_ = false;
-      }
+      Enter_(&start_key);
+      while (iter_.end() && NextIndex_())
+        Enter_(&start_key);
+      if (this->end())
+        Leave_();
     }
 
     ~NoSortIter() {
-      if (locked_)
-        blevel_->lock_[entry_idx_].unlock_shared();
+      Leave_();
     }
 
     ALWAYS_INLINE uint64_t key() const {
@@ -476,28 +565,15 @@ class BLevel {
     }
 
     ALWAYS_INLINE bool next() {
-      if (!iter_.next()) {
-#ifndef NO_LOCK
-        uint64_t last_idx = entry_idx_;
-#endif
-        while (iter_.end() && NextIndex_()) {
-#ifndef NO_LOCK
-          blevel_->lock_[last_idx].unlock_shared();
-          blevel_->lock_[entry_idx_].lock_shared();
-          last_idx = entry_idx_;
-#endif
-          new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
-        }
-        if (end()) {
-          blevel_->lock_[entry_idx_].unlock_shared();
-          locked_ = false;
-          return false;
-        } else {
-          return true;
-        }
-      } else {
+      if (iter_.next())
         return true;
+      while (iter_.end() && NextIndex_())
+        Enter_(nullptr);
+      if (end()) {
+        Leave_();
+        return false;
       }
+      return true;
     }
 
     ALWAYS_INLINE bool end() const {
@@ -509,6 +585,40 @@ class BLevel {
     }
 
    private:
+    // iterate entry_idx_ from *start_key, or all of it if nullptr. the
+    // entry is locked shared until the next Enter_() or Leave_(). with
+    // OPTIMISTIC_LOCK its pairs are copied without lock instead.
+    ALWAYS_INLINE void Enter_(const uint64_t* start_key) {
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+      iter_.Load(blevel_, entry_idx_, start_key ? *start_key : 0);
+#else
+      Leave_();
+#ifndef NO_LOCK
+      blevel_->lock_[entry_idx_].lock_shared();
+#ifdef ASYNC_FLUSH
+      while (blevel_->Merging_(entry_idx_)) {
+        blevel_->lock_[entry_idx_].unlock_shared();
+        blevel_->WaitMerge_(entry_idx_);
+        blevel_->lock_[entry_idx_].lock_shared();
+      }
+#endif
+      locked_idx_ = entry_idx_;
+      locked_ = true;
+#endif
+      if (start_key)
+        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_, *start_key);
+      else
+        new (&iter_) BLevel::Entry::NoSortIter(&blevel_->entries_[entry_idx_], &blevel_->clevel_mem_);
+#endif
+    }
+
+    ALWAYS_INLINE void Leave_() {
+      if (locked_) {
+        blevel_->lock_[locked_idx_].unlock_shared();
+        locked_ = false;
+      }
+    }
+
     ALWAYS_INLINE bool NextIndex_() {
 #ifdef BRANGE
       if (++entry_idx_ < range_end_) {
@@ -525,13 +635,18 @@ class BLevel {
 #endif
     }
 
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+    EntryCopy iter_;
+#else
     BLevel::Entry::NoSortIter iter_;
+#endif
     const BLevel* blevel_;
     uint64_t entry_idx_;
 #ifdef BRANGE
     uint64_t range_end_;
     int range_;
 #endif
+    uint64_t locked_idx_;
     bool locked_;
   };
 
@@ -546,8 +661,8 @@ class BLevel {
   struct ExpandData {
     Entry* new_addr;
     Entry* max_addr;
-    uint64_t key_buf[BLEVEL_EXPAND_BUF_KEY];
-    uint64_t value_buf[BLEVEL_EXPAND_BUF_KEY];
+    uint64_t key_buf[MAX_EXPAND_BUF_KEY];
+    uint64_t value_buf[MAX_EXPAND_BUF_KEY];
     uint64_t clevel_data_count;
     uint64_t clevel_count;
     uint64_t size;
@@ -582,17 +697,31 @@ class BLevel {
   void* pmem_addr_;
   size_t mapped_len_;
   std::string pmem_file_;
+  int pmem_file_id_;
   static int file_id_;
 
   uint64_t entries_offset_;                     // pmem file offset
   Entry* __attribute__((aligned(64))) entries_; // current mmaped address
   size_t nr_entries_;                           // logical entries count
   size_t physical_nr_entries_;                  // physical entries count
+  int expand_buf_key_;                          // pairs per entry after expansion
   std::atomic<size_t> size_;
   CLevel::MemControl clevel_mem_;
 
 #ifndef NO_LOCK
-  std::shared_mutex* lock_;
+  EntryLock* lock_;
+#endif
+
+#ifdef ASYNC_FLUSH
+  // entries close to full, flushed to clevel before writers fill them
+  std::mutex flush_lock_;
+  std::condition_variable flush_cv_;
+  std::vector<uint64_t> flush_queue_;
+  std::vector<std::thread> flush_threads_;
+  bool flush_stop_;
+  // set with the entry lock while a flush thread merges the entry without
+  // it, clevel of the entry is not used by others meanwhile
+  std::atomic<bool>* merging_;
 #endif
 
 #ifdef BRANGE
@@ -614,6 +743,18 @@ class BLevel {
   static std::atomic<uint64_t> expanded_entries_[EXPAND_THREADS];
 #endif
 
+  // persistent header before entries_, nr_entries is written last
+  struct __attribute__((aligned(64))) Meta {
+    uint64_t nr_entries;
+    uint64_t physical_nr_entries;
+#ifdef BRANGE
+    uint64_t interval_size;
+    BRange ranges[EXPAND_THREADS+1];
+#endif
+  };
+
+  Meta* meta_;
+
   // function
 #ifdef BRANGE
   ALWAYS_INLINE int FindBRange_(uint64_t logical_idx) const {
@@ -647,6 +788,7 @@ class BLevel {
 #endif
 
 #ifdef BRANGE
+  int ToPhysical_(uint64_t key, uint64_t& begin, uint64_t& end) const;
   void ExpandRange_(BLevel* old_blevel, int thread_id);
   void FinishExpansion_();
   uint64_t Find_(uint64_t key, uint64_t begin, uint64_t end, std::atomic<size_t>** interval) const;
@@ -655,9 +797,41 @@ class BLevel {
 #else
   uint64_t Find_(uint64_t key, uint64_t begin, uint64_t end) const;
 #endif
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+  bool ReadEntry_(uint64_t physical_idx, uint64_t start_key, size_t n,
+                  std::vector<std::pair<uint64_t,uint64_t>>& kv) const;
+#endif
+  bool ScanEntries_(uint64_t& min_key, uint64_t max_key, uint64_t bound,
+                    size_t max_size, size_t& count,
+                    void (*callback)(uint64_t,uint64_t,void*), void* arg,
+                    uint64_t physical_idx, uint64_t last_idx, int range) const;
+  void PersistMeta_();
+  void RecoverEntries_(uint64_t begin, uint64_t end, std::atomic<size_t>* size);
   void ExpandSetup_(ExpandData& data);
   void ExpandPut_(ExpandData& data, uint64_t key, uint64_t value);
   void ExpandFinish_(ExpandData& data);
+#ifdef ASYNC_FLUSH
+  void StartFlushThreads_();
+  void StopFlushThreads_();
+  void PushFlush_(uint64_t physical_idx);
+  void FlushThread_();
+
+  ALWAYS_INLINE bool Merging_(uint64_t physical_idx) const {
+    return merging_[physical_idx].load(std::memory_order_acquire);
+  }
+
+  void WaitMerge_(uint64_t physical_idx) const {
+    while (Merging_(physical_idx))
+      std::this_thread::yield();
+  }
+
+  template <typename Lock>
+  void WaitMerge_(Lock& lock, uint64_t physical_idx) const {
+    lock.unlock();
+    WaitMerge_(physical_idx);
+    lock.lock();
+  }
+#endif
 
   ALWAYS_INLINE bool Put_(uint64_t key, uint64_t value, uint64_t physical_idx
 #ifdef BRANGE
@@ -666,11 +840,20 @@ class BLevel {
                                   ) {
     // assert(entries_[physical_idx].entry_key <= key);
 #ifndef NO_LOCK
-    std::lock_guard<std::shared_mutex> lock(lock_[physical_idx]);
+    std::unique_lock<EntryLock> lock(lock_[physical_idx]);
 #endif
-    if (!entries_[physical_idx].IsValid())
+#ifdef ASYNC_FLUSH
+    // a full buffer is flushed inline
+    while (Merging_(physical_idx) && entries_[physical_idx].FreeSlots() == 0)
+      WaitMerge_(lock, physical_idx);
+#endif
+    if (!entries_[physical_idx].IsValid() ||
+        !entries_[physical_idx].Put(&clevel_mem_, key, value))
       return false;
-    entries_[physical_idx].Put(&clevel_mem_, key, value);
+#ifdef ASYNC_FLUSH
+    if (entries_[physical_idx].FreeSlots() == FLUSH_AHEAD)
+      PushFlush_(physical_idx);
+#endif
     size_.fetch_add(1, std::memory_order_relaxed);
 #ifdef BRANGE
     interval_size->fetch_add(1, std::memory_order_relaxed);
@@ -680,20 +863,62 @@ class BLevel {
 
   ALWAYS_INLINE bool Update_(uint64_t key, uint64_t value, uint64_t physical_idx) const {
 #ifndef NO_LOCK
-    std::lock_guard<std::shared_mutex> lock(lock_[physical_idx]);
+    std::unique_lock<EntryLock> lock(lock_[physical_idx]);
+#endif
+#ifdef ASYNC_FLUSH
+    while (Merging_(physical_idx) && !entries_[physical_idx].InBuffer(key))
+      WaitMerge_(lock, physical_idx);
 #endif
     if (!entries_[physical_idx].IsValid())
       return false;
     return entries_[physical_idx].Update((CLevel::MemControl*)&clevel_mem_, key, value);
   }
 
-  ALWAYS_INLINE bool Get_(uint64_t key, uint64_t& value, uint64_t physical_idx) const {
+  ALWAYS_INLINE bool Get_(uint64_t key, uint64_t& value, uint64_t physical_idx,
+                          bool* moved) const {
+#if defined(OPTIMISTIC_LOCK) && !defined(NO_LOCK)
+    // search buffer and clevel without lock, retry if a writer intervened
+    const Entry& entry = entries_[physical_idx];
+    while (true) {
+      uint64_t version = lock_[physical_idx].ReadBegin();
+      bool valid = entry.IsValid();
+      bool exist;
+      int pos = entry.buf.Find(key, exist);
+      uint64_t buf_value = exist ? entry.value(pos) : 0;
+#ifdef ASYNC_FLUSH
+      if (valid && !exist && Merging_(physical_idx)) {
+        WaitMerge_(physical_idx);
+        continue;
+      }
+#endif
+      bool found = false;
+      uint64_t clevel_value = 0;
+      if (valid && !exist && entry.clevel.HasSetup() &&
+          !entry.clevel.TryGet(&clevel_mem_, key, clevel_value, found))
+        continue;
+      if (!lock_[physical_idx].ReadValidate(version))
+        continue;
+      if (!valid) {
+        if (moved) *moved = true;
+        return false;
+      }
+      value = exist ? buf_value : clevel_value;
+      return exist || found;
+    }
+#else
 #ifndef NO_LOCK
-    std::shared_lock<std::shared_mutex> lock(lock_[physical_idx]);
+    std::shared_lock<EntryLock> lock(lock_[physical_idx]);
 #endif
-    if (!entries_[physical_idx].IsValid())
+#ifdef ASYNC_FLUSH
+    while (Merging_(physical_idx) && !entries_[physical_idx].InBuffer(key))
+      WaitMerge_(lock, physical_idx);
+#endif
+    if (!entries_[physical_idx].IsValid()) {
+      if (moved) *moved = true;
       return false;
+    }
     return entries_[physical_idx].Get((CLevel::MemControl*)&clevel_mem_, key, value);
+#endif
   }
 
   ALWAYS_INLINE bool Delete_(uint64_t key, uint64_t* value, uint64_t physical_idx
@@ -702,11 +927,16 @@ class BLevel {
 #endif
                                   ) {
 #ifndef NO_LOCK
-    std::lock_guard<std::shared_mutex> lock(lock_[physical_idx]);
+    std::unique_lock<EntryLock> lock(lock_[physical_idx]);
+#endif
+#ifdef ASYNC_FLUSH
+    while (Merging_(physical_idx) && !entries_[physical_idx].InBuffer(key))
+      WaitMerge_(lock, physical_idx);
 #endif
     if (!entries_[physical_idx].IsValid())
       return false;
-    entries_[physical_idx].Delete(&clevel_mem_, key, value);
+    if (!entries_[physical_idx].Delete(&clevel_mem_, key, value))
+      return true;
     size_.fetch_sub(1, std::memory_order_relaxed);
 #ifdef BRANGE
     interval_size->fetch_sub(1, std::memory_order_relaxed);
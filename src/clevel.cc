@@ -5,6 +5,35 @@
 namespace combotree {
 
 int CLevel::MemControl::file_id_ = 0;
+std::atomic<uint64_t> CLevel::MemControl::next_id_(1);
+std::mutex CLevel::MemControl::live_lock_;
+std::unordered_map<uint64_t, CLevel::MemControl*> CLevel::MemControl::live_;
+
+// thread exits, what is left in its arenas goes back to their MemControls
+CLevel::MemControl::ThreadArenas::~ThreadArenas() {
+  std::lock_guard<std::mutex> lock(live_lock_);
+  for (auto& arena : arenas) {
+    auto it = live_.find(arena.first);
+    if (it != live_.end())
+      it->second->Release_(arena.second);
+  }
+}
+
+CLevel::MemControl::Arena& CLevel::MemControl::FindArena_(ThreadArenas& local) {
+  auto it = local.arenas.find(id_);
+  if (it == local.arenas.end()) {
+    // drop arenas of destroyed MemControls, their space is gone with them
+    {
+      std::lock_guard<std::mutex> lock(live_lock_);
+      for (auto i = local.arenas.begin(); i != local.arenas.end();)
+        i = live_.count(i->first) ? std::next(i) : local.arenas.erase(i);
+    }
+    it = local.arenas.emplace(id_, Arena{0, 0, 1, 0}).first;
+  }
+  local.last_id = id_;
+  local.last = &it->second;
+  return it->second;
+}
 
 void CLevel::Node::PutChild(MemControl* mem, uint64_t key, const Node* child) {
   assert(type == Type::INDEX);
@@ -33,7 +62,9 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
     leaf_buf.Put(pos, key, value);
     if (leaf_buf.entries == leaf_buf.max_entries) {
       // split
+      STATS_INC(CLEVEL_SPLIT);
       Node* new_node = mem->NewNode(Type::LEAF, leaf_buf.suffix_bytes);
+      assert(new_node);
       leaf_buf.CopyData(&new_node->leaf_buf, leaf_buf.entries/2);
       // set next pointer
       memcpy(new_node->next, next, sizeof(next));
@@ -44,6 +75,7 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
 
       if (parent == nullptr) {
         Node* new_root = mem->NewNode(Type::INDEX, leaf_buf.suffix_bytes);
+        assert(new_root);
         uint64_t tmp = (uint64_t)this - mem->BaseAddr();
         // set first_child before Put, beacause Put will do flush,
         // which contains first_child
@@ -76,7 +108,9 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
     if (new_child != child) {
       if (index_buf.entries == index_buf.max_entries) {
         // full, split
+        STATS_INC(CLEVEL_SPLIT);
         Node* new_node = mem->NewNode(Type::INDEX, index_buf.suffix_bytes);
+        assert(new_node);
         // copy data to new_node
         index_buf.CopyData(&new_node->index_buf, (index_buf.entries+1)/2);
         // set new_node.first_child
@@ -88,6 +122,7 @@ CLevel::Node* CLevel::Node::Put(MemControl* mem, uint64_t key, uint64_t value, N
 
         if (parent == nullptr) {
           Node* new_root = mem->NewNode(Type::INDEX, index_buf.suffix_bytes);
+          assert(new_root);
           uint64_t tmp = (uint64_t)this - mem->BaseAddr();
           memcpy(new_root->first_child, &tmp, sizeof(new_root->first_child));
           new_root->PutChild(mem, index_buf.sort_key((index_buf.entries+1)/2-1, key), new_node);
@@ -140,13 +175,110 @@ bool CLevel::Node::Get(MemControl* mem, uint64_t key, uint64_t& value) const {
   }
 }
 
-bool CLevel::Node::Delete(MemControl* mem, uint64_t key, uint64_t* value) {
-  Node* leaf = (Node*)FindLeaf(mem, key);
-  bool exist;
-  int pos = leaf->leaf_buf.Find(key, exist);
-  if (exist && value)
-    *value = leaf->leaf_buf.sort_value(pos);
-  return exist ? leaf->leaf_buf.Delete(pos) : true;
+// no assert, nodes may be changed or reused meanwhile
+const CLevel::Node* CLevel::Node::TryFindLeaf(const MemControl* mem, uint64_t key) const {
+  const Node* node = this;
+  // deeper than any tree, ends a cycle
+  for (int depth = 0; depth < 32; ++depth) {
+    if (!mem->Contains(node) || !node->Sane())
+      return nullptr;
+    Type type = node->type;
+    if (type == Type::LEAF)
+      return node;
+    if (type != Type::INDEX)
+      return nullptr;
+    bool exist;
+    int pos = node->index_buf.FindLE(key, exist);
+    node = node->GetChild(pos+1, mem->BaseAddr());
+  }
+  return nullptr;
+}
+
+// leaf is merged with its sibling if it underflows after delete,
+// child_pos is the position of this node in parent.
+bool CLevel::Node::Delete(MemControl* mem, uint64_t key, uint64_t* value, Node* parent, int child_pos) {
+  if (type == Type::LEAF) {
+    bool exist;
+    int pos = leaf_buf.Find(key, exist);
+    if (!exist)
+      return false;
+    if (value)
+      *value = leaf_buf.sort_value(pos);
+    leaf_buf.Delete(pos);
+    if (parent != nullptr && leaf_buf.entries <= leaf_buf.max_entries / 4)
+      parent->MergeChild(mem, child_pos);
+    return true;
+  } else if (type == Type::INDEX) {
+    bool exist;
+    int pos = index_buf.FindLE(key, exist);
+    return GetChild(pos+1, mem->BaseAddr())->Delete(mem, key, value, this, pos+1);
+  } else {
+    assert(0);
+    return false;
+  }
+}
+
+// merge leaf at child_pos with its right sibling, or left sibling if it is
+// the last child. data is moved to the left one, the right one is freed.
+// removing the separator from parent is the commit point, the merge is
+// logged in MemControl so that a crash around it is repaired on reopen.
+void CLevel::Node::MergeChild(MemControl* mem, int child_pos) {
+  assert(type == Type::INDEX);
+  if (index_buf.entries == 0)
+    return;
+
+  int right_pos = child_pos < index_buf.entries ? child_pos + 1 : child_pos;
+  Node* left = GetChild(right_pos-1, mem->BaseAddr());
+  Node* right = GetChild(right_pos, mem->BaseAddr());
+  assert(left->type == Type::LEAF && right->type == Type::LEAF);
+  if (left->leaf_buf.entries + right->leaf_buf.entries >= left->leaf_buf.max_entries)
+    return;
+
+  mem->LogMerge(this, left, right);
+  // keys in right are all bigger than keys in left
+  left->leaf_buf.Append(right->leaf_buf);
+  // separator of right child
+  index_buf.Delete(right_pos-1);
+  memcpy(left->next, right->next, sizeof(left->next));
+  cacheline_flush(left->next);
+  memory_fence();
+  // right is freed after the log is cleared, a crash in between only
+  // leaks it
+  mem->ClearMerge();
+  mem->FreeNode(right);
+}
+
+// this is the parent of a merge interrupted by a crash
+void CLevel::Node::RecoverMerge(MemControl* mem, Node* left, Node* right,
+                                uint64_t left_header) {
+  uint64_t right_off = (uint64_t)right - mem->BaseAddr();
+  for (int i = 0; i < index_buf.entries; ++i) {
+    if (index_buf.sort_value(i) == right_off) {
+      // separator is still there, drop pairs appended to left
+      left->leaf_buf.header = left_header;
+      cacheline_flush(&left->leaf_buf.header);
+      memory_fence();
+      return;
+    }
+  }
+  if (left->GetNext(mem->BaseAddr()) == right) {
+    memcpy(left->next, right->next, sizeof(left->next));
+    cacheline_flush(left->next);
+    memory_fence();
+  }
+  mem->FreeNode(right);
+}
+
+void CLevel::MemControl::RecoverMerge_() {
+  if (meta_->merge_right == 0)
+    return;
+  Node* parent = (Node*)(meta_->merge_parent + base_addr_);
+  Node* left = (Node*)(meta_->merge_left + base_addr_);
+  Node* right = (Node*)(meta_->merge_right + base_addr_);
+  parent->RecoverMerge(this, left, right, meta_->merge_left_header);
+  meta_->merge_right = 0;
+  cacheline_flush(meta_);
+  memory_fence();
 }
 
 
@@ -157,18 +289,23 @@ CLevel::CLevel()
   root_[0] = 1;
 }
 
-void CLevel::Setup(MemControl* mem, int suffix_len) {
+bool CLevel::Setup(MemControl* mem, int suffix_len) {
   uint64_t new_root = (uint64_t)mem->NewNode(Node::Type::LEAF, suffix_len);
+  if (new_root == 0)
+    return false;
   // set next to NULL: set LSB to 1
   ((Node*)new_root)->next[0] = 1;
   new_root -= mem->BaseAddr();
   memcpy(root_, &new_root, sizeof(root_));
   cacheline_flush(&root_);
   memory_fence();
+  return true;
 }
 
-void CLevel::Setup(MemControl* mem, KVBuffer<112,8>& blevel_buf) {
+bool CLevel::Setup(MemControl* mem, KVBuffer<112,8>& blevel_buf) {
   Node* new_root = mem->NewNode(Node::Type::LEAF, blevel_buf.suffix_bytes);
+  if (new_root == nullptr)
+    return false;
   assert(sizeof(new_root->leaf_buf.buf) == sizeof(blevel_buf.buf));
   new_root->leaf_buf.FromKVBuffer(blevel_buf);
   cacheline_flush(new_root);
@@ -180,10 +317,89 @@ void CLevel::Setup(MemControl* mem, KVBuffer<112,8>& blevel_buf) {
   memcpy(root_, &new_root, sizeof(root_));
   cacheline_flush(&root_);
   memory_fence();
+  return true;
+}
+
+bool CLevel::Setup(MemControl* mem, SortBuffer<104,8>& blevel_buf) {
+  Node* new_root = mem->NewNode(Node::Type::LEAF, blevel_buf.suffix_bytes);
+  if (new_root == nullptr)
+    return false;
+  new_root->leaf_buf.FromSortBuffer(blevel_buf);
+  cacheline_flush(new_root);
+  cacheline_flush((uint8_t*)new_root+64);
+
+  // set next to NULL: set LSB to 1
+  new_root->next[0] = 1;
+  new_root = (Node*)((uint64_t)new_root - mem->BaseAddr());
+  memcpy(root_, &new_root, sizeof(root_));
+  cacheline_flush(&root_);
+  memory_fence();
+  return true;
+}
+
+size_t CLevel::Size(const MemControl* mem) const {
+  size_t size = 0;
+  const Node* leaf = root(mem->BaseAddr())->FindHead(mem);
+  while (leaf != nullptr) {
+    size += leaf->leaf_buf.entries;
+    leaf = leaf->GetNext(mem->BaseAddr());
+  }
+  return size;
+}
+
+bool CLevel::Delete(MemControl* mem, uint64_t key, uint64_t* value) {
+  Node* old_root = root(mem->BaseAddr());
+  if (!old_root->Delete(mem, key, value, nullptr, 0))
+    return false;
+  // only one child left, use it as new root
+  if (old_root->type == Node::Type::INDEX && old_root->index_buf.entries == 0) {
+    uint64_t new_root = (uint64_t)old_root->GetChild(0, mem->BaseAddr()) - mem->BaseAddr();
+    memcpy(root_, &new_root, sizeof(root_));
+    cacheline_flush(&root_);
+    memory_fence();
+    mem->FreeNode(old_root);
+  }
+  return true;
+}
+
+bool CLevel::TryGet(const MemControl* mem, uint64_t key, uint64_t& value, bool& found) const {
+  const Node* leaf = root(mem->BaseAddr())->TryFindLeaf(mem, key);
+  if (leaf == nullptr)
+    return false;
+  int pos = leaf->leaf_buf.Find(key, found);
+  if (found)
+    value = leaf->leaf_buf.sort_value(pos);
+  return true;
+}
+
+bool CLevel::TryScan(const MemControl* mem, uint64_t prefix_key, uint64_t start_key, size_t n,
+                     std::vector<std::pair<uint64_t,uint64_t>>& kv) const {
+  const Node* leaf = root(mem->BaseAddr())->TryFindLeaf(mem, start_key);
+  if (leaf == nullptr)
+    return false;
+  // more leaves than nodes is a cycle
+  uint64_t steps = mem->Usage() / sizeof(Node);
+  while (leaf != nullptr && n != 0) {
+    if (!mem->Contains(leaf) || leaf->type != Node::Type::LEAF || !leaf->Sane() ||
+        steps-- == 0)
+      return false;
+    for (int i = 0; i < leaf->leaf_buf.entries && n != 0; ++i) {
+      uint64_t key = leaf->leaf_buf.sort_key(i, prefix_key);
+      if (key >= start_key) {
+        kv.emplace_back(key, leaf->leaf_buf.sort_value(i));
+        n--;
+      }
+    }
+    leaf = leaf->GetNext(mem->BaseAddr());
+  }
+  return true;
 }
 
 bool CLevel::Put(MemControl* mem, uint64_t key, uint64_t value) {
   Node* old_root = root(mem->BaseAddr());
+  // nodes of a split are taken before anything is changed
+  if (!mem->Prepare(old_root->Height(mem) + 1))
+    return false;
   Node* new_root = old_root->Put(mem, key, value, nullptr);
   if (old_root != new_root) {
     new_root = (Node*)((uint64_t)new_root - mem->BaseAddr());
@@ -194,4 +410,40 @@ bool CLevel::Put(MemControl* mem, uint64_t key, uint64_t value) {
   return true;
 }
 
+// runs of keys falling in the same leaf are merged with one flush and
+// fence. a full leaf is split by Put() and the rest goes on from the root.
+bool CLevel::PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values, int n) {
+  // every key may split, the root may split once more
+  if (!mem->Prepare(n * (root(mem->BaseAddr())->Height(mem) + 2)))
+    return false;
+  int i = 0;
+  while (i < n) {
+    Node* node = root(mem->BaseAddr());
+    bool has_bound = false;
+    uint64_t bound = 0;
+    while (node->type != Node::Type::LEAF) {
+      assert(node->type == Node::Type::INDEX);
+      bool exist;
+      int pos = node->index_buf.FindLE(keys[i], exist);
+      if (pos + 1 < node->index_buf.entries) {
+        has_bound = true;
+        bound = node->index_buf.sort_key(pos+1, keys[i]);
+      }
+      node = node->GetChild(pos+1, mem->BaseAddr());
+    }
+
+    int end = i;
+    while (end < n && (!has_bound || keys[end] < bound))
+      end++;
+    i += node->leaf_buf.PutSorted(&keys[i], &values[i], end - i);
+    if (i < end) {
+      // nodes are prepared above
+      if (!Put(mem, keys[i], values[i]))
+        assert(0);
+      i++;
+    }
+  }
+  return true;
+}
+
 } // namespace combotree
\ No newline at end of file
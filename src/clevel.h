@@ -1,9 +1,18 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <libpmem.h>
 #include <filesystem>
 #include <atomic>
+#include <vector>
+#include <utility>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "kvbuffer.h"
 #include "sortbuffer.h"
 #include "combotree_config.h"
@@ -45,8 +54,10 @@ class __attribute__((packed)) CLevel {
     Node* Put(MemControl* mem, uint64_t key, uint64_t value, Node* parent);
     bool Update(MemControl* mem, uint64_t key, uint64_t value);
     bool Get(MemControl* mem, uint64_t key, uint64_t& value) const;
-    bool Delete(MemControl* mem, uint64_t key, uint64_t* value);
+    bool Delete(MemControl* mem, uint64_t key, uint64_t* value, Node* parent, int child_pos);
     void PutChild(MemControl* mem, uint64_t key, const Node* child);
+    void MergeChild(MemControl* mem, int child_pos);
+    void RecoverMerge(MemControl* mem, Node* left, Node* right, uint64_t left_header);
 
     ALWAYS_INLINE Node* GetChild(int pos, uint64_t base_addr) const {
       if (pos == 0)
@@ -64,6 +75,14 @@ class __attribute__((packed)) CLevel {
       memcpy(next, &tmp, sizeof(next));
     }
 
+    // for readers without lock, nullptr if a node being changed is met
+    const Node* TryFindLeaf(const MemControl* mem, uint64_t key) const;
+
+    // header read without lock keeps accesses inside the node
+    ALWAYS_INLINE bool Sane() const {
+      return leaf_buf.suffix_bytes <= 8 && leaf_buf.entries <= leaf_buf.max_entries;
+    }
+
     ALWAYS_INLINE const Node* FindLeaf(const MemControl* mem, uint64_t key) const {
       const Node* node = this;
       while (node->type != Type::LEAF) {
@@ -75,6 +94,16 @@ class __attribute__((packed)) CLevel {
       return node;
     }
 
+    // levels down to leaves, a split takes at most one node per level
+    // and a new root
+    ALWAYS_INLINE int Height(const MemControl* mem) const {
+      int height = 1;
+      for (const Node* node = this; node->type != Type::LEAF;
+           node = node->GetChild(0, mem->BaseAddr()))
+        height++;
+      return height;
+    }
+
     ALWAYS_INLINE const Node* FindHead(const MemControl* mem) const {
       const Node* node = this;
       while (node->type != Type::LEAF) {
@@ -92,56 +121,97 @@ class __attribute__((packed)) CLevel {
   class MemControl {
    public:
     MemControl(void* base_addr, size_t size)
-      : pmem_file_(""), pmem_addr_(0), base_addr_((uint64_t)base_addr),
-        cur_addr_((uintptr_t)base_addr), end_addr_((uint8_t*)base_addr+size)
-    {}
+      : pmem_file_(""), pmem_file_id_(-1), pmem_addr_(0), base_addr_((uint64_t)base_addr),
+        meta_(nullptr), cur_addr_((uintptr_t)base_addr), end_addr_((uint8_t*)base_addr+size),
+        reserved_addr_((uintptr_t)end_addr_), id_(next_id_++)
+    {
+      Register_();
+    }
 
     MemControl(std::string pmem_file, size_t file_size)
-      : pmem_file_(pmem_file+std::to_string(file_id_++))
+      : pmem_file_id_(file_id_++), id_(next_id_++)
     {
+      pmem_file_ = pmem_file + std::to_string(pmem_file_id_);
 #ifdef USE_LIBPMEM
-      int is_pmem;
       std::filesystem::remove(pmem_file_);
-      pmem_addr_ = pmem_map_file(pmem_file_.c_str(), file_size + 64,
-                   PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
-      assert(is_pmem == 1);
-      if (pmem_addr_ == nullptr) {
-        perror("CLevel::MemControl(): pmem_map_file");
-        exit(1);
-      }
-
-      // aligned at 64-bytes
-      base_addr_ = (uint64_t)pmem_addr_;
-      if ((base_addr_ & (uintptr_t)63) != 0) {
-        // not aligned
-        base_addr_ = (base_addr_+64) & ~(uintptr_t)63;
-      }
-
-      cur_addr_ = base_addr_;
-      end_addr_ = (uint8_t*)pmem_addr_ + mapped_len_;
+      grow_size_ = file_size;
+      // start small, the file grows on demand
+      MapFile_(std::min<size_t>(file_size, CLEVEL_PMEM_INIT_SIZE), true);
+
+      meta_ = (Meta*)base_addr_;
+      meta_->reserved_offset = sizeof(Meta);
+      meta_->free_head = 1;
+      meta_->merge_right = 0;
+      cacheline_flush(meta_);
+      memory_fence();
+      cur_addr_ = base_addr_ + sizeof(Meta);
+      reserved_addr_ = cur_addr_.load();
 #else // libvmmalloc
       pmem_file_ = "";
       pmem_addr_ = nullptr;
+      meta_ = nullptr;
       base_addr_ = (uint64_t)new (std::align_val_t{64}) uint8_t[file_size];
       assert((base_addr_ & 63) == 0);
       cur_addr_  = base_addr_;
       end_addr_  = (uint8_t*)base_addr_ + file_size;
+      reserved_addr_ = (uintptr_t)end_addr_;
 #endif
+      Register_();
+    }
+
+    // reopen file created before, nodes allocated after the last
+    // persistent reserved address are discarded.
+    MemControl(std::string pmem_file, int file_id, size_t grow_size)
+      : pmem_file_(pmem_file+std::to_string(file_id)), pmem_file_id_(file_id),
+        id_(next_id_++)
+    {
+      file_id_ = std::max(file_id_, file_id + 1);
+      grow_size_ = grow_size;
+      MapFile_(std::filesystem::file_size(pmem_file_), false);
+
+      meta_ = (Meta*)base_addr_;
+      cur_addr_ = base_addr_ + std::max<uint64_t>(meta_->reserved_offset, sizeof(Meta));
+      reserved_addr_ = cur_addr_.load();
+      free_head_ = meta_->free_head;
+      for (uint64_t node = free_head_; !(node & 1);
+           node = READ_SIX_BYTE(((Node*)(node + base_addr_))->next))
+        free_cnt_++;
+      RecoverMerge_();
+      Register_();
     }
 
     ~MemControl() {
+      Unregister_();
       if (!pmem_file_.empty() && pmem_addr_) {
-        pmem_unmap(pmem_addr_, mapped_len_);
-        std::filesystem::remove(pmem_file_);
+        pmem_unmap(pmem_addr_, reserved_len_);
       } else {
         delete (uint8_t*)base_addr_;
       }
     }
 
+    // the mapping is still valid until destruction
+    void RemoveFile() {
+      if (!pmem_file_.empty())
+        std::filesystem::remove(pmem_file_);
+    }
+
+    // nullptr if the file can not grow
     CLevel::Node* NewNode(Node::Type type, int suffix_len) {
       assert(suffix_len > 0 && suffix_len <= 8);
-      assert((uint8_t*)cur_addr_.load() + sizeof(CLevel::Node) < end_addr_);
-      CLevel::Node* ret = (CLevel::Node*)cur_addr_.fetch_add(sizeof(CLevel::Node));
+      Arena& arena = Arena_();
+      if (arena.free_cnt == 0 && free_cnt_.load(std::memory_order_relaxed) != 0)
+        PopFree_(arena);
+      CLevel::Node* ret;
+      if (arena.free_cnt != 0) {
+        ret = (CLevel::Node*)(arena.free + base_addr_);
+        arena.free = READ_SIX_BYTE(ret->next);
+        arena.free_cnt--;
+      } else {
+        ret = (CLevel::Node*)Allocate_(arena);
+        if (ret == nullptr)
+          return nullptr;
+        STATS_ADD(ALLOC_BYTES, sizeof(CLevel::Node));
+      }
       ret->type = type;
       ret->leaf_buf.header = 0x0123456789AB'0000UL;
       ret->leaf_buf.suffix_bytes = suffix_len;
@@ -151,6 +221,69 @@ class __attribute__((packed)) CLevel {
       return ret;
     }
 
+    // make sure the next n NewNode() of this thread succeed
+    bool Prepare(int n) {
+      Arena& arena = Arena_();
+      if (Available_(arena) >= n)
+        return Prepared_();
+      if (free_cnt_.load(std::memory_order_relaxed) != 0) {
+        PopFree_(arena);
+        if (Available_(arena) >= n)
+          return Prepared_();
+      }
+      // rest of the chunk joins the free nodes, then a new chunk is taken
+      ChunkToFree_(arena);
+      size_t size = std::max<size_t>(CLEVEL_ARENA_SIZE, (n - arena.free_cnt) * sizeof(CLevel::Node));
+      uintptr_t addr = Grab_(size);
+      if (addr == 0)
+        return false;
+      arena.cur = addr;
+      arena.end = addr + size;
+      return Prepared_();
+    }
+
+    // put node into the persistent free list, node must be unreachable
+    void FreeNode(CLevel::Node* node) {
+      std::lock_guard<std::mutex> lock(free_lock_);
+      node->type = Node::Type::INVALID;
+      memcpy(node->next, &free_head_, sizeof(node->next));
+      cacheline_flush(node);
+      memory_fence();
+      free_head_ = (uint64_t)node - base_addr_;
+      if (meta_) {
+        meta_->free_head = free_head_;
+        cacheline_flush(&meta_->free_head);
+        memory_fence();
+      }
+      free_cnt_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // record a leaf merge before it changes anything, a crash before
+    // ClearMerge() is rolled back or finished on reopen. merges of all
+    // clevels in the file share the record, so they are serialized.
+    void LogMerge(Node* parent, Node* left, Node* right) {
+      merge_lock_.lock();
+      if (!meta_)
+        return;
+      meta_->merge_parent = (uint64_t)parent - base_addr_;
+      meta_->merge_left = (uint64_t)left - base_addr_;
+      meta_->merge_left_header = left->leaf_buf.header;
+      cacheline_flush(meta_);
+      memory_fence();
+      meta_->merge_right = (uint64_t)right - base_addr_;
+      cacheline_flush(meta_);
+      memory_fence();
+    }
+
+    void ClearMerge() {
+      if (meta_) {
+        meta_->merge_right = 0;
+        cacheline_flush(meta_);
+        memory_fence();
+      }
+      merge_lock_.unlock();
+    }
+
     uint64_t BaseAddr() const {
       return base_addr_;
     }
@@ -159,19 +292,306 @@ class __attribute__((packed)) CLevel {
       return (uint64_t)cur_addr_.load() - base_addr_;
     }
 
+    int FileId() const {
+      return pmem_file_id_;
+    }
+
+    // node lies in allocated space, checked by readers without lock
+    ALWAYS_INLINE bool Contains(const void* node) const {
+      return (uintptr_t)node >= base_addr_ &&
+             (uintptr_t)node + sizeof(CLevel::Node) <= cur_addr_.load(std::memory_order_relaxed);
+    }
+
+    // a Prepare() failed to grow the file and none succeeded since
+    bool NoSpace() const {
+      return no_space_.load(std::memory_order_relaxed);
+    }
+
+    // nodes in the persistent free list, not counting those held by threads
+    size_t FreeNodes() const {
+      return free_cnt_.load(std::memory_order_relaxed);
+    }
+
    private:
+    // persistent allocation bound, updated every RESERVE_SIZE bytes,
+    // head of free node list, LSB == 1 means NULL, and the leaf merge in
+    // progress, valid if merge_right != 0.
+    struct __attribute__((aligned(64))) Meta {
+      uint64_t reserved_offset;
+      uint64_t free_head;
+      uint64_t merge_parent;
+      uint64_t merge_left;
+      uint64_t merge_left_header;
+      uint64_t merge_right;
+    };
+
+    static constexpr size_t RESERVE_SIZE = 1024*1024;
+
     std::string pmem_file_;
+    int pmem_file_id_;
     void* pmem_addr_;
     size_t mapped_len_;
+    size_t reserved_len_ = 0;
+    size_t grow_size_ = 0;
     uint64_t base_addr_;
+    Meta* meta_;
     std::atomic<uintptr_t> cur_addr_;
     void* end_addr_;
+    std::atomic<uintptr_t> reserved_addr_;
+    std::atomic<bool> no_space_{false};
+    std::mutex reserve_lock_;
+    std::mutex free_lock_;
+    std::mutex merge_lock_;
+    uint64_t free_head_ = 1;
+    std::atomic<size_t> free_cnt_{0};
+    uint64_t id_;
     static int file_id_;
+    static std::atomic<uint64_t> next_id_;
+
+    // nodes are handed out from per-thread chunks of CLEVEL_ARENA_SIZE
+    // bytes, so threads don't contend on cur_addr_ and nodes allocated
+    // by the same thread stay close. a thread has an arena for each
+    // MemControl, what is left in it goes back to the free list when the
+    // thread exits. free nodes are taken from the persistent list in
+    // batches of FREE_BATCH.
+    struct Arena {
+      uintptr_t cur;
+      uintptr_t end;
+      uint64_t free;      // offset of first free node, linked by next
+      int free_cnt;
+    };
+
+    // arenas of a thread by id of MemControl, the last one is cached
+    struct ThreadArenas {
+      std::unordered_map<uint64_t, Arena> arenas;
+      uint64_t last_id = 0;
+      Arena* last = nullptr;
+      ~ThreadArenas();
+    };
+
+    static constexpr int FREE_BATCH = 16;
+
+    // MemControls not destroyed yet, by id
+    static std::mutex live_lock_;
+    static std::unordered_map<uint64_t, MemControl*> live_;
+
+    void Register_() {
+      std::lock_guard<std::mutex> lock(live_lock_);
+      live_[id_] = this;
+    }
+
+    void Unregister_() {
+      std::lock_guard<std::mutex> lock(live_lock_);
+      live_.erase(id_);
+    }
+
+    ALWAYS_INLINE Arena& Arena_() {
+      static thread_local ThreadArenas local;
+      if (local.last_id == id_)
+        return *local.last;
+      return FindArena_(local);
+    }
+
+    Arena& FindArena_(ThreadArenas& local);
+
+    // unused nodes of the chunk are moved to the free nodes of arena
+    void ChunkToFree_(Arena& arena) {
+      for (; arena.cur != arena.end; arena.cur += sizeof(CLevel::Node)) {
+        CLevel::Node* node = (CLevel::Node*)arena.cur;
+        memcpy(node->next, &arena.free, sizeof(node->next));
+        arena.free = arena.cur - base_addr_;
+        arena.free_cnt++;
+        STATS_ADD(ALLOC_BYTES, sizeof(CLevel::Node));
+      }
+    }
+
+    // 0 if the file can not grow
+    ALWAYS_INLINE uintptr_t Allocate_(Arena& arena) {
+      // chunk of Prepare() is used up first
+      if (arena.cur == arena.end) {
+#if CLEVEL_ARENA_SIZE > 0
+        uintptr_t addr = Grab_(CLEVEL_ARENA_SIZE);
+        if (addr == 0)
+          return 0;
+        arena.cur = addr;
+        arena.end = addr + CLEVEL_ARENA_SIZE;
+#else
+        return Grab_(sizeof(CLevel::Node));
+#endif
+      }
+      uintptr_t ret = arena.cur;
+      arena.cur += sizeof(CLevel::Node);
+      return ret;
+    }
+
+    void RecoverMerge_();
+
+    // nodes freed by others may make room again after a failed grow
+    ALWAYS_INLINE bool Prepared_() {
+      if (no_space_.load(std::memory_order_relaxed))
+        no_space_.store(false, std::memory_order_relaxed);
+      return true;
+    }
+
+    ALWAYS_INLINE int Available_(const Arena& arena) const {
+      return arena.free_cnt + (arena.end - arena.cur) / sizeof(CLevel::Node);
+    }
+
+    // move a batch of free nodes to arena, the head is persisted once.
+    // nodes of a batch not used before a crash are leaked.
+    void PopFree_(Arena& arena) {
+      std::lock_guard<std::mutex> lock(free_lock_);
+      uint64_t first = free_head_;
+      CLevel::Node* last = nullptr;
+      int cnt = 0;
+      while (!(free_head_ & 1) && cnt < FREE_BATCH) {
+        last = (CLevel::Node*)(free_head_ + base_addr_);
+        free_head_ = READ_SIX_BYTE(last->next);
+        cnt++;
+      }
+      if (cnt == 0)
+        return;
+      if (meta_) {
+        meta_->free_head = free_head_;
+        cacheline_flush(&meta_->free_head);
+        memory_fence();
+      }
+      // in front of free nodes the thread still holds
+      memcpy(last->next, &arena.free, sizeof(last->next));
+      arena.free = first;
+      arena.free_cnt += cnt;
+      free_cnt_.fetch_sub(cnt, std::memory_order_relaxed);
+    }
+
+    // put all nodes held by arena into the persistent free list, the head is
+    // persisted once. nodes are leaked if crash before that.
+    void Release_(Arena& arena) {
+      ChunkToFree_(arena);
+      if (arena.free_cnt == 0)
+        return;
+      std::lock_guard<std::mutex> lock(free_lock_);
+      CLevel::Node* last = nullptr;
+      for (uint64_t node = arena.free; !(node & 1); node = READ_SIX_BYTE(last->next)) {
+        last = (CLevel::Node*)(node + base_addr_);
+        last->type = Node::Type::INVALID;
+        cacheline_flush(last);
+      }
+      memcpy(last->next, &free_head_, sizeof(last->next));
+      cacheline_flush(last);
+      memory_fence();
+      free_head_ = arena.free;
+      if (meta_) {
+        meta_->free_head = free_head_;
+        cacheline_flush(&meta_->free_head);
+        memory_fence();
+      }
+      free_cnt_.fetch_add(arena.free_cnt, std::memory_order_relaxed);
+      arena.free = 1;
+      arena.free_cnt = 0;
+    }
+
+    // 0 if the file can not grow
+    ALWAYS_INLINE uintptr_t Grab_(size_t size) {
+      uintptr_t ret = cur_addr_.load();
+      do {
+        if (ret + size > reserved_addr_.load(std::memory_order_acquire) &&
+            !Reserve_(ret + size))
+          return 0;
+      } while (!cur_addr_.compare_exchange_weak(ret, ret + size));
+      return ret;
+    }
+
+    bool Reserve_(uintptr_t addr) {
+      std::lock_guard<std::mutex> lock(reserve_lock_);
+      uintptr_t reserved = reserved_addr_.load();
+      if (addr <= reserved)
+        return true;
+      while (reserved < addr)
+        reserved += RESERVE_SIZE;
+      if (reserved > (uintptr_t)end_addr_) {
+        if (!Grow_(reserved)) {
+          no_space_.store(true, std::memory_order_relaxed);
+          return false;
+        }
+      }
+      meta_->reserved_offset = reserved - base_addr_;
+      cacheline_flush(&meta_->reserved_offset);
+      memory_fence();
+      reserved_addr_.store(reserved, std::memory_order_release);
+      return true;
+    }
+
+    // reserve address space of CLEVEL_PMEM_MAX_SIZE and map the file at
+    // its beginning, so the file can grow without moving base_addr_.
+    void MapFile_(size_t file_size, bool create) {
+      reserved_len_ = std::max<size_t>(file_size, CLEVEL_PMEM_MAX_SIZE);
+      pmem_addr_ = mmap(nullptr, reserved_len_, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (pmem_addr_ == MAP_FAILED) {
+        perror("CLevel::MemControl(): mmap");
+        exit(1);
+      }
+      // mmap is page aligned, so nodes are aligned at 64-bytes
+      base_addr_ = (uint64_t)pmem_addr_;
+      mapped_len_ = 0;
+      if (!MapRange_(file_size, create ? O_CREAT | O_EXCL : 0))
+        exit(1);
+    }
+
+    // extend file to size and map [mapped_len_, size) after current mapping
+    bool MapRange_(size_t size, int flags) {
+      int fd = open(pmem_file_.c_str(), O_RDWR | flags, 0666);
+      if (fd < 0) {
+        perror("CLevel::MemControl: open");
+        return false;
+      }
+      // posix_fallocate returns the error instead of setting errno
+      int err = posix_fallocate(fd, 0, size);
+      if (err != 0) {
+        fprintf(stderr, "CLevel::MemControl: fallocate %s to %lu bytes: %s\n",
+                pmem_file_.c_str(), size, strerror(err));
+        close(fd);
+        return false;
+      }
+      uint8_t* addr = (uint8_t*)pmem_addr_ + mapped_len_;
+      void* ret = mmap(addr, size - mapped_len_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED_VALIDATE | MAP_SYNC | MAP_FIXED, fd, mapped_len_);
+      if (ret == MAP_FAILED)
+        ret = mmap(addr, size - mapped_len_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, mapped_len_);
+      close(fd);
+      if (ret == MAP_FAILED) {
+        perror("CLevel::MemControl: mmap");
+        return false;
+      }
+#ifdef PERSIST_PMEM
+      assert(pmem_is_pmem(ret, size - mapped_len_));
+#endif
+      mapped_len_ = size;
+      end_addr_ = (uint8_t*)pmem_addr_ + mapped_len_;
+      return true;
+    }
+
+    // grow file until addr is covered, called with reserve_lock_. the
+    // size doubles, by at most grow_size_ each time.
+    bool Grow_(uintptr_t addr) {
+      size_t size = mapped_len_;
+      if (!pmem_file_.empty()) {
+        while ((uintptr_t)pmem_addr_ + size < addr)
+          size += std::min(size, grow_size_);
+      }
+      if (pmem_file_.empty() || size > reserved_len_) {
+        fprintf(stderr, "CLevel::MemControl: out of space, usage %lu\n", Usage());
+        return false;
+      }
+      return MapRange_(size, 0);
+    }
   };
 
   class Iter {
    public:
-    Iter() {}
+    // end iterator until it is set up by placement new
+    Iter() : mem_(nullptr), prefix_key(0), cur_(nullptr), idx_(0) {}
 
     Iter(const CLevel* clevel, const MemControl* mem, uint64_t prefix_key, uint64_t start_key)
       : mem_(mem), prefix_key(prefix_key)
@@ -236,7 +656,8 @@ class __attribute__((packed)) CLevel {
 
   class NoSortIter {
    public:
-    NoSortIter() {}
+    // end iterator until it is set up by placement new
+    NoSortIter() : mem_(nullptr), prefix_key(0), cur_(nullptr), idx_(0) {}
 
     NoSortIter(const CLevel* clevel, const MemControl* mem, uint64_t prefix_key, uint64_t start_key)
       : mem_(mem), prefix_key(prefix_key)
@@ -291,9 +712,16 @@ class __attribute__((packed)) CLevel {
 
   CLevel();
   ALWAYS_INLINE bool HasSetup() const { return !(root_[0] & 1); };
-  void Setup(MemControl* mem, int suffix_len);
-  void Setup(MemControl* mem, KVBuffer<48+64,8>& buf);
+  // count pairs in leaves
+  size_t Size(const MemControl* mem) const;
+  // Setup, Put and PutBatch return false and change nothing if the
+  // file can not grow
+  bool Setup(MemControl* mem, int suffix_len);
+  bool Setup(MemControl* mem, KVBuffer<48+64,8>& buf);
+  bool Setup(MemControl* mem, SortBuffer<104,8>& buf);
   bool Put(MemControl* mem, uint64_t key, uint64_t value);
+  // keys are ascending
+  bool PutBatch(MemControl* mem, const uint64_t* keys, const uint64_t* values, int n);
 
   ALWAYS_INLINE bool Update(MemControl* mem, uint64_t key, uint64_t value) {
     return root(mem->BaseAddr())->Update(mem, key, value);
@@ -303,8 +731,20 @@ class __attribute__((packed)) CLevel {
     return root(mem->BaseAddr())->Get(mem, key, value);
   }
 
-  ALWAYS_INLINE bool Delete(MemControl* mem, uint64_t key, uint64_t* value) {
-    return root(mem->BaseAddr())->Delete(mem, key, value);
+  // return false if key not exist
+  bool Delete(MemControl* mem, uint64_t key, uint64_t* value);
+
+  // reads without lock, the caller validates them against the version of
+  // the entry. false if a node being changed is met, then retry.
+  bool TryGet(const MemControl* mem, uint64_t key, uint64_t& value, bool& found) const;
+  // append at most n pairs with keys >= start_key to kv in order
+  bool TryScan(const MemControl* mem, uint64_t prefix_key, uint64_t start_key, size_t n,
+               std::vector<std::pair<uint64_t,uint64_t>>& kv) const;
+
+  ALWAYS_INLINE void PrefetchRoot(const MemControl* mem) const {
+    const char* node = (const char*)root(mem->BaseAddr());
+    _mm_prefetch(node, _MM_HINT_T0);
+    _mm_prefetch(node + 64, _MM_HINT_T0);
   }
 
  private:
@@ -1,4 +1,5 @@
 #include <filesystem>
+#include <algorithm>
 #include <thread>
 #include <memory>
 #include <iostream>
@@ -9,37 +10,124 @@
 #include "blevel.h"
 #include "manifest.h"
 #include "pmemkv.h"
+#include "value_log.h"
+#include "string_key.h"
 #include "debug.h"
+#include "stats.h"
 
 namespace combotree {
 
 std::mutex log_mutex;
 int64_t expand_time = 0;
 
-ComboTree::ComboTree(std::string pool_dir, size_t pool_size, bool create)
-    : pool_dir_(pool_dir), pool_size_(pool_size), alevel_(nullptr),
-      blevel_(nullptr), old_blevel_(nullptr), pmemkv_(nullptr), permit_delete_(true)
+ComboTree::Options::Options()
+    : expand_buf_key(BLEVEL_EXPAND_BUF_KEY), expansion_factor(EXPANSION_FACTOR),
+      pmemkv_threshold(PMEMKV_THRESHOLD), entry_size_factor(ENTRY_SIZE_FACTOR),
+      span(DEFAULT_SPAN), clevel_file_size(CLEVEL_PMEM_FILE_SIZE), value_log_size(0),
+      string_keys(false)
+{}
+
+ComboTree::ComboTree(std::string pool_dir, size_t pool_size, bool create,
+                     const Options& options)
+    : pool_dir_(pool_dir), pool_size_(pool_size), options_(options), alevel_(nullptr),
+      blevel_(nullptr), old_blevel_(nullptr), pmemkv_(nullptr), permit_delete_(true),
+      need_sleep_(false), expand_epoch_(0), expand_request_(false), expand_stop_(false),
+      value_log_(nullptr)
 {
+  if (options_.expand_buf_key <= 0 || options_.expand_buf_key > BLevel::MAX_EXPAND_BUF_KEY ||
+      options_.expansion_factor <= 0 || options_.entry_size_factor < 1.0 ||
+      options_.span <= 0 || options_.clevel_file_size == 0) {
+    LOG(Debug::ERROR, "invalid options!");
+    exit(1);
+  }
+  // long strings are kept in the value log
+  if (options_.string_keys && options_.value_log_size == 0) {
+    LOG(Debug::ERROR, "string_keys requires value_log_size!");
+    exit(1);
+  }
   ValidPoolDir_();
-  manifest_ = new Manifest(pool_dir_);
-  pmemkv_ = new PmemKV(manifest_->PmemKVPath());
-  status_ = State::USING_PMEMKV;
+  manifest_ = new Manifest(pool_dir_, PMEMOBJ_MIN_POOL, create);
+  if (create || !manifest_->IsComboTree()) {
+    // may be unvalid after a former ComboTree in this process migrated
+    PmemKV::SetWriteValid();
+    PmemKV::SetReadValid();
+    pmemkv_ = new PmemKV(manifest_->PmemKVPath(), SIZE, create);
+    status_ = State::USING_PMEMKV;
+  } else {
+#ifndef USE_LIBPMEM
+    LOG(Debug::ERROR, "recovery requires USE_LIBPMEM!");
+    exit(1);
+#endif
+    // old entries are invalidated while moving, can not roll back
+    if (manifest_->IsExpanding()) {
+      LOG(Debug::ERROR, "can not recover from a crash during expansion!");
+      exit(1);
+    }
+    blevel_ = new BLevel(manifest_->BLevelFileId(), manifest_->CLevelFileId(),
+                         options_.expand_buf_key, options_.clevel_file_size);
+    old_blevel_ = blevel_;
+    alevel_ = new ALevel(blevel_, options_.span);
+    status_ = State::USING_COMBO_TREE;
+    LOG(Debug::INFO, "recover combotree, size is %ld, entry count is %ld",
+        blevel_->Size(), blevel_->Entries());
+  }
+
+  if (options_.value_log_size) {
+    value_log_ = new ValueLog(pool_dir_ + "value_log", options_.value_log_size, create);
+    if (!create) {
+      // live records are those the tree points to
+      if (options_.string_keys) {
+        std::vector<uint64_t> heads;
+        Scan_(0, UINT64_MAX, SIZE_MAX, [](uint64_t key, uint64_t head, void* heads) {
+          if (!string_key::IsInline(key))
+            ((std::vector<uint64_t>*)heads)->push_back(head);
+        }, &heads);
+        for (uint64_t head : heads)
+          string_key::Recover(value_log_, head);
+      } else {
+        Scan_(0, UINT64_MAX, SIZE_MAX, [](uint64_t, uint64_t handle, void* log) {
+          ((ValueLog*)log)->Recover(handle);
+        }, value_log_);
+      }
+      value_log_->FinishRecovery();
+    }
+    value_gc_thread_ = std::thread(&ComboTree::ValueGCWorker_, this);
+  }
 
 #ifdef BRANGE
   std::cout << "EXPAND_THREADS:        " << EXPAND_THREADS << std::endl;
 #else
   std::cout << "BRANGE = 0" << std::endl;
 #endif
-#ifdef BACKGROUD_EXPAND
-  std::cout << "BACKGROUD_EXPAND = 1" << std::endl;
+#ifdef BACKGROUND_EXPAND
+  std::cout << "BACKGROUND_EXPAND = 1" << std::endl;
+  expand_thread_ = std::thread(&ComboTree::ExpandWorker_, this);
 #endif
-  std::cout << "BLEVEL_EXPAND_BUF_KEY: " << BLEVEL_EXPAND_BUF_KEY << std::endl;
-  std::cout << "EXPANSION_FACTOR:      " << EXPANSION_FACTOR << std::endl;
-  std::cout << "PMEMKV_THRESHOLD:      " << PMEMKV_THRESHOLD << std::endl;
-  std::cout << "ENTRY_SIZE_FACTOR:     " << ENTRY_SIZE_FACTOR << std::endl;
-  std::cout << "DEFAULT_SPAN:          " << DEFAULT_SPAN << std::endl;
+  std::cout << "BLEVEL_EXPAND_BUF_KEY: " << options_.expand_buf_key << std::endl;
+  std::cout << "EXPANSION_FACTOR:      " << options_.expansion_factor << std::endl;
+  std::cout << "PMEMKV_THRESHOLD:      " << options_.pmemkv_threshold << std::endl;
+  std::cout << "ENTRY_SIZE_FACTOR:     " << options_.entry_size_factor << std::endl;
+  std::cout << "CLEVEL_PMEM_FILE_SIZE: " << options_.clevel_file_size << std::endl;
+  std::cout << "MULTI_GROUP_SIZE:      " << MULTI_GROUP_SIZE << std::endl;
+  if (value_log_)
+    std::cout << "VALUE_LOG_SIZE:        " << options_.value_log_size << std::endl;
+#ifdef LEARNED_ALEVEL
+  std::cout << "LEARNED_ALEVEL = 1" << std::endl;
+  std::cout << "ALEVEL_MAX_ERROR:      " << ALEVEL_MAX_ERROR << std::endl;
+#else
+  std::cout << "DEFAULT_SPAN:          " << options_.span << std::endl;
+#endif
+  std::cout << "PMEM_DIR:              " << PMEM_DIR << std::endl;
   std::cout << "FLUSH_METHOD:          " << FLUSH_METHOD << std::endl;
   std::cout << "FENCH_METHOD:          " << FENCE_METHOD << std::endl;
+#ifdef PERSIST_DRAM
+  std::cout << "PERSIST_DRAM = 1" << std::endl;
+  std::cout << "DRAM_FLUSH_LATENCY:    " << DRAM_FLUSH_LATENCY << std::endl;
+  std::cout << "DRAM_FENCE_LATENCY:    " << DRAM_FENCE_LATENCY << std::endl;
+#endif
+#ifdef PERSIST_MSYNC
+  std::cout << "PERSIST_MSYNC = 1" << std::endl;
+#endif
 
 #ifdef USE_LIBPMEM
   std::cout << "USE_LIBPMEM = 1" << std::endl;
@@ -49,6 +137,10 @@ ComboTree::ComboTree(std::string pool_dir, size_t pool_size, bool create)
   std::cout << "BUF_SORT = 1" << std::endl;
 #endif
 
+#ifdef BLEVEL_SORT_BUFFER
+  std::cout << "BLEVEL_SORT_BUFFER = 1" << std::endl;
+#endif
+
 #ifdef STREAMING_STORE
   std::cout << "STREAMING_STORE = 1" << std::endl;
 #endif
@@ -61,12 +153,36 @@ ComboTree::ComboTree(std::string pool_dir, size_t pool_size, bool create)
   std::cout << "NO_LOCK = 1" << std::endl;
 #endif
 
+#ifdef OPTIMISTIC_LOCK
+  std::cout << "OPTIMISTIC_LOCK = 1" << std::endl;
+#endif
+
+#ifdef STATISTICS
+  std::cout << "STATISTICS = 1" << std::endl;
+#endif
+
+#ifdef ASYNC_FLUSH
+  std::cout << "ASYNC_FLUSH = 1, threads " << FLUSH_THREADS << std::endl;
+#endif
+
 #ifdef NDEBUG
   std::cout << "NDEBUG = 1" << std::endl;
 #endif
 }
 
 ComboTree::~ComboTree() {
+#ifdef BACKGROUND_EXPAND
+  {
+    std::lock_guard<std::mutex> lock(expand_lock_);
+    expand_stop_ = true;
+  }
+  expand_cv_.notify_one();
+  expand_thread_.join();
+#endif
+  if (value_log_) {
+    value_log_->Stop();
+    value_gc_thread_.join();
+  }
   while (permit_delete_.load() == false) {
     std::this_thread::sleep_for(std::chrono::microseconds(10));
   }
@@ -74,6 +190,8 @@ ComboTree::~ComboTree() {
   if (alevel_) delete alevel_;
   if (blevel_) delete blevel_;
   if (old_blevel_ && old_blevel_ != blevel_) delete old_blevel_;
+  if (value_log_) delete value_log_;
+  delete manifest_;
 }
 
 size_t ComboTree::Size() const {
@@ -106,6 +224,22 @@ int64_t ComboTree::CLevelTime() const {
   return blevel_->CLevelTime();
 }
 
+ComboTree::Stats ComboTree::GetStats() const {
+  uint64_t c[stats::COUNTER_NUM];
+  stats::Snapshot(c);
+  Stats s;
+  s.flush             = c[stats::FLUSH];
+  s.fence             = c[stats::FENCE];
+  s.flush_to_clevel   = c[stats::FLUSH_TO_CLEVEL];
+  s.clevel_split      = c[stats::CLEVEL_SPLIT];
+  s.alloc_bytes       = c[stats::ALLOC_BYTES];
+  s.expansion         = c[stats::EXPANSION];
+  s.expansion_time_us = c[stats::EXPANSION_TIME_US];
+  s.expand_wait       = c[stats::EXPAND_WAIT];
+  s.put_retry         = c[stats::PUT_RETRY];
+  return s;
+}
+
 void ComboTree::ChangeToComboTree_() {
   State tmp = State::USING_PMEMKV;
   // must change status first
@@ -113,25 +247,89 @@ void ComboTree::ChangeToComboTree_() {
     return;
 
   permit_delete_.store(false);
-  PmemKV::SetWriteUnvalid();
-  // wait until no ref to pmemkv
-  // get will not ref, so get still work during migration
-  // FIXME: have race conditions! maybe one writer thread haven't ref yet.
-  while (!pmemkv_->NoWriteRef()) ;
   LOG(Debug::INFO, "start to migrate data from pmemkv to combotree...");
 
+  // writers keep appending to pmemkv log, records after the snapshot are
+  // replayed once blevel is built
+  std::vector<std::pair<uint64_t,uint64_t>> exist_kv;
+  size_t replay_from = pmemkv_->Snapshot(exist_kv);
+
+  blevel_ = new BLevel(exist_kv.size(), options_.expand_buf_key,
+                       options_.entry_size_factor, options_.clevel_file_size);
+  old_blevel_ = blevel_;
+  blevel_->Expansion(exist_kv.data(), exist_kv.size(),
+                     std::max(1U, std::thread::hardware_concurrency()));
+  FinishMigration_(replay_from);
+}
+
+bool ComboTree::BulkLoad(const Pair* data, size_t size) {
+  for (size_t i = 1; i < size; ++i) {
+    if (data[i].key <= data[i-1].key) {
+      LOG(Debug::ERROR, "keys are not sorted or not unique!");
+      return false;
+    }
+  }
+  if (size < options_.pmemkv_threshold) {
+    for (size_t i = 0; i < size; ++i)
+      Put(data[i].key, data[i].value);
+    return true;
+  }
+
+  State tmp = State::USING_PMEMKV;
+  if (pmemkv_ == nullptr || pmemkv_->Size() != 0 ||
+      !status_.compare_exchange_strong(tmp, State::PMEMKV_TO_COMBO_TREE, std::memory_order_release)) {
+    LOG(Debug::ERROR, "tree is not empty!");
+    return false;
+  }
+
+  permit_delete_.store(false);
   std::vector<std::pair<uint64_t,uint64_t>> exist_kv;
-  pmemkv_->Scan(0, UINT64_MAX, UINT64_MAX, exist_kv);
+  size_t replay_from = pmemkv_->Snapshot(exist_kv);
+  // a writer may have put before status is changed, its write stays in pmemkv
+  if (!exist_kv.empty()) {
+    pmemkv_->Unpin();
+    tmp = State::PMEMKV_TO_COMBO_TREE;
+    status_.compare_exchange_strong(tmp, State::USING_PMEMKV, std::memory_order_release);
+    permit_delete_.store(true);
+    LOG(Debug::ERROR, "tree is not empty!");
+    return false;
+  }
+  LOG(Debug::INFO, "start to bulk load %ld pairs", size);
 
-  blevel_ = new BLevel(exist_kv.size());
+  // size blevel once for all data, no expansion is needed
+  blevel_ = new BLevel(size, options_.expand_buf_key,
+                       options_.entry_size_factor, options_.clevel_file_size);
   old_blevel_ = blevel_;
-  blevel_->Expansion(exist_kv);
+  blevel_->Expansion(data, size, std::max(1U, std::thread::hardware_concurrency()));
+  FinishMigration_(replay_from);
+  return true;
+}
 
+// blevel_ is built, switch from pmemkv to combotree
+void ComboTree::FinishMigration_(size_t replay_from) {
   {
     std::lock_guard<std::shared_mutex> lock(alevel_lock_);
-    alevel_ = new ALevel(blevel_);
+    alevel_ = new ALevel(blevel_, options_.span);
   }
+
+  // writers wait until status is changed. their writes since the snapshot
+  // are in pmemkv log, which is recovered if crash before manifest changes.
+  PmemKV::SetWriteUnvalid();
+  while (!pmemkv_->NoWriteRef()) ;
+  size_t cnt = pmemkv_->Replay(replay_from, [](uint64_t key, uint64_t value, bool deleted, void* arg) {
+    ComboTree* tree = (ComboTree*)arg;
+    uint64_t old_value;
+    if (deleted)
+      tree->alevel_->Delete(key, nullptr);
+    else if (tree->alevel_->Get(key, old_value))
+      tree->alevel_->Update(key, value);
+    else
+      tree->alevel_->Put(key, value);
+  }, this);
+  LOG(Debug::INFO, "replay %ld records written during migration", cnt);
+
   // change manifest first
+  manifest_->SetBLevelFile(blevel_->FileId(), blevel_->CLevelFileId());
   manifest_->SetIsComboTree(true);
   State s = State::PMEMKV_TO_COMBO_TREE;
   // must change status before wating no ref
@@ -156,31 +354,45 @@ void ComboTree::ExpandComboTree_() {
   LOG(Debug::INFO, "preparing to expand combotree. current size is %ld", Size());
 
   permit_delete_.store(false);
+#ifdef BACKGROUND_EXPAND
+  // expansion workers are dedicated, foreground threads keep serving
+  need_sleep_.store(false);
+#else
   sleeped_threads_.store(1);
   need_sleep_.store(sleeped_threads_ < EXPAND_THREADS);
+#endif
 
+  manifest_->SetIsExpanding(true);
   // old_blevel_ is set when last expanding finish.
-  blevel_ = new BLevel(old_blevel_->Size());
+  blevel_ = new BLevel(old_blevel_->Size(), options_.expand_buf_key,
+                       options_.entry_size_factor, options_.clevel_file_size);
   blevel_->PrepareExpansion(old_blevel_);
 
   s = State::PREPARE_EXPANDING;
   if (!status_.compare_exchange_strong(s, State::COMBO_TREE_EXPANDING, std::memory_order_release))
     assert(0);
 
-#ifdef BACKGROUD_EXPAND
-  std::thread t([&](){
-#endif
   Timer timer;
   timer.Start();
 
   blevel_->Expansion(old_blevel_);
 
-  need_sleep_.store(false);
+  // wake up threads sleeping for this expansion, under lock so that
+  // a thread about to sleep does not miss it
+  {
+    std::lock_guard<std::mutex> lock(BLevel::expand_wait_lock);
+    need_sleep_.store(false);
+    expand_epoch_++;
+  }
+  BLevel::expand_wait_cv.notify_all();
+  manifest_->SetBLevelFile(blevel_->FileId(), blevel_->CLevelFileId());
+  manifest_->SetIsExpanding(false);
 
   {
     std::lock_guard<std::shared_mutex> lock(alevel_lock_);
     delete alevel_;
-    alevel_ = new ALevel(blevel_);
+    alevel_ = new ALevel(blevel_, options_.span);
+    old_blevel_->RemoveFile();
     delete old_blevel_;
     old_blevel_ = blevel_;
   }
@@ -189,14 +401,13 @@ void ComboTree::ExpandComboTree_() {
   if (!status_.compare_exchange_strong(tmp, State::USING_COMBO_TREE, std::memory_order_release))
     assert(0);
 
-  expand_time += timer.End();
+  int64_t elapsed = timer.End();
+  expand_time += elapsed;
+  STATS_INC(EXPANSION);
+  STATS_ADD(EXPANSION_TIME_US, elapsed);
   permit_delete_.store(true);
 
   LOG(Debug::INFO, "finish expanding combotree. current size is %ld, current entry count is %ld, expansion time is %lfs", Size(), blevel_->Entries(), (double)expand_time/1000000.0);
-#ifdef BACKGROUD_EXPAND
-  });
-  t.detach();
-#endif
 
 #else // BRANGE
 
@@ -212,11 +423,24 @@ void ComboTree::ExpandComboTree_() {
   ALevel* old_alevel = alevel_;
   BLevel* old_blevel = blevel_;
 
-  blevel_ = new BLevel(old_blevel->Size());
-  blevel_->Expansion(old_blevel);
-  alevel_ = new ALevel(blevel_);
+  manifest_->SetIsExpanding(true);
+  BLevel* new_blevel = new BLevel(old_blevel->Size(), options_.expand_buf_key,
+                                  options_.entry_size_factor, options_.clevel_file_size);
+  new_blevel->Expansion(old_blevel);
+  manifest_->SetBLevelFile(new_blevel->FileId(), new_blevel->CLevelFileId());
+  manifest_->SetIsExpanding(false);
+  ALevel* new_alevel = new ALevel(new_blevel, options_.span);
+
+  {
+    // readers of the old levels hold alevel_lock_ shared
+    std::lock_guard<std::shared_mutex> lock(alevel_lock_);
+    alevel_ = new_alevel;
+    blevel_ = new_blevel;
+    old_blevel_ = blevel_;
+  }
 
   delete old_alevel;
+  old_blevel->RemoveFile();
   delete old_blevel;
 
   // change status
@@ -226,31 +450,81 @@ void ComboTree::ExpandComboTree_() {
         "can not change state from COMBO_TREE_EXPANDING to USING_COMBO_TREE!");
   }
 
-  expand_time += timer.End();
+  int64_t elapsed = timer.End();
+  expand_time += elapsed;
+  STATS_INC(EXPANSION);
+  STATS_ADD(EXPANSION_TIME_US, elapsed);
   permit_delete_.store(true);
 
   LOG(Debug::INFO, "finish expanding combotree. current size is %ld, current entry count is %ld, expansion time is %lfs", Size(), blevel_->Entries(), (double)expand_time/1000000.0);
 #endif // BRANGE
 }
 
+#ifdef BACKGROUND_EXPAND
+// wake up the expansion thread, writers never wait for expansion
+void ComboTree::RequestExpansion_() {
+  if (expand_request_.load(std::memory_order_relaxed))
+    return;
+  {
+    std::lock_guard<std::mutex> lock(expand_lock_);
+    expand_request_.store(true);
+  }
+  expand_cv_.notify_one();
+}
+
+void ComboTree::ExpandWorker_() {
+  std::unique_lock<std::mutex> lock(expand_lock_);
+  while (true) {
+    expand_cv_.wait(lock, [&](){ return expand_request_.load() || expand_stop_; });
+    if (expand_stop_)
+      break;
+    lock.unlock();
+    ExpandComboTree_();
+    lock.lock();
+    expand_request_.store(false);
+  }
+}
+#endif // BACKGROUND_EXPAND
+
+void ComboTree::CheckExpansion_() {
+  if (Size() >= (size_t)options_.expansion_factor * options_.expand_buf_key * blevel_->Entries()) {
+#ifdef BACKGROUND_EXPAND
+    RequestExpansion_();
+#else
+    ExpandComboTree_();
+#endif
+  }
+}
+
 bool ComboTree::Put(uint64_t key, uint64_t value) {
   bool ret;
   int wait = 0;
-  while (true) {
+  for (int retry = 0; ; ++retry) {
+    if (retry)
+      STATS_INC(PUT_RETRY);
     // the order of comparison should not be changed
     if (status_.load(std::memory_order_acquire) == State::USING_PMEMKV) {
       ret = pmemkv_->Put(key, value);
-      if (Size() >= PMEMKV_THRESHOLD)
+      // migration started after status is loaded, or a failed BulkLoad
+      // blocked writes for a while
+      if (!ret && (status_.load(std::memory_order_acquire) != State::USING_PMEMKV ||
+                   !pmemkv_->Full()))
+        continue;
+      if (Size() >= options_.pmemkv_threshold)
         ChangeToComboTree_();
       break;
     } else if (status_.load(std::memory_order_acquire) == State::PMEMKV_TO_COMBO_TREE) {
-      std::this_thread::sleep_for(std::chrono::microseconds(10));
+      // pmemkv log keeps the write until it is replayed into combotree,
+      // writes are rejected only during replay
+      ret = pmemkv_->Put(key, value);
+      if (ret) break;
+      std::this_thread::yield();
       continue;
     } else if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
       ret = alevel_->Put(key, value);
+      if (!ret && blevel_->NoSpace()) break;
       if (!ret) continue;
-      if (Size() >= EXPANSION_FACTOR * BLEVEL_EXPAND_BUF_KEY * blevel_->Entries())
-        ExpandComboTree_();
+      CheckExpansion_();
       ret = true;
       break;
     } else if (status_.load(std::memory_order_acquire) == State::PREPARE_EXPANDING) {
@@ -265,12 +539,16 @@ bool ComboTree::Put(uint64_t key, uint64_t value) {
           if (sleeped_threads_ == EXPAND_THREADS)
             need_sleep_.store(false);
           LOG(Debug::INFO, "thread waiting for cv");
-          BLevel::expand_wait_cv.wait(lock);
+          uint64_t epoch = expand_epoch_;
+          STATS_INC(EXPAND_WAIT);
+          BLevel::expand_wait_cv.wait(lock, [&](){ return expand_epoch_ != epoch; });
           LOG(Debug::INFO, "thread finish waiting for cv");
         }
       } else {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        wait++;
+        // nothing moved yet, the pair will be moved by expansion
+        std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+        ret = alevel_->Put(key, value);
+        if (ret || blevel_->NoSpace()) break;
       }
 #endif
       continue;
@@ -286,7 +564,9 @@ bool ComboTree::Put(uint64_t key, uint64_t value) {
           if (sleeped_threads_ == EXPAND_THREADS)
             need_sleep_.store(false);
           LOG(Debug::INFO, "thread waiting for cv");
-          BLevel::expand_wait_cv.wait(lock);
+          uint64_t epoch = expand_epoch_;
+          STATS_INC(EXPAND_WAIT);
+          BLevel::expand_wait_cv.wait(lock, [&](){ return expand_epoch_ != epoch; });
           LOG(Debug::INFO, "thread finish waiting for cv");
         }
         continue;
@@ -299,7 +579,7 @@ bool ComboTree::Put(uint64_t key, uint64_t value) {
           std::shared_lock<std::shared_mutex> lock(alevel_lock_);
           ret = alevel_->Put(key, value);
         }
-        if (!ret) continue;
+        if (!ret && !blevel_->NoSpace()) continue;
         break;
       }
 #endif // BRANGE
@@ -317,11 +597,20 @@ bool ComboTree::Update(uint64_t key, uint64_t value) {
     // the order of comparison should not be changed
     if (status_.load(std::memory_order_acquire) == State::USING_PMEMKV) {
       ret = pmemkv_->Put(key, value);
-      if (Size() >= PMEMKV_THRESHOLD)
+      // migration started after status is loaded, or a failed BulkLoad
+      // blocked writes for a while
+      if (!ret && (status_.load(std::memory_order_acquire) != State::USING_PMEMKV ||
+                   !pmemkv_->Full()))
+        continue;
+      if (Size() >= options_.pmemkv_threshold)
         ChangeToComboTree_();
       break;
     } else if (status_.load(std::memory_order_acquire) == State::PMEMKV_TO_COMBO_TREE) {
-      std::this_thread::sleep_for(std::chrono::microseconds(10));
+      // pmemkv log keeps the write until it is replayed into combotree,
+      // writes are rejected only during replay
+      ret = pmemkv_->Put(key, value);
+      if (ret) break;
+      std::this_thread::yield();
       continue;
     } else if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
       ret = alevel_->Update(key, value);
@@ -336,12 +625,16 @@ bool ComboTree::Update(uint64_t key, uint64_t value) {
           if (sleeped_threads_ == EXPAND_THREADS)
             need_sleep_.store(false);
           LOG(Debug::INFO, "thread waiting for cv");
-          BLevel::expand_wait_cv.wait(lock);
+          uint64_t epoch = expand_epoch_;
+          STATS_INC(EXPAND_WAIT);
+          BLevel::expand_wait_cv.wait(lock, [&](){ return expand_epoch_ != epoch; });
           LOG(Debug::INFO, "thread finish waiting for cv");
         }
       } else {
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
-        wait++;
+        // nothing moved yet, the pair will be moved by expansion
+        std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+        ret = alevel_->Update(key, value);
+        if (ret) break;
       }
 #else
       std::this_thread::sleep_for(std::chrono::milliseconds(1));
@@ -360,7 +653,9 @@ bool ComboTree::Update(uint64_t key, uint64_t value) {
           if (sleeped_threads_ == EXPAND_THREADS)
             need_sleep_.store(false);
           LOG(Debug::INFO, "thread waiting for cv");
-          BLevel::expand_wait_cv.wait(lock);
+          uint64_t epoch = expand_epoch_;
+          STATS_INC(EXPAND_WAIT);
+          BLevel::expand_wait_cv.wait(lock, [&](){ return expand_epoch_ != epoch; });
           LOG(Debug::INFO, "thread finish waiting for cv");
         }
         continue;
@@ -373,7 +668,7 @@ bool ComboTree::Update(uint64_t key, uint64_t value) {
           std::shared_lock<std::shared_mutex> lock(alevel_lock_);
           ret = alevel_->Update(key, value);
         }
-        if (!ret) continue;
+        if (!ret && !blevel_->NoSpace()) continue;
         break;
       }
 #endif // BRANGE
@@ -393,13 +688,46 @@ bool ComboTree::Get(uint64_t key, uint64_t& value) const {
       break;
     } else if (status_.load(std::memory_order_acquire) == State::PMEMKV_TO_COMBO_TREE) {
       ret = pmemkv_->Get(key, value);
+      // pmemkv is retired after its log is replayed into combotree
+      if (status_.load(std::memory_order_acquire) != State::PMEMKV_TO_COMBO_TREE)
+        continue;
       break;
     } else if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
-      ret = alevel_->Get(key, value);
+      // expansion may start after status is loaded, and replace alevel_
+      bool moved = false;
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      ret = alevel_->Get(key, value, &moved);
+      if (moved) continue;
+      break;
+    } else if (status_.load(std::memory_order_acquire) == State::PREPARE_EXPANDING) {
+      // alevel_ is replaced under alevel_lock_, but expansion may start
+      // moving entries after status is loaded
+      bool moved = false;
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      ret = alevel_->Get(key, value, &moved);
+      if (moved) continue;
       break;
     } else if (status_.load(std::memory_order_acquire) == State::COMBO_TREE_EXPANDING) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-      continue;
+#ifndef BRANGE
+      // old blevel is intact until alevel_ is replaced
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      ret = alevel_->Get(key, value);
+      break;
+#else
+      int range;
+      uint64_t end;
+      if (blevel_->IsKeyExpanded(key, range, end)) {
+        ret = blevel_->GetRange(key, value, range, end);
+        break;
+      } else {
+        // entry may be moved but not visible in new blevel yet, retry
+        bool moved = false;
+        std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+        ret = alevel_->Get(key, value, &moved);
+        if (moved) continue;
+        break;
+      }
+#endif // BRANGE
     }
   }
   return ret;
@@ -411,21 +739,442 @@ bool ComboTree::Delete(uint64_t key) {
     // the order of comparison should not be changed
     if (status_.load(std::memory_order_acquire) == State::USING_PMEMKV) {
       ret = pmemkv_->Delete(key);
+      if (!ret && (status_.load(std::memory_order_acquire) != State::USING_PMEMKV ||
+                   !pmemkv_->Full()))
+        continue;
       break;
     } else if (status_.load(std::memory_order_acquire) == State::PMEMKV_TO_COMBO_TREE) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ret = pmemkv_->Delete(key);
+      if (ret) break;
+      std::this_thread::yield();
       continue;
     } else if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      ret = alevel_->Delete(key, nullptr);
+      if (!ret) continue;
+      break;
+    } else if (status_.load(std::memory_order_acquire) == State::PREPARE_EXPANDING) {
+#ifdef BRANGE
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
       ret = alevel_->Delete(key, nullptr);
+      if (!ret) continue;
       break;
+#else
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+#endif
     } else if (status_.load(std::memory_order_acquire) == State::COMBO_TREE_EXPANDING) {
+#ifndef BRANGE
+      // deletes would be lost in the copy
       std::this_thread::sleep_for(std::chrono::milliseconds(1));
       continue;
+#else
+      int range;
+      uint64_t end;
+      if (blevel_->IsKeyExpanded(key, range, end)) {
+        ret = blevel_->DeleteRange(key, nullptr, range, end);
+      } else {
+        std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+        ret = alevel_->Delete(key, nullptr);
+      }
+      if (!ret) continue;
+      break;
+#endif // BRANGE
     }
   }
   return ret;
 }
 
+void ComboTree::MultiGet(const uint64_t* keys, size_t n, uint64_t* values, bool* found) const {
+  for (size_t i = 0; i < n; i += MULTI_GROUP_SIZE) {
+    int group = std::min<size_t>(MULTI_GROUP_SIZE, n - i);
+    uint64_t retry = UINT64_MAX >> (64 - group);
+    if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE)
+      retry = alevel_->MultiGet(keys + i, group, values + i, found + i);
+    // other states and entries moved by expansion go through single key path
+    while (retry) {
+      int j = __builtin_ctzll(retry);
+      found[i+j] = Get(keys[i+j], values[i+j]);
+      retry &= retry - 1;
+    }
+  }
+}
+
+void ComboTree::MultiPut(const uint64_t* keys, const uint64_t* values, size_t n) {
+  for (size_t i = 0; i < n; i += MULTI_GROUP_SIZE) {
+    int group = std::min<size_t>(MULTI_GROUP_SIZE, n - i);
+    uint64_t retry = UINT64_MAX >> (64 - group);
+    if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
+      retry = alevel_->MultiPut(keys + i, values + i, group);
+      CheckExpansion_();
+    }
+    while (retry) {
+      int j = __builtin_ctzll(retry);
+      Put(keys[i+j], values[i+j]);
+      retry &= retry - 1;
+    }
+  }
+}
+
+/************************* ComboTree::*Value *************************/
+void ComboTree::ValueRef::Reset() {
+  if (log_)
+    log_->Unpin(handle_);
+  log_ = nullptr;
+  data_ = nullptr;
+  size_ = 0;
+}
+
+bool ComboTree::PutValue(uint64_t key, const void* data, size_t size) {
+  assert(value_log_);
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(key));
+  uint64_t handle;
+  if (Get(key, handle))
+    return false;
+  handle = value_log_->Append(key, data, size);
+  if (handle == ValueLog::INVALID_HANDLE)
+    return false;
+  if (!Put(key, handle)) {
+    value_log_->Kill(handle);
+    return false;
+  }
+  return true;
+}
+
+bool ComboTree::UpdateValue(uint64_t key, const void* data, size_t size) {
+  assert(value_log_);
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(key));
+  uint64_t old_handle, handle;
+  if (!Get(key, old_handle))
+    return false;
+  handle = value_log_->Append(key, data, size);
+  if (handle == ValueLog::INVALID_HANDLE)
+    return false;
+  if (!Update(key, handle)) {
+    value_log_->Kill(handle);
+    return false;
+  }
+  value_log_->Kill(old_handle);
+  return true;
+}
+
+bool ComboTree::GetValue(uint64_t key, ValueRef& value) const {
+  assert(value_log_);
+  value.Reset();
+  uint64_t handle;
+  const void* data;
+  size_t size;
+  // moved by gc after the handle is read, read again
+  do {
+    if (!Get(key, handle))
+      return false;
+  } while (!value_log_->Pin(handle, data, size));
+  value.log_ = value_log_;
+  value.handle_ = handle;
+  value.data_ = data;
+  value.size_ = size;
+  return true;
+}
+
+bool ComboTree::DeleteValue(uint64_t key) {
+  assert(value_log_);
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(key));
+  uint64_t handle;
+  if (!Get(key, handle) || !Delete(key))
+    return false;
+  value_log_->Kill(handle);
+  return true;
+}
+
+// move live records out of segments with many dead records
+void ComboTree::ValueGCWorker_() {
+  int segment;
+  int backoff = 1;
+  while ((segment = value_log_->WaitVictim()) >= 0) {
+    bool full = false;
+    value_log_->ForEachRecord(segment, [&](uint64_t key, uint64_t handle,
+                                           const void* data, size_t size) {
+      if (full)
+        return;
+      std::lock_guard<std::mutex> lock(value_log_->KeyLock(key));
+      uint64_t cur;
+      if (!Get(key, cur))
+        return;
+      // records of long strings are referenced by the chain of their prefix
+      if (options_.string_keys) {
+        full = !string_key::Move(value_log_, key, cur, handle, data, size,
+                                 [&](uint64_t moved) { return Update(key, moved); });
+        return;
+      }
+      if (cur != handle)
+        return;
+      uint64_t new_handle = value_log_->Append(key, data, size, true);
+      if (new_handle == ValueLog::INVALID_HANDLE) {
+        full = true;
+        return;
+      }
+      // the record stays in the segment, which is picked again later
+      if (!Update(key, new_handle)) {
+        value_log_->Kill(new_handle);
+        full = true;
+      }
+    });
+    // the segment is still referenced, moved records are skipped next time.
+    // wait for released segments to be unpinned.
+    if (full) {
+      LOG(Debug::WARNING, "no space to move value log segment %d, retry in %d ms",
+          segment, backoff);
+      value_log_->Retry(segment);
+      std::this_thread::sleep_for(std::chrono::milliseconds(backoff));
+      backoff = std::min(backoff * 2, 100);
+      continue;
+    }
+    backoff = 1;
+    value_log_->Release(segment);
+  }
+}
+
+namespace {
+
+void scan_to_vector(uint64_t key, uint64_t value, void* arg) {
+  ((std::vector<std::pair<uint64_t,uint64_t>>*)arg)->emplace_back(key, value);
+}
+
+void scan_to_pair(uint64_t key, uint64_t value, void* arg) {
+  Pair*& cur = *(Pair**)arg;
+  cur->key = key;
+  cur->value = value;
+  cur++;
+}
+
+void scan_to_value(uint64_t key, uint64_t value, void* arg) {
+  uint64_t*& cur = *(uint64_t**)arg;
+  *cur++ = value;
+}
+
+} // anonymous namespace
+
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       std::vector<std::pair<uint64_t, uint64_t>>& results) {
+  return Scan_(min_key, max_key, max_size, scan_to_vector, &results);
+}
+
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       Pair* results) {
+  return Scan_(min_key, max_key, max_size, scan_to_pair, &results);
+}
+
+// only values are returned
+size_t ComboTree::Scan(uint64_t min_key, uint64_t max_key, size_t max_size,
+                       uint64_t* results) {
+  return Scan_(min_key, max_key, max_size, scan_to_value, &results);
+}
+
+/************************* ComboTree::*String *************************/
+bool ComboTree::PutString(std::string_view key, uint64_t value) {
+  uint64_t prefix = string_key::Encode(key);
+  if (string_key::IsInline(prefix))
+    return Put(prefix, value);
+  // gc only knows chains of long strings with string_keys
+  if (!options_.string_keys)
+    return false;
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(prefix));
+  uint64_t head;
+  string_key::Position pos;
+  bool exist = Get(prefix, head);
+  if (exist && string_key::Find(value_log_, head, key, pos))
+    return false;
+  uint64_t record = string_key::NewRecord(value_log_, prefix, key, value);
+  if (record == ValueLog::INVALID_HANDLE)
+    return false;
+  uint64_t chunk = string_key::Chunk(key);
+  if (!exist) {
+    string_key::Node::Slot slot{chunk, record};
+    uint64_t node = string_key::NewNode(value_log_, prefix, &slot, 1, string_key::EMPTY);
+    if (node == ValueLog::INVALID_HANDLE) {
+      value_log_->Kill(record);
+      return false;
+    }
+    if (Put(prefix, node))
+      return true;
+    value_log_->Kill(node);
+    value_log_->Kill(record);
+    return false;
+  }
+  uint64_t copy;
+  if (!string_key::CopyPut(value_log_, prefix, pos, chunk, record, copy)) {
+    value_log_->Kill(record);
+    return false;
+  }
+  if (!SetChain_(prefix, pos.prev, copy)) {
+    string_key::KillCopy(value_log_, copy, pos.node);
+    value_log_->Kill(record);
+    return false;
+  }
+  value_log_->Kill(pos.node);
+  return true;
+}
+
+bool ComboTree::UpdateString(std::string_view key, uint64_t value) {
+  uint64_t prefix = string_key::Encode(key);
+  if (string_key::IsInline(prefix))
+    return Update(prefix, value);
+  if (!options_.string_keys)
+    return false;
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(prefix));
+  uint64_t head;
+  string_key::Position pos;
+  if (!Get(prefix, head) || !string_key::Find(value_log_, head, key, pos))
+    return false;
+  uint64_t record = ((string_key::Node*)value_log_->Data(pos.node))->slot[pos.slot].handle;
+  value_log_->Write(record, 0, value);
+  return true;
+}
+
+bool ComboTree::GetString(std::string_view key, uint64_t& value) const {
+  uint64_t prefix = string_key::Encode(key);
+  if (string_key::IsInline(prefix))
+    return Get(prefix, value);
+  if (!options_.string_keys)
+    return false;
+  uint64_t head;
+  bool found;
+  do {
+    if (!Get(prefix, head))
+      return false;
+  } while (!string_key::Get(value_log_, head, key, value, found));
+  return found;
+}
+
+bool ComboTree::DeleteString(std::string_view key) {
+  uint64_t prefix = string_key::Encode(key);
+  if (string_key::IsInline(prefix))
+    return Delete(prefix);
+  if (!options_.string_keys)
+    return false;
+  std::lock_guard<std::mutex> lock(value_log_->KeyLock(prefix));
+  uint64_t head;
+  string_key::Position pos;
+  if (!Get(prefix, head) || !string_key::Find(value_log_, head, key, pos))
+    return false;
+  uint64_t record = ((string_key::Node*)value_log_->Data(pos.node))->slot[pos.slot].handle;
+  uint64_t copy;
+  if (!string_key::CopyDelete(value_log_, prefix, pos, copy))
+    return false;
+  if (!SetChain_(prefix, pos.prev, copy)) {
+    string_key::KillCopy(value_log_, copy, pos.node);
+    return false;
+  }
+  value_log_->Kill(pos.node);
+  value_log_->Kill(record);
+  return true;
+}
+
+// point the tree slot of prefix, or next of prev, to node of a chain.
+// the prefix is deleted if the chain is empty.
+bool ComboTree::SetChain_(uint64_t prefix, uint64_t prev, uint64_t node) {
+  if (prev != string_key::EMPTY) {
+    value_log_->Write(prev, string_key::Node::NextOffset(), node);
+    return true;
+  }
+  if (node == string_key::EMPTY)
+    return Delete(prefix);
+  return Update(prefix, node);
+}
+
+size_t ComboTree::ScanString(std::string_view min_key, size_t max_size,
+                             std::vector<std::pair<std::string, uint64_t>>& results) {
+  size_t count = 0;
+  uint64_t start = string_key::Encode(min_key);
+  std::vector<std::pair<uint64_t, uint64_t>> kv;
+  std::vector<std::pair<std::string, uint64_t>> chain;
+  while (count < max_size) {
+    // a chain holds at least one string
+    kv.clear();
+    size_t want = max_size - count;
+    Scan_(start, UINT64_MAX, want, scan_to_vector, &kv);
+    for (auto& p : kv) {
+      if (count >= max_size)
+        break;
+      if (string_key::IsInline(p.first)) {
+        results.emplace_back(string_key::Decode(p.first), p.second);
+        count++;
+        continue;
+      }
+      if (!options_.string_keys)
+        continue;
+      {
+        // head may be moved by gc since scanned
+        std::lock_guard<std::mutex> lock(value_log_->KeyLock(p.first));
+        uint64_t head;
+        if (!Get(p.first, head))
+          continue;
+        string_key::Collect(value_log_, head, chain);
+      }
+      for (auto& s : chain) {
+        // only the chain of min_key has smaller strings
+        if (count >= max_size || s.first < min_key)
+          continue;
+        results.push_back(std::move(s));
+        count++;
+      }
+    }
+    if (kv.size() < want)
+      break;
+    start = kv.back().first + 1;
+  }
+  return count;
+}
+
+size_t ComboTree::Scan_(uint64_t min_key, uint64_t max_key, size_t max_size,
+                        void (*callback)(uint64_t,uint64_t,void*), void* arg) {
+  size_t count = 0;
+  if (min_key > max_key || max_size == 0)
+    return 0;
+
+  while (true) {
+    // the order of comparison should not be changed
+    if (status_.load(std::memory_order_acquire) == State::USING_PMEMKV) {
+      return pmemkv_->Scan(min_key, max_key, max_size, callback, arg);
+    } else if (status_.load(std::memory_order_acquire) == State::PMEMKV_TO_COMBO_TREE) {
+      // pmemkv has every write until it is retired
+      return pmemkv_->Scan(min_key, max_key, max_size, callback, arg);
+    } else if (status_.load(std::memory_order_acquire) == State::USING_COMBO_TREE) {
+      // alevel_ and its blevel will not be deleted while holding alevel_lock_.
+      // Scan returns false if expansion starts, then retry in new state.
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      if (alevel_->Scan(min_key, max_key, max_size, count, callback, arg))
+        break;
+    } else if (status_.load(std::memory_order_acquire) == State::PREPARE_EXPANDING) {
+      // old blevel is intact before expansion starts
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      if (alevel_->Scan(min_key, max_key, max_size, count, callback, arg))
+        break;
+    } else if (status_.load(std::memory_order_acquire) == State::COMBO_TREE_EXPANDING) {
+#ifndef BRANGE
+      // old blevel is intact until alevel_ is replaced
+      std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+      if (alevel_->Scan(min_key, max_key, max_size, count, callback, arg))
+        break;
+#else
+      // keys less than expanded max key are scanned in new blevel, others in
+      // old blevel. switch between them until done.
+      int range;
+      uint64_t end;
+      if (blevel_->IsKeyExpanded(min_key, range, end)) {
+        if (blevel_->ScanRange(min_key, max_key, max_size, count, callback, arg, range))
+          break;
+      } else {
+        std::shared_lock<std::shared_mutex> lock(alevel_lock_);
+        if (alevel_->Scan(min_key, max_key, max_size, count, callback, arg))
+          break;
+      }
+#endif // BRANGE
+    }
+  }
+  return count;
+}
+
 /************************ ComboTree::IterImpl ************************/
 class ComboTree::IterImpl {
  public:
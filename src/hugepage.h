@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/mman.h>
+
+namespace combotree {
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024UL;
+
+// zeroed DRAM backed by 2MB pages. reserved hugetlb pages are used if
+// there are any, otherwise ask for transparent huge pages.
+inline void* HugePageAlloc(size_t size, size_t& mapped_len) {
+  mapped_len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  if (mapped_len == 0)
+    mapped_len = HUGE_PAGE_SIZE;
+  void* addr = mmap(nullptr, mapped_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (addr != MAP_FAILED)
+    return addr;
+
+  addr = mmap(nullptr, mapped_len, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    perror("HugePageAlloc(): mmap");
+    exit(1);
+  }
+  madvise(addr, mapped_len, MADV_HUGEPAGE);
+  return addr;
+}
+
+inline void HugePageFree(void* addr, size_t mapped_len) {
+  munmap(addr, mapped_len);
+}
+
+} // namespace combotree
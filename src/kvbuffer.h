@@ -5,11 +5,37 @@
 #include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <x86intrin.h>
 #include "combotree_config.h"
 #include "pmem.h"
 
 namespace combotree {
 
+#if !defined(BUF_SORT) && (__AVX512BW__ || __AVX2__)
+namespace {
+
+// shuffle[s] repeats the low s bytes of a broadcast key over 64 bytes
+// (pshufb works inside 16-byte lanes, every lane holds the key twice).
+// stride[s] has bit i*s set for every key slot.
+struct SuffixMatchTable {
+  alignas(64) uint8_t shuffle[9][64];
+  uint64_t stride[9];
+
+  constexpr SuffixMatchTable() : shuffle(), stride() {
+    for (int s = 1; s <= 8; ++s) {
+      for (int i = 0; i < 64; ++i)
+        shuffle[s][i] = i % s;
+      for (int i = 0; i < 64; i += s)
+        stride[s] |= 1UL << i;
+    }
+  }
+};
+
+constexpr SuffixMatchTable suffix_match_table;
+
+} // anonymous namespace
+#endif
+
 template<const size_t buf_size, const size_t value_size = 8>
 struct KVBuffer {
   union {
@@ -89,6 +115,15 @@ struct KVBuffer {
     }
     find = false;
     return left;
+#elif __AVX512BW__ || __AVX2__
+    // return the last one if key is put twice
+    uint64_t match = MatchSuffix_(target);
+    if (match) {
+      find = true;
+      return (63 - __builtin_clzll(match)) / suffix_bytes;
+    }
+    find = false;
+    return entries;
 #else
     for (int i = entries-1; i >= 0; --i) {
       if (!memcmp(pkey(i), &target, suffix_bytes)) {
@@ -101,6 +136,40 @@ struct KVBuffer {
 #endif // BUF_SORT
   }
 
+#if !defined(BUF_SORT) && (__AVX512BW__ || __AVX2__)
+  // compare all suffix keys with target at once, bit i*suffix_bytes of
+  // the result is set if key i matches.
+  ALWAYS_INLINE uint64_t MatchSuffix_(uint64_t target) const {
+    static_assert(buf_size >= 64, "KVBuffer too small for simd find");
+    assert(entries * suffix_bytes <= 64);
+    const uint8_t* shuffle = suffix_match_table.shuffle[suffix_bytes];
+#if __AVX512BW__
+    __m512i pattern = _mm512_shuffle_epi8(_mm512_set1_epi64(target),
+                                          _mm512_load_si512(shuffle));
+    uint64_t eq = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(buf), pattern);
+#else
+    __m256i bcast = _mm256_set1_epi64x(target);
+    __m256i lo = _mm256_shuffle_epi8(bcast, _mm256_load_si256((const __m256i*)shuffle));
+    __m256i hi = _mm256_shuffle_epi8(bcast, _mm256_load_si256((const __m256i*)(shuffle+32)));
+    uint64_t eq = (uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)buf), lo)) |
+                  ((uint64_t)(uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf+32)), hi)) << 32);
+#endif
+    // bit j remains set only if bytes [j, j+suffix_bytes) are all equal
+    for (int i = 1; i < suffix_bytes; ++i)
+      eq &= eq >> 1;
+    int bits = entries * suffix_bytes;
+#ifdef __BMI2__
+    return eq & _bzhi_u64(suffix_match_table.stride[suffix_bytes], bits);
+#else
+    // bzhi is BMI2, not part of AVX2
+    uint64_t mask = bits == 64 ? UINT64_MAX : (1UL << bits) - 1;
+    return eq & suffix_match_table.stride[suffix_bytes] & mask;
+#endif
+  }
+#endif
+
   // find first entry greater or equal to target
   int FindLE(uint64_t target, bool& find) const {
 #ifdef BUF_SORT
@@ -203,6 +272,31 @@ struct KVBuffer {
 #endif // BUF_SORT
   }
 
+  // pairs in slots [0, n) are in sorted order
+  ALWAYS_INLINE void SetSorted(int n) {
+    entries = n;
+  }
+
+#ifndef BUF_SORT
+  // finish a Delete interrupted between key move and update of entries,
+  // the last key then appears twice and the last value is the right one.
+  void Recover() {
+    if (entries < 2)
+      return;
+    for (int i = entries - 2; i >= 0; --i) {
+      if (memcmp(pkey(i), pkey(entries - 1), suffix_bytes) == 0) {
+        memcpy(pvalue(i), pvalue(entries - 1), value_size);
+        cacheline_flush(pvalue(i));
+        memory_fence();
+        entries--;
+        cacheline_flush(&meta);
+        memory_fence();
+        return;
+      }
+    }
+  }
+#endif // BUF_SORT
+
 #ifdef BUF_SORT
   // move data from this.[start_pos, entries) to dest.[0,entries-start_pos),
   // the start_pos and entries are the position of sorted order.
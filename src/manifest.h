@@ -1,8 +1,8 @@
 #include <filesystem>
 #include <libpmem.h>
 #include <libpmemobj++/persistent_ptr.hpp>
-#include <libpmemobj++/make_persistent_atomic.hpp>
 #include "combotree_config.h"
+#include "debug.h"
 
 namespace combotree {
 
@@ -25,30 +25,34 @@ class Manifest {
       pop_ = pmem::obj::pool<Root>::create(manifest_path,
           "Combo Tree Manifest", size_, 0666);
       root_ = pop_.root();
-      pmem::obj::make_persistent_atomic<std::string>(
-          pop_, root_->pmemkv_path, dir_ + DEFAULT_PMEMKV_PATH);
-      pmem::obj::make_persistent_atomic<std::string>(
-          pop_, root_->blevel_path, dir_ + DEFAULT_PMEM_PATH);
-      pmem::obj::make_persistent_atomic<std::string>(
-          pop_, root_->clevel_path, dir_ + DEFAULT_PMEMOBJ_PATH);
+      SetPath_(root_->pmemkv_path, dir_ + DEFAULT_PMEMKV_PATH);
+      SetPath_(root_->blevel_path, dir_ + DEFAULT_PMEM_PATH);
+      SetPath_(root_->clevel_path, dir_ + DEFAULT_PMEMOBJ_PATH);
       root_->is_combo_tree = 0;
       root_->combo_tree_seq = 0;
+      root_->is_expanding = 0;
+      root_->blevel_files = 0;
       root_.persist();
     } else {
-      assert(0);
+      pop_ = pmem::obj::pool<Root>::open(dir_ + "Manifest", "Combo Tree Manifest");
+      root_ = pop_.root();
     }
   }
 
+  ~Manifest() {
+    pop_.close();
+  }
+
   const std::string PmemKVPath() const {
-    return *root_->pmemkv_path;
+    return root_->pmemkv_path;
   }
 
   const std::string BLevelPath() const {
-    return *root_->blevel_path;
+    return root_->blevel_path;
   }
 
   const std::string CLevelPath() const {
-    return *root_->clevel_path + std::string("-") +
+    return std::string(root_->clevel_path) + "-" +
            std::to_string(root_->combo_tree_seq);
   }
 
@@ -67,18 +71,55 @@ class Manifest {
         sizeof(is_combo_tree));
   }
 
+  // file ids of current blevel and its clevel, written in one 8-byte store
+  void SetBLevelFile(int blevel_id, int clevel_id) {
+    uint64_t files = ((uint64_t)(uint32_t)blevel_id << 32) | (uint32_t)clevel_id;
+    pop_.memcpy_persist(&root_->blevel_files, &files, sizeof(files));
+  }
+
+  int BLevelFileId() const {
+    return root_->blevel_files >> 32;
+  }
+
+  int CLevelFileId() const {
+    return root_->blevel_files & 0xFFFFFFFFUL;
+  }
+
+  bool IsExpanding() const {
+    return root_->is_expanding;
+  }
+
+  void SetIsExpanding(int is_expanding) {
+    pop_.memcpy_persist(&root_->is_expanding, &is_expanding,
+        sizeof(is_expanding));
+  }
+
  private:
   std::string dir_; // combotree directory
   size_t size_;     // manifest file size
 
+  static constexpr size_t PATH_LEN = 256;
+
+  // paths are stored inline, a std::string would keep its buffer in the
+  // heap of the process which created the pool
   struct Root {
-    pmem::obj::persistent_ptr<std::string> pmemkv_path;
-    pmem::obj::persistent_ptr<std::string> blevel_path;
-    pmem::obj::persistent_ptr<std::string> clevel_path;
+    char pmemkv_path[PATH_LEN];
+    char blevel_path[PATH_LEN];
+    char clevel_path[PATH_LEN];
     int combo_tree_seq;
     int is_combo_tree;
+    int is_expanding;
+    uint64_t blevel_files;
   };
 
+  void SetPath_(char* dst, const std::string& path) {
+    if (path.size() >= PATH_LEN) {
+      LOG(Debug::ERROR, "path is too long: %s", path.c_str());
+      exit(1);
+    }
+    pop_.memcpy_persist(dst, path.c_str(), path.size() + 1);
+  }
+
   pmem::obj::pool<Root> pop_;
   pmem::obj::persistent_ptr<Root> root_;
 
@@ -1,23 +1,133 @@
 #pragma once
 
+#include <cstdint>
+#include <chrono>
+#include <sys/mman.h>
 #include <x86intrin.h>
+#include "combotree_config.h"
+#include "stats.h"
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// persistence backend, selected by PERSIST_MODE in CMakeLists.txt
+//   PERSIST_PMEM:  real persistent memory, flush cache line
+//   PERSIST_DRAM:  tmpfs, flush and fence only inject latency
+//   PERSIST_MSYNC: normal file, fence msyncs pages flushed before
+
+#if defined(PERSIST_PMEM)
 
 // cache line flush
 #if __CLWB__
-#define cacheline_flush _mm_clwb
+#define raw_cacheline_flush _mm_clwb
 #define FLUSH_METHOD  "_mm_clwb"
 #elif __CLFLUSHOPT__
-#define cacheline_flush _mm_clflushopt
+#define raw_cacheline_flush _mm_clflushopt
 #define FLUSH_METHOD  "_mm_clflushopt"
 #elif __CLFLUSH__
-#define cacheline_flush _mm_clflush
+#define raw_cacheline_flush _mm_clflush
 #define FLUSH_METHOD  "_mm_clflush"
 #else
 static_assert(0, "cache line flush not supported!");
 #endif
 
 // memory fence
-#define memory_fence _mm_sfence
+#define raw_memory_fence _mm_sfence
+#define FENCE_METHOD  "_mm_sfence"
+
+#elif defined(PERSIST_DRAM)
+
+namespace combotree {
+namespace persist {
+
+// tsc ticks per nanosecond, measured at first use
+inline double TscPerNs() {
+  static const double tsc_per_ns = [] {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_tsc = __rdtsc();
+    while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10)) {}
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+    return (double)(__rdtsc() - start_tsc) / ns;
+  }();
+  return tsc_per_ns;
+}
+
+ALWAYS_INLINE void Delay(uint64_t ns) {
+  uint64_t end = __rdtsc() + (uint64_t)(ns * TscPerNs());
+  while (__rdtsc() < end) {}
+}
+
+ALWAYS_INLINE void Flush(const void*) {
+#if DRAM_FLUSH_LATENCY > 0
+  Delay(DRAM_FLUSH_LATENCY);
+#endif
+}
+
+ALWAYS_INLINE void Fence() {
+  _mm_sfence();
+#if DRAM_FENCE_LATENCY > 0
+  Delay(DRAM_FENCE_LATENCY);
+#endif
+}
+
+} // namespace persist
+} // namespace combotree
+
+#define raw_cacheline_flush combotree::persist::Flush
+#define FLUSH_METHOD  "dram"
+#define raw_memory_fence combotree::persist::Fence
 #define FENCE_METHOD  "_mm_sfence"
 
-#define ALWAYS_INLINE inline __attribute__((always_inline))
\ No newline at end of file
+#elif defined(PERSIST_MSYNC)
+
+namespace combotree {
+namespace persist {
+
+// pages flushed by this thread since last fence
+struct PendingPages {
+  static constexpr int MAX_PAGES = 16;
+  uintptr_t page[MAX_PAGES];
+  int cnt;
+};
+
+inline thread_local PendingPages pending_pages;
+
+inline void Fence() {
+  // addresses not mapped from file fail with ENOMEM, ignore them
+  for (int i = 0; i < pending_pages.cnt; ++i)
+    msync((void*)pending_pages.page[i], 4096, MS_SYNC);
+  pending_pages.cnt = 0;
+}
+
+ALWAYS_INLINE void Flush(const void* addr) {
+  uintptr_t page = (uintptr_t)addr & ~(uintptr_t)4095;
+  for (int i = 0; i < pending_pages.cnt; ++i)
+    if (pending_pages.page[i] == page)
+      return;
+  if (pending_pages.cnt == PendingPages::MAX_PAGES)
+    Fence();
+  pending_pages.page[pending_pages.cnt++] = page;
+}
+
+} // namespace persist
+} // namespace combotree
+
+#define raw_cacheline_flush combotree::persist::Flush
+#define FLUSH_METHOD  "msync"
+#define raw_memory_fence combotree::persist::Fence
+#define FENCE_METHOD  "msync"
+
+#else
+static_assert(0, "unknown PERSIST_MODE!");
+#endif
+
+// counted with STATISTICS
+ALWAYS_INLINE void cacheline_flush(const void* addr) {
+  STATS_INC(FLUSH);
+  raw_cacheline_flush((void*)addr);
+}
+
+ALWAYS_INLINE void memory_fence() {
+  STATS_INC(FENCE);
+  raw_memory_fence();
+}
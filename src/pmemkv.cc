@@ -1,104 +1,184 @@
 #include <cassert>
 #include <filesystem>
-#include <libpmemkv.hpp>
+#include <libpmem.h>
 #include "combotree_config.h"
 #include "pmemkv.h"
+#include "pmem.h"
+#include "debug.h"
 
 namespace combotree {
 
 std::atomic<bool> PmemKV::read_valid_  = true;
 std::atomic<bool> PmemKV::write_valid_ = true;
 
-using pmem::kv::config;
-using pmem::kv::status;
-using pmem::kv::db;
-
-PmemKV::PmemKV(std::string path, size_t size,
-               std::string engine, bool force_create)
-    : db_(new db()), write_ref_(0), read_ref_(0)
+PmemKV::PmemKV(std::string path, size_t size, bool force_create)
+    : path_(path), nr_records_(0), pinned_(false), write_ref_(0), read_ref_(0)
 {
-  std::filesystem::remove(path);
-  config cfg;
-  [[maybe_unused]] auto s = cfg.put_string("path", path);
-  assert(s == status::OK);
-  s = cfg.put_uint64("size", size);
-  assert(s == status::OK);
-  s = cfg.put_uint64("force_create", force_create ? 1 : 0);
-  assert(s == status::OK);
-
-  s = db_->open(engine, std::move(cfg));
-  assert(s == status::OK);
+  // left by a crash during compaction, the log itself is intact
+  std::filesystem::remove(path_ + ".compact");
+  if (force_create)
+    std::filesystem::remove(path);
+  pmem_addr_ = Map_(path, force_create ? size + 64 : 0, log_, capacity_, mapped_len_);
+
+  // new file is zeroed, replay valid records of old file
+  while (nr_records_ < capacity_ && log_[nr_records_].type != EMPTY) {
+    Record& r = log_[nr_records_++];
+    if (r.type == PUT)
+      index_[r.key] = r.value;
+    else
+      index_.erase(r.key);
+  }
+}
+
+PmemKV::~PmemKV() {
+  pmem_unmap(pmem_addr_, mapped_len_);
 }
 
-namespace {
+// create the file if size is not 0
+void* PmemKV::Map_(const std::string& path, size_t size, Record*& log,
+                   size_t& capacity, size_t& mapped_len) {
+  int is_pmem;
+  void* addr;
+  if (size) {
+    addr = pmem_map_file(path.c_str(), size,
+                         PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len, &is_pmem);
+  } else {
+    addr = pmem_map_file(path.c_str(), 0, 0, 0666, &mapped_len, &is_pmem);
+  }
+#ifdef PERSIST_PMEM
+  assert(is_pmem == 1);
+#endif
+  if (addr == nullptr) {
+    perror("PmemKV::Map_(): pmem_map_file");
+    exit(1);
+  }
+  // aligned at 64-bytes
+  log = (Record*)addr;
+  if (((uintptr_t)log & (uintptr_t)63) != 0)
+    log = (Record*)(((uintptr_t)log+64) & ~(uintptr_t)63);
+  capacity = (mapped_len - ((uintptr_t)log - (uintptr_t)addr)) / sizeof(Record);
+  return addr;
+}
 
-inline void int2char(uint64_t integer, char* buf) {
-  *(uint64_t*)buf = integer;
+// rewrite live records to a new file which replaces the log by rename,
+// a crash before rename leaves the old log. caller holds lock_ exclusively.
+bool PmemKV::Compact_() {
+  if (pinned_ || index_.size() == nr_records_)
+    return false;
+  std::string tmp_path = path_ + ".compact";
+  std::filesystem::remove(tmp_path);
+  Record* log;
+  size_t capacity, mapped_len;
+  void* addr = Map_(tmp_path, mapped_len_, log, capacity, mapped_len);
+  size_t cnt = 0;
+  for (auto& kv : index_) {
+    log[cnt].key = kv.first;
+    log[cnt].value = kv.second;
+    log[cnt].type = PUT;
+    cnt++;
+  }
+  for (size_t i = 0; i < cnt; i += 64 / sizeof(Record))
+    cacheline_flush(&log[i]);
+  memory_fence();
+  std::filesystem::rename(tmp_path, path_);
+  pmem_unmap(pmem_addr_, mapped_len_);
+  pmem_addr_ = addr;
+  mapped_len_ = mapped_len;
+  log_ = log;
+  capacity_ = capacity;
+  nr_records_ = cnt;
+  LOG(Debug::INFO, "compact pmemkv log to %ld records", cnt);
+  return true;
 }
 
-} // anonymous namespace
+// caller holds lock_ exclusively
+bool PmemKV::Append_(uint64_t key, uint64_t value, RecordType type) {
+  if (nr_records_ == capacity_ && !Compact_()) {
+    LOG(Debug::ERROR, "log is full!");
+    return false;
+  }
+  Record& r = log_[nr_records_++];
+  r.key = key;
+  r.value = value;
+  // same cache line, type can not be persisted before key and value
+  r.type = type;
+  cacheline_flush(&r);
+  memory_fence();
+  return true;
+}
 
 bool PmemKV::Put(uint64_t key, uint64_t value) {
   WriteRef_();
-  if (!write_valid_.load(std::memory_order_acquire))
+  if (!write_valid_.load()) {
+    WriteUnRef_();
     return false;
-  char key_buf[sizeof(uint64_t)];
-  char value_buf[sizeof(uint64_t)];
-  int2char(key, key_buf);
-  int2char(value, value_buf);
-
-  auto s = db_->put(string_view(key_buf, sizeof(uint64_t)),
-                    string_view(value_buf, sizeof(uint64_t)));
+  }
+  bool ret;
+  {
+    std::lock_guard<std::shared_mutex> lock(lock_);
+    ret = Append_(key, value, PUT);
+    if (ret)
+      index_[key] = value;
+  }
   WriteUnRef_();
-  return s == status::OK;
+  return ret;
 }
 
 bool PmemKV::Get(uint64_t key, uint64_t& value) const {
   ReadRef_();
-  if (!read_valid_.load(std::memory_order_acquire))
+  if (!read_valid_.load()) {
+    ReadUnRef_();
     return false;
-  char key_buf[sizeof(uint64_t)];
-  int2char(key, key_buf);
-
-  auto s = db_->get(string_view(key_buf, sizeof(uint64_t)),
-      [&](string_view value_str){ value = *(uint64_t*)value_str.data(); });
+  }
+  bool ret = false;
+  {
+    std::shared_lock<std::shared_mutex> lock(lock_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      value = it->second;
+      ret = true;
+    }
+  }
   ReadUnRef_();
-  return s == status::OK;
+  return ret;
 }
 
 bool PmemKV::Delete(uint64_t key) {
   WriteRef_();
-  if (!write_valid_.load(std::memory_order_acquire))
+  if (!write_valid_.load()) {
+    WriteUnRef_();
     return false;
-  char key_buf[sizeof(uint64_t)];
-  int2char(key, key_buf);
-  auto s = db_->remove(string_view(key_buf, sizeof(uint64_t)));
+  }
+  bool ret = true;
+  {
+    std::lock_guard<std::shared_mutex> lock(lock_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      ret = Append_(key, 0, DELETE);
+      if (ret)
+        index_.erase(it);
+    }
+  }
   WriteUnRef_();
-  return s == status::OK || s == status::NOT_FOUND;
+  return ret;
 }
 
 size_t PmemKV::Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
                     std::vector<std::pair<uint64_t,uint64_t>>& kv) const {
   ReadRef_();
-  char key_buf[sizeof(uint64_t)];
-  int2char(min_key, key_buf);
-  db_->get_all(
-    [&](string_view key_str, string_view value_str) {
-      uint64_t key = *(uint64_t*)key_str.data();
-      uint64_t value = *(uint64_t*)value_str.data();
-      if (key <= max_key && key >= min_key)
-        kv.emplace_back(key, value);
-      return 0;
-    });
+  {
+    std::shared_lock<std::shared_mutex> lock(lock_);
+    for (auto it = index_.lower_bound(min_key);
+         it != index_.end() && it->first <= max_key && kv.size() < max_size; ++it)
+      kv.emplace_back(it->first, it->second);
+  }
   ReadUnRef_();
-  std::sort(kv.begin(), kv.end());
-  if (kv.size() > max_size)
-    kv.resize(max_size);
   return kv.size();
 }
 
 size_t PmemKV::Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
                     void (*callback)(uint64_t,uint64_t,void*), void* arg) const {
+  // callback runs without lock_
   std::vector<std::pair<uint64_t,uint64_t>> kv;
   Scan(min_key, max_key, max_size, kv);
   for (auto& pair : kv)
@@ -106,4 +186,24 @@ size_t PmemKV::Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
   return kv.size();
 }
 
-} // namespace combotree
\ No newline at end of file
+size_t PmemKV::Snapshot(std::vector<std::pair<uint64_t,uint64_t>>& kv) {
+  std::lock_guard<std::shared_mutex> lock(lock_);
+  kv.assign(index_.begin(), index_.end());
+  pinned_ = true;
+  return nr_records_;
+}
+
+void PmemKV::Unpin() {
+  std::lock_guard<std::shared_mutex> lock(lock_);
+  pinned_ = false;
+}
+
+size_t PmemKV::Replay(size_t from, void (*callback)(uint64_t,uint64_t,bool,void*),
+                      void* arg) const {
+  std::shared_lock<std::shared_mutex> lock(lock_);
+  for (size_t i = from; i < nr_records_; ++i)
+    callback(log_[i].key, log_[i].value, log_[i].type == DELETE, arg);
+  return nr_records_ - from;
+}
+
+} // namespace combotree
@@ -2,49 +2,76 @@
 
 #include <cassert>
 #include <cstdlib>
-#include <libpmemkv.hpp>
+#include <string>
 #include <vector>
+#include <map>
 #include <atomic>
 #include <mutex>
-#include <algorithm>
-#include <vector>
+#include <shared_mutex>
 
 namespace combotree {
 
-using pmem::kv::status;
-using pmem::kv::string_view;
-
 namespace {
 
 const uint64_t SIZE = 512 * 1024UL * 1024UL;
 
 } // anonymous namespace
 
+// small tree stage before migrating to combotree. every write is appended
+// to a persistent log, a sorted index in DRAM serves reads and scans and
+// is rebuilt from the log on recovery. a full log is compacted to its
+// live records.
 class PmemKV {
  public:
-  explicit PmemKV(std::string path, size_t size = SIZE,
-                  std::string engine = "cmap", bool force_create = true);
+  explicit PmemKV(std::string path, size_t size = SIZE, bool force_create = true);
+  ~PmemKV();
 
   bool Put(uint64_t key, uint64_t value);
-  bool Update(uint64_t key, uint64_t value);
   bool Get(uint64_t key, uint64_t& value) const;
   bool Delete(uint64_t key);
   size_t Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
               void (*callback)(uint64_t,uint64_t,void*), void* arg) const;
   size_t Scan(uint64_t min_key, uint64_t max_key, uint64_t max_size,
               std::vector<std::pair<uint64_t,uint64_t>>& kv) const;
+  // copy live pairs, return the log position they reflect. records after
+  // it are not compacted away until Unpin().
+  size_t Snapshot(std::vector<std::pair<uint64_t,uint64_t>>& kv);
+  void Unpin();
+  // records appended since a snapshot in order, writers must be stopped
+  size_t Replay(size_t from, void (*callback)(uint64_t,uint64_t,bool,void*),
+                void* arg) const;
 
   size_t Size() const {
     ReadRef_();
-    if (!read_valid_.load(std::memory_order_acquire))
+    if (!read_valid_.load()) {
+      ReadUnRef_();
       return -1;
+    }
     size_t size;
-    [[maybe_unused]] auto s = db_->count_all(size);
-    assert(s == status::OK);
+    {
+      std::shared_lock<std::shared_mutex> lock(lock_);
+      size = index_.size();
+    }
     ReadUnRef_();
     return size;
   }
 
+  // no record can be appended, even after compaction
+  bool Full() const {
+    ReadRef_();
+    if (!read_valid_.load()) {
+      ReadUnRef_();
+      return false;
+    }
+    bool full;
+    {
+      std::shared_lock<std::shared_mutex> lock(lock_);
+      full = index_.size() == capacity_;
+    }
+    ReadUnRef_();
+    return full;
+  }
+
   bool NoWriteRef() const { return write_ref_.load() == 0; }
   bool NoReadRef() const { return read_ref_.load() == 0; }
 
@@ -53,7 +80,8 @@ class PmemKV {
   }
 
   static void SetWriteUnvalid() {
-    write_valid_.store(false, std::memory_order_release);
+    // seq_cst, pairs with WriteRef_() then load in writers
+    write_valid_.store(false);
   }
 
   static void SetReadValid() {
@@ -61,21 +89,51 @@ class PmemKV {
   }
 
   static void SetReadUnvalid() {
-    read_valid_.store(false, std::memory_order_release);
+    read_valid_.store(false);
   }
 
  private:
-  pmem::kv::db* db_;
+  enum RecordType : uint64_t {
+    EMPTY = 0,
+    PUT,
+    DELETE,
+  };
+
+  // type is written last, a record is valid once its type is persisted.
+  // padded so that a record never crosses a cache line.
+  struct Record {
+    uint64_t key;
+    uint64_t value;
+    uint64_t type;
+    uint64_t reserved;
+  };
+
+  static_assert(sizeof(Record) == 32, "");
+
+  std::string path_;
+  void* pmem_addr_;
+  size_t mapped_len_;
+  Record* log_;
+  size_t capacity_;
+  size_t nr_records_;
+  bool pinned_;
+  std::map<uint64_t, uint64_t> index_;
+  mutable std::shared_mutex lock_;
   mutable std::atomic<int> write_ref_;
   mutable std::atomic<int> read_ref_;
 
   static std::atomic<bool> write_valid_;
   static std::atomic<bool> read_valid_;
 
+  static void* Map_(const std::string& path, size_t size, Record*& log,
+                    size_t& capacity, size_t& mapped_len);
+  bool Compact_();
+  bool Append_(uint64_t key, uint64_t value, RecordType type);
+
   void WriteRef_() const { write_ref_++; }
   void WriteUnRef_() const { write_ref_--; }
   void ReadRef_() const { read_ref_++; }
   void ReadUnRef_() const { read_ref_--; }
 };
 
-} // namespace combotree
\ No newline at end of file
+} // namespace combotree
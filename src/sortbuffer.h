@@ -188,6 +188,81 @@ struct SortBuffer {
     return Put(pos, &new_key, value);
   }
 
+  // put ascending keys, existing keys are updated. stops before the last
+  // free slot is taken, return pairs consumed. like Append(), new pairs and
+  // new values of existing keys are written to free slots and persisted
+  // first, then published by one header store.
+  int PutSorted(const uint64_t* keys, const uint64_t* values, int n) {
+    // sorted position -> slot, slots after new_entries are free. slots
+    // beyond max_entries are at the bottom of free ones and never taken.
+    int slot[12];
+    for (int pos = 0; pos < 12; ++pos)
+      slot[pos] = index(pos);
+    int new_entries = entries;
+    int unusable = 12 - max_entries;
+    int fresh = max_entries - entries;  // free slots not written in this call
+    int i, pos = 0;
+    for (i = 0; i < n; ++i) {
+      // keys are ascending, search from last position
+      while (pos < new_entries && key(slot[pos], keys[i]) < keys[i])
+        pos++;
+      bool exist = pos < new_entries && key(slot[pos], keys[i]) == keys[i];
+      if (fresh == 0 || (!exist && new_entries >= max_entries - 1))
+        break;
+      int target_idx = slot[11];
+      fresh--;
+      memcpy(pvalue(target_idx), &values[i], value_size);
+      memcpy(pkey(target_idx), &keys[i], suffix_bytes);
+      if (exist) {
+        // old slot is free once published, it goes below fresh slots
+        int old_idx = slot[pos];
+        slot[pos] = target_idx;
+        std::copy_backward(&slot[new_entries+unusable], &slot[11], &slot[12]);
+        slot[new_entries+unusable] = old_idx;
+      } else {
+        std::copy_backward(&slot[pos], &slot[11], &slot[12]);
+        slot[pos] = target_idx;
+        new_entries++;
+      }
+    }
+    if (i == 0)
+      return 0;
+
+    uint64_t perm = 0;
+    for (int pos = 11; pos >= 0; --pos)
+      perm = (perm << 4) | slot[pos];
+    // entries is bit 8-11 of header
+    uint64_t new_header = (header & 0xF0FFUL) | ((uint64_t)new_entries << 8) | (perm << 16);
+    cacheline_flush(&buf[0]);
+    cacheline_flush(&buf[buf_size-1]);
+    memory_fence();
+    header = new_header;
+    cacheline_flush(&header);
+    memory_fence();
+    return i;
+  }
+
+  // append pairs of src, whose keys are all bigger. pairs are written to
+  // free slots and persisted first, then published by one header store.
+  void Append(const SortBuffer<buf_size, value_size>& src) {
+    assert(entries + src.entries < max_entries);
+    uint64_t new_header = header;
+    for (int i = 0; i < src.entries; ++i) {
+      int target_idx = _bextr_u64(new_header, 16+11*4, 4);
+      memcpy(pvalue(target_idx), src.sort_pvalue(i), value_size);
+      memcpy(pkey(target_idx), src.sort_pkey(i), suffix_bytes);
+      new_header = circular_lshift(new_header, 16+4*(entries+i), 4);
+    }
+    // entries is bit 8-11 of header
+    new_header = (new_header & ~(0xFUL << 8)) | ((uint64_t)(entries + src.entries) << 8);
+    cacheline_flush(&buf[0]);
+    cacheline_flush(&buf[buf_size-1]);
+    memory_fence();
+    header = new_header;
+    cacheline_flush(&header);
+    memory_fence();
+  }
+
   ALWAYS_INLINE bool Delete(int pos) {
     header = circular_rshift(header, 16+4*pos, 4);
     entries--;
@@ -212,6 +287,26 @@ struct SortBuffer {
     entries = start_pos;
   }
 
+  // pairs in slots [0, n) are in sorted order, other slots are free
+  ALWAYS_INLINE void SetSorted(int n) {
+    uint64_t perm = 0;
+    for (int pos = 11; pos >= 0; --pos)
+      perm = (perm << 4) | (pos < n ? pos : 11 + n - pos);
+    header = (header & 0xFFFFUL) | (perm << 16);
+    entries = n;
+  }
+
+  // copy pairs of a smaller buffer in sorted order
+  template<const size_t src_size>
+  void FromSortBuffer(const SortBuffer<src_size,value_size>& src) {
+    static_assert(src_size <= buf_size, "");
+    for (int i = 0; i < src.entries; ++i) {
+      memcpy(pkey(i), src.sort_pkey(i), suffix_bytes);
+      memcpy(pvalue(i), src.sort_pvalue(i), value_size);
+    }
+    SetSorted(src.entries);
+  }
+
   void FromKVBuffer(KVBuffer<buf_size,value_size>& blevel_buf) {
     entries = blevel_buf.entries;
     memcpy(buf, &blevel_buf.buf, sizeof(blevel_buf.buf));
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include "combotree_config.h"
+
+namespace combotree {
+namespace stats {
+
+// process wide counters, compiled in with STATISTICS. each thread bumps
+// its own cache line, Snapshot() sums all threads.
+enum Counter {
+  FLUSH,              // cacheline_flush calls
+  FENCE,              // memory_fence calls
+  FLUSH_TO_CLEVEL,    // BLevel entry buffer flushed to CLevel
+  CLEVEL_SPLIT,       // CLevel node splits
+  ALLOC_BYTES,        // bytes of CLevel nodes allocated
+  EXPANSION,          // expansions finished
+  EXPANSION_TIME_US,  // time spent in expansion
+  EXPAND_WAIT,        // threads slept on expand_wait_cv
+  PUT_RETRY,          // extra loops in ComboTree::Put
+  COUNTER_NUM,
+};
+
+#ifdef STATISTICS
+
+struct alignas(64) ThreadCounters {
+  std::atomic<uint64_t> c[COUNTER_NUM];
+};
+
+class Registry {
+ public:
+  static Registry& Get() {
+    static Registry registry;
+    return registry;
+  }
+
+  void Register(ThreadCounters* t) {
+    std::lock_guard<std::mutex> lock(lock_);
+    threads_.push_back(t);
+  }
+
+  // counters of exited threads are kept in retired_
+  void Unregister(ThreadCounters* t) {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (int i = 0; i < COUNTER_NUM; ++i)
+      retired_[i] += t->c[i].load(std::memory_order_relaxed);
+    threads_.erase(std::find(threads_.begin(), threads_.end(), t));
+  }
+
+  void Snapshot(uint64_t* out) {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (int i = 0; i < COUNTER_NUM; ++i) {
+      out[i] = retired_[i];
+      for (auto t : threads_)
+        out[i] += t->c[i].load(std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  std::mutex lock_;
+  std::vector<ThreadCounters*> threads_;
+  uint64_t retired_[COUNTER_NUM] = {};
+};
+
+struct LocalCounters : ThreadCounters {
+  LocalCounters() {
+    for (int i = 0; i < COUNTER_NUM; ++i)
+      c[i].store(0, std::memory_order_relaxed);
+    Registry::Get().Register(this);
+  }
+  ~LocalCounters() { Registry::Get().Unregister(this); }
+};
+
+inline thread_local LocalCounters local_counters;
+
+// only the owner thread writes, no atomic rmw needed
+inline void Add(Counter counter, uint64_t n) {
+  auto& c = local_counters.c[counter];
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline void Snapshot(uint64_t* out) {
+  Registry::Get().Snapshot(out);
+}
+
+#define STATS_ADD(counter, n) combotree::stats::Add(combotree::stats::counter, (n))
+
+#else
+
+inline void Snapshot(uint64_t* out) {
+  std::fill(out, out + COUNTER_NUM, 0);
+}
+
+#define STATS_ADD(counter, n) do {} while (0)
+
+#endif // STATISTICS
+
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+
+} // namespace stats
+} // namespace combotree
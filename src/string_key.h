@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <algorithm>
+#include "value_log.h"
+#include "pmem.h"
+
+namespace combotree {
+
+// order-preserving 8-byte key of a string: first 7 bytes big-endian,
+// zero padded, then the length if it is at most 7, or 8 for longer
+// strings. a short string is the tree key itself, longer strings with
+// the same 7 bytes share one chain in the value log. keys never reach
+// UINT64_MAX, which BLevel uses as end of ranges.
+namespace string_key {
+
+static constexpr size_t INLINE_LEN = 7;
+static constexpr uint8_t LONG_MARK = INLINE_LEN + 1;
+
+inline uint64_t Encode(std::string_view key) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < INLINE_LEN; ++i)
+    prefix = (prefix << 8) | (i < key.size() ? (uint8_t)key[i] : 0);
+  return (prefix << 8) | (key.size() <= INLINE_LEN ? key.size() : LONG_MARK);
+}
+
+inline bool IsInline(uint64_t prefix) {
+  return (prefix & 0xFF) != LONG_MARK;
+}
+
+// string of an inline key
+inline std::string Decode(uint64_t prefix) {
+  std::string key(prefix & 0xFF, '\0');
+  for (size_t i = 0; i < key.size(); ++i)
+    key[i] = (char)(prefix >> (56 - 8 * i));
+  return key;
+}
+
+// a long string is one record of the value log, | value | string |, whose
+// key is the prefix. records of a prefix are found from a chain of
+// nodes, also in the value log, and the tree slot of the prefix points to
+// the first. strings are sorted along the chain, slots of a node are
+// filled from the front. a node is never changed but for 8-byte stores
+// of next and of handles moved by gc, a put or delete writes a copy and
+// links it in place of the node, so lockless readers see sorted nodes.
+// writers hold KeyLock(prefix).
+static constexpr uint64_t EMPTY = ValueLog::INVALID_HANDLE;
+
+struct Node {
+  static constexpr int SLOTS = 15;
+  struct Slot {
+    uint64_t chunk;       // Chunk() of string, compared before the string
+    uint64_t handle;      // record of string, EMPTY if free
+  };
+  uint64_t next;          // handle of next node, EMPTY if last
+  Slot slot[SLOTS];
+
+  static constexpr size_t NextOffset() { return 0; }
+  static constexpr size_t HandleOffset(int i) { return 16 + 16 * i; }
+
+  int Used() const {
+    int n = 0;
+    while (n < SLOTS && slot[n].handle != EMPTY)
+      n++;
+    return n;
+  }
+
+  // first slot whose string is not less than key, n if none. cmp(i)
+  // compares the string of slot i with key, only if their chunks tie.
+  template <typename Cmp>
+  int LowerBound(int n, uint64_t chunk, Cmp cmp) const {
+    int left = 0, right = n;
+    while (left < right) {
+      int middle = (left + right) / 2;
+      uint64_t mid_chunk = slot[middle].chunk;
+      if (mid_chunk < chunk || (mid_chunk == chunk && cmp(middle) < 0))
+        left = middle + 1;
+      else
+        right = middle;
+    }
+    return left;
+  }
+};
+
+// string bytes [7, 15) big-endian, zero padded
+inline uint64_t Chunk(std::string_view key) {
+  uint64_t chunk = 0;
+  for (size_t i = INLINE_LEN; i < INLINE_LEN + 8; ++i)
+    chunk = (chunk << 8) | (i < key.size() ? (uint8_t)key[i] : 0);
+  return chunk;
+}
+
+ALWAYS_INLINE std::string_view RecordKey(const void* data, size_t size) {
+  return std::string_view((const char*)data + 8, size - 8);
+}
+
+ALWAYS_INLINE uint64_t RecordValue(const void* data) {
+  return *(const uint64_t*)data;
+}
+
+inline uint64_t NewRecord(ValueLog* log, uint64_t prefix, std::string_view key,
+                          uint64_t value) {
+  std::string data((const char*)&value, 8);
+  data.append(key);
+  return log->Append(prefix, data.data(), data.size());
+}
+
+// node of n sorted slots
+inline uint64_t NewNode(ValueLog* log, uint64_t prefix, const Node::Slot* slots,
+                        int n, uint64_t next) {
+  Node node;
+  node.next = next;
+  for (int i = 0; i < Node::SLOTS; ++i)
+    node.slot[i] = i < n ? slots[i] : Node::Slot{0, EMPTY};
+  return log->Append(prefix, &node, sizeof(node));
+}
+
+// where a string is in a chain, or is to be put if it is not
+struct Position {
+  uint64_t prev = EMPTY;  // node linking to node, EMPTY if node is the head
+  uint64_t node = EMPTY;
+  int slot = -1;          // slot of string, or the one it is put before
+};
+
+// caller holds KeyLock(prefix), so records are not moved by gc
+inline bool Find(const ValueLog* log, uint64_t head, std::string_view key, Position& pos) {
+  uint64_t chunk = Chunk(key);
+  for (uint64_t h = head; h != EMPTY; h = ((const Node*)log->Data(h))->next) {
+    const Node* node = (const Node*)log->Data(h);
+    auto cmp = [&](int i) {
+      uint64_t record = node->slot[i].handle;
+      return RecordKey(log->Data(record), log->Size(record)).compare(key);
+    };
+    int n = node->Used();
+    int i = node->LowerBound(n, chunk, cmp);
+    pos.node = h;
+    pos.slot = i;
+    // bigger than strings of node, the next one may hold it
+    if (i == n && node->next != EMPTY) {
+      pos.prev = h;
+      continue;
+    }
+    return i < n && node->slot[i].chunk == chunk && cmp(i) == 0;
+  }
+  return false;
+}
+
+// lockless lookup. false if a record is moved by gc meanwhile, then look
+// up again from the tree.
+inline bool Get(const ValueLog* log, uint64_t head, std::string_view key,
+                uint64_t& value, bool& found) {
+  uint64_t chunk = Chunk(key);
+  found = false;
+  for (uint64_t h = head; h != EMPTY;) {
+    const void* data;
+    size_t size;
+    if (!log->Pin(h, data, size))
+      return false;
+    const Node* node = (const Node*)data;
+    bool moved = false;
+    auto cmp = [&](int i) {
+      uint64_t record = node->slot[i].handle;
+      const void* record_data;
+      size_t record_size;
+      if (!log->Pin(record, record_data, record_size)) {
+        moved = true;
+        return 0;
+      }
+      int ret = RecordKey(record_data, record_size).compare(key);
+      if (ret == 0)
+        value = RecordValue(record_data);
+      log->Unpin(record);
+      return ret;
+    };
+    int n = node->Used();
+    int i = node->LowerBound(n, chunk, cmp);
+    if (!moved && i < n)
+      found = node->slot[i].chunk == chunk && cmp(i) == 0;
+    uint64_t next = node->next;
+    log->Unpin(h);
+    if (moved)
+      return false;
+    // strings of later nodes are bigger
+    if (i < n)
+      break;
+    h = next;
+  }
+  return true;
+}
+
+// copy of pos.node with the string put at pos.slot, split into two nodes
+// if it is full. the copy links to the next of pos.node. false if the
+// log is full.
+inline bool CopyPut(ValueLog* log, uint64_t prefix, const Position& pos,
+                    uint64_t chunk, uint64_t record, uint64_t& copy) {
+  const Node* node = (const Node*)log->Data(pos.node);
+  int n = node->Used();
+  Node::Slot slots[Node::SLOTS + 1];
+  std::copy(node->slot, node->slot + pos.slot, slots);
+  slots[pos.slot] = {chunk, record};
+  std::copy(node->slot + pos.slot, node->slot + n, slots + pos.slot + 1);
+  n++;
+  if (n <= Node::SLOTS) {
+    copy = NewNode(log, prefix, slots, n, node->next);
+    return copy != EMPTY;
+  }
+  // strings put in order fill the last node up
+  int half = (pos.slot == Node::SLOTS && node->next == EMPTY) ? Node::SLOTS : n / 2;
+  uint64_t right = NewNode(log, prefix, slots + half, n - half, node->next);
+  if (right == EMPTY)
+    return false;
+  copy = NewNode(log, prefix, slots, half, right);
+  if (copy == EMPTY) {
+    log->Kill(right);
+    return false;
+  }
+  return true;
+}
+
+// copy of pos.node without the string at pos.slot, or its next if no
+// string is left. false if the log is full.
+inline bool CopyDelete(ValueLog* log, uint64_t prefix, const Position& pos, uint64_t& copy) {
+  const Node* node = (const Node*)log->Data(pos.node);
+  int n = node->Used();
+  if (n == 1) {
+    copy = node->next;
+    return true;
+  }
+  Node::Slot slots[Node::SLOTS];
+  std::copy(node->slot, node->slot + pos.slot, slots);
+  std::copy(node->slot + pos.slot + 1, node->slot + n, slots + pos.slot);
+  copy = NewNode(log, prefix, slots, n - 1, node->next);
+  return copy != EMPTY;
+}
+
+// nodes of a copy of node which is not linked
+inline void KillCopy(ValueLog* log, uint64_t copy, uint64_t node) {
+  uint64_t end = ((const Node*)log->Data(node))->next;
+  for (uint64_t h = copy; h != end;) {
+    uint64_t next = ((const Node*)log->Data(h))->next;
+    log->Kill(h);
+    h = next;
+  }
+}
+
+// strings of a chain in order, caller holds KeyLock(prefix)
+inline void Collect(const ValueLog* log, uint64_t head,
+                    std::vector<std::pair<std::string, uint64_t>>& kv) {
+  kv.clear();
+  for (uint64_t h = head; h != EMPTY; h = ((const Node*)log->Data(h))->next) {
+    const Node* node = (const Node*)log->Data(h);
+    for (int i = 0, n = node->Used(); i < n; ++i) {
+      const void* data = log->Data(node->slot[i].handle);
+      kv.emplace_back(RecordKey(data, log->Size(node->slot[i].handle)), RecordValue(data));
+    }
+  }
+}
+
+// records of a chain are live
+inline void Recover(ValueLog* log, uint64_t head) {
+  for (uint64_t h = head; h != EMPTY; h = ((const Node*)log->Data(h))->next) {
+    log->Recover(h);
+    for (auto& slot : ((const Node*)log->Data(h))->slot)
+      if (slot.handle != EMPTY)
+        log->Recover(slot.handle);
+  }
+}
+
+// move a node or record of the chain from head to the tail of gc, the
+// head is moved by set_head, which returns false if the tree rejects it.
+// caller holds KeyLock(prefix). false if the log is full or the head is
+// not moved.
+template <typename SetHead>
+bool Move(ValueLog* log, uint64_t prefix, uint64_t head, uint64_t handle,
+          const void* data, size_t size, SetHead set_head) {
+  // the node or slot pointing to handle, EMPTY if it is the head
+  uint64_t ref = EMPTY;
+  size_t off = 0;
+  for (uint64_t h = head; head != handle && h != EMPTY && ref == EMPTY;
+       h = ((const Node*)log->Data(h))->next) {
+    const Node* node = (const Node*)log->Data(h);
+    if (node->next == handle) {
+      ref = h;
+      off = Node::NextOffset();
+    }
+    for (int i = 0; i < Node::SLOTS; ++i) {
+      if (node->slot[i].handle == handle) {
+        ref = h;
+        off = Node::HandleOffset(i);
+      }
+    }
+  }
+  // dead
+  if (head != handle && ref == EMPTY)
+    return true;
+  uint64_t moved = log->Append(prefix, data, size, true);
+  if (moved == ValueLog::INVALID_HANDLE)
+    return false;
+  if (ref == EMPTY) {
+    if (!set_head(moved)) {
+      log->Kill(moved);
+      return false;
+    }
+  } else {
+    log->Write(ref, off, moved);
+  }
+  return true;
+}
+
+} // namespace string_key
+} // namespace combotree
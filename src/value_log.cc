@@ -0,0 +1,284 @@
+#include <cassert>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#include <libpmem.h>
+#include "combotree_config.h"
+#include "value_log.h"
+#include "pmem.h"
+#include "debug.h"
+
+namespace combotree {
+
+std::atomic<uint64_t> ValueLog::next_id_(1);
+std::mutex ValueLog::logs_lock_;
+std::unordered_map<uint64_t, ValueLog*> ValueLog::logs_;
+
+struct ValueLog::Tails {
+  static constexpr int SLOTS = 4;
+  struct {
+    uint64_t id;
+    int segment;
+  } slot[SLOTS] = {};
+
+  ~Tails() {
+    for (auto& tail : slot)
+      if (tail.id != 0)
+        SealTail_(tail.id, tail.segment);
+  }
+};
+
+void ValueLog::SealTail_(uint64_t id, int segment) {
+  std::lock_guard<std::mutex> lock(logs_lock_);
+  auto it = logs_.find(id);
+  if (it != logs_.end() && segment >= 0)
+    it->second->Seal_(segment);
+}
+
+ValueLog::ValueLog(std::string path, size_t size, bool create)
+    : id_(next_id_++), stop_(false)
+{
+  int is_pmem;
+  if (create) {
+    std::filesystem::remove(path);
+    pmem_addr_ = pmem_map_file(path.c_str(), size + VALUE_LOG_SEGMENT_SIZE,
+                 PMEM_FILE_CREATE | PMEM_FILE_EXCL, 0666, &mapped_len_, &is_pmem);
+  } else {
+    pmem_addr_ = pmem_map_file(path.c_str(), 0, 0, 0666, &mapped_len_, &is_pmem);
+  }
+#ifdef PERSIST_PMEM
+  assert(is_pmem == 1);
+#endif
+  if (pmem_addr_ == nullptr) {
+    perror("ValueLog::ValueLog(): pmem_map_file");
+    exit(1);
+  }
+  // aligned at 64-bytes
+  base_ = (uint8_t*)pmem_addr_;
+  if (((uintptr_t)base_ & (uintptr_t)63) != 0)
+    base_ = (uint8_t*)(((uintptr_t)base_+64) & ~(uintptr_t)63);
+  nr_segments_ = (mapped_len_ - (base_ - (uint8_t*)pmem_addr_)) / VALUE_LOG_SEGMENT_SIZE;
+  assert(nr_segments_ * VALUE_LOG_SEGMENT_SIZE < (1UL << OFFSET_BITS));
+  segments_ = new Segment[nr_segments_];
+  // segments of an old file are free until Recover() sees them used
+  for (int i = nr_segments_ - 1; i >= 0; --i)
+    free_.push_back(i);
+
+  std::lock_guard<std::mutex> lock(logs_lock_);
+  logs_[id_] = this;
+}
+
+ValueLog::~ValueLog() {
+  {
+    std::lock_guard<std::mutex> lock(logs_lock_);
+    logs_.erase(id_);
+  }
+  delete[] segments_;
+  pmem_unmap(pmem_addr_, mapped_len_);
+}
+
+uint64_t ValueLog::Append(uint64_t key, const void* data, size_t size, bool gc) {
+  uint64_t len = RecordSize_(size);
+  if (len > VALUE_LOG_SEGMENT_SIZE)
+    return INVALID_HANDLE;
+
+  // tail segment of this thread, slot is chosen by id of log
+  static thread_local Tails tails;
+  auto& tail = tails.slot[id_ % Tails::SLOTS];
+  if (tail.id != id_) {
+    // slot was used by another log
+    if (tail.id != 0)
+      SealTail_(tail.id, tail.segment);
+    tail.id = id_;
+    tail.segment = NewSegment_(gc);
+  } else if (tail.segment < 0 || segments_[tail.segment].used.load(std::memory_order_relaxed) + len >
+             VALUE_LOG_SEGMENT_SIZE) {
+    if (tail.segment >= 0)
+      Seal_(tail.segment);
+    tail.segment = NewSegment_(gc);
+  }
+  if (tail.segment < 0) {
+    LOG(Debug::ERROR, "value log is full!");
+    return INVALID_HANDLE;
+  }
+
+  Segment& seg = segments_[tail.segment];
+  uint64_t file_off = tail.segment * VALUE_LOG_SEGMENT_SIZE + seg.used.load(std::memory_order_relaxed);
+  Record* r = (Record*)(base_ + file_off);
+  r->key = key;
+  r->size = size;
+  memcpy(r->data, data, size);
+  // the record is not referenced before it is persisted, no order needed
+  for (uint64_t line = (uint64_t)r & ~63UL; line < (uint64_t)r + len; line += 64)
+    cacheline_flush((void*)line);
+  memory_fence();
+  seg.used.store(seg.used.load(std::memory_order_relaxed) + len, std::memory_order_release);
+  return Handle_(seg.gen.load(std::memory_order_relaxed), file_off);
+}
+
+void ValueLog::Write(uint64_t handle, size_t off, uint64_t value) {
+  uint64_t* dst = (uint64_t*)((uint8_t*)Data(handle) + off);
+  assert(((uintptr_t)dst & 7) == 0);
+  *dst = value;
+  cacheline_flush(dst);
+  memory_fence();
+}
+
+void ValueLog::Kill(uint64_t handle) {
+  uint64_t file_off = Offset_(handle);
+  int segment = file_off / VALUE_LOG_SEGMENT_SIZE;
+  segments_[segment].dead.fetch_add(RecordSize_(RecordAt_(file_off)->size));
+  CheckVictim_(segment);
+}
+
+bool ValueLog::Pin(uint64_t handle, const void*& data, size_t& size) const {
+  uint64_t file_off = Offset_(handle);
+  const Segment& seg = segments_[file_off / VALUE_LOG_SEGMENT_SIZE];
+  // pairs with Release(), which sets RELEASING before checking pins
+  seg.pins.fetch_add(1);
+  int state = seg.state.load();
+  if (state == FREE || state == RELEASING || seg.gen.load() != Gen_(handle)) {
+    seg.pins.fetch_sub(1);
+    return false;
+  }
+  const Record* r = RecordAt_(file_off);
+  data = r->data;
+  size = r->size;
+  return true;
+}
+
+void ValueLog::Unpin(uint64_t handle) const {
+  segments_[Offset_(handle) / VALUE_LOG_SEGMENT_SIZE].pins.fetch_sub(1);
+}
+
+void ValueLog::Recover(uint64_t handle) {
+  uint64_t file_off = Offset_(handle);
+  Segment& seg = segments_[file_off / VALUE_LOG_SEGMENT_SIZE];
+  // live records of a segment are written in one generation
+  seg.state.store(SEALED, std::memory_order_relaxed);
+  seg.gen.store(Gen_(handle), std::memory_order_relaxed);
+  uint64_t len = RecordSize_(RecordAt_(file_off)->size);
+  uint64_t end = file_off % VALUE_LOG_SEGMENT_SIZE + len;
+  if (seg.used.load(std::memory_order_relaxed) < end)
+    seg.used.store(end, std::memory_order_relaxed);
+  // count live bytes in dead, turned around in FinishRecovery()
+  seg.dead.fetch_add(len, std::memory_order_relaxed);
+}
+
+void ValueLog::FinishRecovery() {
+  std::lock_guard<std::mutex> lock(lock_);
+  free_.clear();
+  for (int i = nr_segments_ - 1; i >= 0; --i) {
+    Segment& seg = segments_[i];
+    if (seg.state.load() == FREE) {
+      free_.push_back(i);
+    } else {
+      seg.dead.store(seg.used.load() - seg.dead.load());
+      if (seg.dead.load() >= seg.used.load() * VALUE_LOG_GC_RATIO) {
+        seg.state.store(GC);
+        victims_.push_back(i);
+      }
+    }
+  }
+  gc_cv_.notify_one();
+}
+
+int ValueLog::NewSegment_(bool gc) {
+  // one segment is kept for gc
+  size_t keep = gc ? 0 : 1;
+  std::lock_guard<std::mutex> lock(lock_);
+  if (free_.size() <= keep)
+    Reclaim_();
+  if (free_.size() <= keep)
+    return -1;
+  int segment = free_.back();
+  free_.pop_back();
+  Segment& seg = segments_[segment];
+  seg.used.store(0, std::memory_order_relaxed);
+  seg.dead.store(0, std::memory_order_relaxed);
+  // handles of the last generation can not pin it any more
+  seg.gen.store((seg.gen.load() + 1) & GEN_MASK);
+  seg.state.store(ACTIVE);
+  return segment;
+}
+
+void ValueLog::Seal_(int segment) {
+  segments_[segment].state.store(SEALED);
+  CheckVictim_(segment);
+}
+
+void ValueLog::CheckVictim_(int segment) {
+  Segment& seg = segments_[segment];
+  if (seg.dead.load() < seg.used.load() * VALUE_LOG_GC_RATIO)
+    return;
+  int state = SEALED;
+  if (!seg.state.compare_exchange_strong(state, GC))
+    return;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    victims_.push_back(segment);
+  }
+  gc_cv_.notify_one();
+}
+
+int ValueLog::WaitVictim() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (true) {
+    Reclaim_();
+    if (stop_)
+      return -1;
+    if (!victims_.empty())
+      break;
+    // pinned segments are checked again later
+    if (releasing_.empty())
+      gc_cv_.wait(lock);
+    else
+      gc_cv_.wait_for(lock, std::chrono::milliseconds(1));
+  }
+  int segment = victims_.front();
+  victims_.pop_front();
+  return segment;
+}
+
+void ValueLog::Release(int segment) {
+  // readers pinned before RELEASING may still read the old records
+  segments_[segment].state.store(RELEASING);
+  std::lock_guard<std::mutex> lock(lock_);
+  releasing_.push_back(segment);
+  Reclaim_();
+}
+
+void ValueLog::Retry(int segment) {
+  // still in GC state, Kill() does not queue it again
+  std::lock_guard<std::mutex> lock(lock_);
+  victims_.push_back(segment);
+}
+
+// caller holds lock_
+void ValueLog::Reclaim_() {
+  for (auto it = releasing_.begin(); it != releasing_.end();) {
+    if (segments_[*it].pins.load() == 0) {
+      segments_[*it].state.store(FREE);
+      free_.push_back(*it);
+      it = releasing_.erase(it);
+    } else {
+      it++;
+    }
+  }
+}
+
+void ValueLog::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stop_ = true;
+  }
+  gc_cv_.notify_all();
+}
+
+size_t ValueLog::FreeSegments() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  return free_.size();
+}
+
+} // namespace combotree
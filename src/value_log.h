@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include "combotree_config.h"
+
+namespace combotree {
+
+// append-only persistent log of variable-length values. the tree keeps a
+// handle of the record, generation of the segment in the high bits and
+// file offset in the low bits. every thread appends to its own tail
+// segment. segments with enough dead records are picked by gc, their
+// live records are moved and the segment is reused.
+class ValueLog {
+ public:
+  static constexpr uint64_t INVALID_HANDLE = UINT64_MAX;
+
+  ValueLog(std::string path, size_t size, bool create);
+  ~ValueLog();
+
+  // return INVALID_HANDLE if value is too large or log is full. the last
+  // free segment is only taken by gc, so that a victim can always be moved.
+  uint64_t Append(uint64_t key, const void* data, size_t size, bool gc = false);
+  // record of handle is not referenced any more
+  void Kill(uint64_t handle);
+
+  // keep segment of handle from being reused, false if it is moved
+  // by gc after the handle is read
+  bool Pin(uint64_t handle, const void*& data, size_t& size) const;
+  void Unpin(uint64_t handle) const;
+
+  // record of handle read or changed in place by the holder of KeyLock of
+  // its key, gc does not move it meanwhile
+  void* Data(uint64_t handle) const {
+    return (void*)RecordAt_(Offset_(handle))->data;
+  }
+  size_t Size(uint64_t handle) const {
+    return RecordAt_(Offset_(handle))->size;
+  }
+  // store 8 bytes at off of record data and persist them
+  void Write(uint64_t handle, size_t off, uint64_t value);
+
+  // handle is referenced, called for every live record on recovery
+  void Recover(uint64_t handle);
+  void FinishRecovery();
+
+  // writers of the same key are serialized, so that gc does not move a
+  // record replaced meanwhile
+  std::mutex& KeyLock(uint64_t key) const {
+    return key_locks_[(key * 0x9E3779B97F4A7C15UL) >> (64 - KEY_LOCK_BITS)].lock;
+  }
+
+  // block until a segment needs gc, -1 after Stop()
+  int WaitVictim();
+  // call cb(key, handle, data, size) for every record of segment
+  template <typename Callback>
+  void ForEachRecord(int segment, Callback cb) const {
+    uint64_t off = 0;
+    uint64_t used = segments_[segment].used.load(std::memory_order_acquire);
+    while (off < used) {
+      uint64_t file_off = segment * VALUE_LOG_SEGMENT_SIZE + off;
+      const Record* r = RecordAt_(file_off);
+      cb(r->key, Handle_(segments_[segment].gen.load(), file_off), r->data, r->size);
+      off += RecordSize_(r->size);
+    }
+  }
+  // all live records of segment are moved, it is reused once unpinned
+  void Release(int segment);
+  // not all live records are moved, segment is picked again later
+  void Retry(int segment);
+  void Stop();
+
+  size_t FreeSegments() const;
+  size_t Segments() const { return nr_segments_; }
+
+ private:
+  struct Record {
+    uint64_t key;
+    uint64_t size;
+    uint8_t data[0];
+  };
+
+  enum SegmentState : int {
+    FREE,
+    ACTIVE,       // tail of a thread
+    SEALED,
+    GC,           // picked by gc
+    RELEASING,    // waiting for pins
+  };
+
+  struct __attribute__((aligned(64))) Segment {
+    std::atomic<int> state{FREE};
+    std::atomic<uint32_t> gen{0};
+    std::atomic<uint64_t> used{0};   // bytes appended
+    std::atomic<uint64_t> dead{0};   // bytes of killed records
+    mutable std::atomic<uint32_t> pins{0};
+  };
+
+  struct __attribute__((aligned(64))) StripeLock {
+    std::mutex lock;
+  };
+
+  static constexpr int KEY_LOCK_BITS = 10;
+  static constexpr int OFFSET_BITS = 40;
+  static constexpr uint32_t GEN_MASK = (1U << (64 - OFFSET_BITS)) - 1;
+
+  void* pmem_addr_;
+  size_t mapped_len_;
+  uint8_t* base_;
+  size_t nr_segments_;
+  Segment* segments_;
+  mutable StripeLock key_locks_[1 << KEY_LOCK_BITS];
+  uint64_t id_;
+  static std::atomic<uint64_t> next_id_;
+
+  // tail segments of a thread, sealed when the thread exits. logs_ finds
+  // the log of a tail, which may be destroyed before the thread.
+  struct Tails;
+  static std::mutex logs_lock_;
+  static std::unordered_map<uint64_t, ValueLog*> logs_;
+  static void SealTail_(uint64_t id, int segment);
+
+  mutable std::mutex lock_;         // guards free_, victims_ and releasing_
+  std::condition_variable gc_cv_;
+  std::vector<int> free_;
+  std::deque<int> victims_;
+  std::vector<int> releasing_;      // moved by gc, waiting for pins
+  bool stop_;
+
+  static uint64_t Handle_(uint32_t gen, uint64_t file_off) {
+    return ((uint64_t)gen << OFFSET_BITS) | file_off;
+  }
+  static uint64_t Offset_(uint64_t handle) {
+    return handle & ((1UL << OFFSET_BITS) - 1);
+  }
+  static uint32_t Gen_(uint64_t handle) {
+    return handle >> OFFSET_BITS;
+  }
+  static uint64_t RecordSize_(uint64_t size) {
+    return sizeof(Record) + ((size + 7) & ~7UL);
+  }
+  const Record* RecordAt_(uint64_t file_off) const {
+    return (const Record*)(base_ + file_off);
+  }
+
+  int NewSegment_(bool gc);
+  void Seal_(int segment);
+  void CheckVictim_(int segment);
+  void Reclaim_();
+};
+
+} // namespace combotree
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <x86intrin.h>
+
+namespace combotree {
+
+// 8-byte lock with the same interface as std::shared_mutex, plus optimistic
+// read. bit 0 is writer, bit 1 is a waiting writer, which keeps new shared
+// holders out, bits [2,16) are shared holders, bits [16,64) are version
+// which is increased on every unlock().
+class VersionLock {
+ public:
+  VersionLock() : word_(0) {}
+
+  void lock() {
+    uint64_t word = word_.load(std::memory_order_relaxed);
+    while (true) {
+      if ((word & (WRITER | READERS)) == 0) {
+        if (word_.compare_exchange_weak(word, (word | WRITER) & ~WAITER,
+                                        std::memory_order_acquire))
+          return;
+        continue;
+      }
+      if ((word & WAITER) == 0)
+        word_.fetch_or(WAITER, std::memory_order_relaxed);
+      _mm_pause();
+      word = word_.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock() {
+    // clear writer bit and increase version
+    word_.fetch_add(VERSION - WRITER, std::memory_order_release);
+  }
+
+  void lock_shared() {
+    uint64_t word = word_.load(std::memory_order_relaxed);
+    while (true) {
+      if ((word & (WRITER | WAITER)) == 0 &&
+          word_.compare_exchange_weak(word, word + READER, std::memory_order_acquire))
+        return;
+      _mm_pause();
+      word = word_.load(std::memory_order_relaxed);
+    }
+  }
+
+  void unlock_shared() {
+    word_.fetch_sub(READER, std::memory_order_release);
+  }
+
+  // wait until no writer, return version to validate against
+  uint64_t ReadBegin() const {
+    uint64_t word = word_.load(std::memory_order_acquire);
+    while (word & WRITER) {
+      _mm_pause();
+      word = word_.load(std::memory_order_acquire);
+    }
+    return word & ~(READERS | WAITER);
+  }
+
+  // true if no writer has locked since ReadBegin()
+  bool ReadValidate(uint64_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return (word_.load(std::memory_order_relaxed) & ~(READERS | WAITER)) == version;
+  }
+
+ private:
+  static constexpr uint64_t WRITER  = 1UL;
+  static constexpr uint64_t WAITER  = 1UL << 1;
+  static constexpr uint64_t READER  = 1UL << 2;
+  static constexpr uint64_t READERS = ((1UL << 16) - 1) & ~(WRITER | WAITER);
+  static constexpr uint64_t VERSION = 1UL << 16;
+
+  std::atomic<uint64_t> word_;
+};
+
+static_assert(sizeof(VersionLock) == 8, "sizeof(VersionLock) != 8");
+
+} // namespace combotree
@@ -0,0 +1,108 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include "combotree_config.h"
+#include "alevel.h"
+#include "blevel.h"
+
+size_t TEST_SIZE = 10000000;
+size_t GET_SIZE  = 1000000;
+
+namespace combotree {
+
+// search window of ALevel and Get throughput on different key distributions
+class Test {
+ public:
+  static void Run(const std::string& name, std::vector<uint64_t>& key) {
+    std::sort(key.begin(), key.end());
+    key.erase(std::unique(key.begin(), key.end()), key.end());
+
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    for (auto k : key)
+      kv.emplace_back(k, k);
+    BLevel* blevel = new BLevel(kv.size());
+    blevel->Expansion(kv);
+    ALevel* alevel = new ALevel(blevel);
+
+    std::mt19937_64 rng(0);
+    std::vector<uint64_t> target;
+    for (size_t i = 0; i < GET_SIZE; ++i)
+      target.push_back(key[rng() % key.size()]);
+
+    uint64_t total_width = 0;
+    uint64_t max_width = 0;
+    for (auto k : target) {
+      uint64_t begin, end;
+      alevel->BLevelRange(k, begin, end);
+      total_width += end - begin + 1;
+      max_width = std::max(max_width, end - begin + 1);
+    }
+
+    Timer timer;
+    timer.Start();
+    uint64_t value;
+    for (auto k : target) {
+      if (!alevel->Get(k, value) || value != k) {
+        std::cout << "get error!" << std::endl;
+        abort();
+      }
+    }
+    uint64_t total_time = timer.End();
+
+    std::cout << std::setw(10) << name
+              << " keys: " << key.size()
+              << " entries: " << blevel->Entries()
+              << " alevel usage: " << alevel->Usage()
+              << " avg window: " << (double)total_width / target.size()
+              << " max window: " << max_width
+              << " get: " << (double)target.size() / total_time * 1000000.0
+              << std::endl;
+
+    delete alevel;
+    delete blevel;
+  }
+};
+
+} // namespace combotree
+
+int main(int argc, char** argv) {
+  if (argc >= 2)
+    TEST_SIZE = atol(argv[1]);
+
+#ifdef LEARNED_ALEVEL
+  std::cout << "LEARNED_ALEVEL = 1, ALEVEL_MAX_ERROR: " << ALEVEL_MAX_ERROR << std::endl;
+#else
+  std::cout << "DEFAULT_SPAN: " << DEFAULT_SPAN << std::endl;
+#endif
+  std::cout << std::fixed << std::setprecision(2);
+
+  std::mt19937_64 rng(0);
+  std::vector<uint64_t> key;
+
+  // uniform
+  for (size_t i = 0; i < TEST_SIZE; ++i)
+    key.push_back(rng() >> 1);
+  combotree::Test::Run("uniform", key);
+
+  // lognormal
+  key.clear();
+  std::lognormal_distribution<double> lognormal(0.0, 2.0);
+  for (size_t i = 0; i < TEST_SIZE; ++i)
+    key.push_back((uint64_t)(lognormal(rng) * 1e9));
+  combotree::Test::Run("lognormal", key);
+
+  // clustered: dense keys around a few random centers
+  key.clear();
+  std::vector<uint64_t> centers;
+  for (int i = 0; i < 100; ++i)
+    centers.push_back(rng() >> 2);
+  std::normal_distribution<double> cluster(0.0, 1e6);
+  for (size_t i = 0; i < TEST_SIZE; ++i)
+    key.push_back(centers[rng() % centers.size()] + (int64_t)cluster(rng));
+  combotree::Test::Run("clustered", key);
+
+  return 0;
+}
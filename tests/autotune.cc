@@ -0,0 +1,129 @@
+#undef NDEBUG
+
+#include <iostream>
+#include <cassert>
+#include <iomanip>
+#include <vector>
+#include <functional>
+#include "combotree/combotree.h"
+#include "combotree_config.h"
+#include "random.h"
+#include "timer.h"
+
+// sweep ComboTree::Options one knob at a time, keep the best value of
+// each knob and go on with the next one.
+
+#define TEST_SIZE       2000000
+#define GET_SIZE        1000000
+
+using combotree::ComboTree;
+using combotree::Random;
+using combotree::Timer;
+
+struct Result {
+  double put_mops;
+  double get_mops;
+  double bytes_per_pair;
+  double time;  // seconds of put and get, smaller is better
+};
+
+Result RunOnce(const ComboTree::Options& options, const std::vector<uint64_t>& key) {
+#ifdef SERVER
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true, options);
+#else
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true, options);
+#endif
+  size_t get_size = std::min<size_t>(GET_SIZE, key.size());
+  uint64_t value;
+  Timer timer;
+
+  timer.Record("start");
+  for (size_t i = 0; i < key.size(); ++i)
+    assert(tree->Put(key[i], key[i]) == true);
+  timer.Record("put");
+  for (size_t i = 0; i < get_size; ++i) {
+    assert(tree->Get(key[i], value) == true);
+    assert(value == key[i]);
+  }
+  timer.Record("get");
+
+  Result res;
+  uint64_t put_time = timer.Microsecond("put", "start");
+  uint64_t get_time = timer.Microsecond("get", "put");
+  res.put_mops = (double)key.size() / put_time;
+  res.get_mops = (double)get_size / get_time;
+  res.bytes_per_pair = (double)tree->Usage() / tree->Size();
+  res.time = (put_time + get_time) / 1000000.0;
+  delete tree;
+  return res;
+}
+
+void PrintOptions(const ComboTree::Options& o) {
+  std::cout << "expand_buf_key=" << o.expand_buf_key
+            << " expansion_factor=" << o.expansion_factor
+            << " pmemkv_threshold=" << o.pmemkv_threshold
+            << " entry_size_factor=" << o.entry_size_factor
+            << " span=" << o.span;
+}
+
+int main(int argc, char** argv) {
+  size_t test_size = TEST_SIZE;
+  if (argc == 2)
+    test_size = atol(argv[1]);
+
+  std::vector<uint64_t> key;
+  Random rnd(0, test_size-1);
+  for (size_t i = 0; i < test_size; ++i)
+    key.push_back(i);
+  for (size_t i = 0; i < test_size; ++i)
+    std::swap(key[i], key[rnd.Next()]);
+
+  struct Knob {
+    const char* name;
+    std::vector<double> candidates;
+    std::function<void(ComboTree::Options&, double)> set;
+  };
+
+  std::vector<Knob> knobs = {
+    {"expand_buf_key",    {4, 6, 8, 10, 12},
+      [](ComboTree::Options& o, double v) { o.expand_buf_key = v; }},
+    {"expansion_factor",  {2, 4, 8},
+      [](ComboTree::Options& o, double v) { o.expansion_factor = v; }},
+    {"entry_size_factor", {1.0, 1.2, 1.5},
+      [](ComboTree::Options& o, double v) { o.entry_size_factor = v; }},
+#ifndef LEARNED_ALEVEL
+    {"span",              {1, 2, 4, 8},
+      [](ComboTree::Options& o, double v) { o.span = v; }},
+#endif
+    {"pmemkv_threshold",  {1000, 3000, 10000},
+      [](ComboTree::Options& o, double v) { o.pmemkv_threshold = v; }},
+  };
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "TEST_SIZE: " << test_size << std::endl;
+
+  ComboTree::Options best;
+  double best_time = RunOnce(best, key).time;
+
+  for (auto& knob : knobs) {
+    for (double v : knob.candidates) {
+      ComboTree::Options options = best;
+      knob.set(options, v);
+      Result res = RunOnce(options, key);
+      std::cout << "tune " << knob.name << "=" << std::defaultfloat << v << std::fixed
+                << " put " << res.put_mops << " Mops"
+                << " get " << res.get_mops << " Mops"
+                << " bytes-per-pair " << res.bytes_per_pair
+                << " time " << res.time << "s" << std::endl;
+      if (res.time < best_time) {
+        best_time = res.time;
+        best = options;
+      }
+    }
+  }
+
+  std::cout << "best: ";
+  PrintOptions(best);
+  std::cout << " time " << best_time << "s" << std::endl;
+  return 0;
+}
@@ -9,6 +9,7 @@
 #include "combotree_config.h"
 #include "random.h"
 #include "timer.h"
+#include "histogram.h"
 
 #define TEST_SIZE       10000000
 #define LAST_EXPAND     600000
@@ -17,10 +18,12 @@
 
 bool use_data_file = true;
 int SCAN_SIZE = 100;
+int SERIES_MS = 0;    // latency time series window, 0 to disable
 
 using combotree::ComboTree;
 using combotree::Random;
 using combotree::Timer;
+using combotree::LatencyRecorder;
 
 // return human readable string of size
 std::string human_readable(double size) {
@@ -48,14 +51,17 @@ std::string human_readable(double size) {
 
 int main(int argc, char** argv) {
 #ifdef SERVER
-  ComboTree* tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
 #else
-  ComboTree* tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
 #endif
 
-  if (argc == 2) {
+  if (argc >= 2) {
     SCAN_SIZE = atoi(argv[1]);
   }
+  if (argc >= 3) {
+    SERIES_MS = atoi(argv[2]);
+  }
 
   std::cout << "TEST_SIZE:             " << TEST_SIZE << std::endl;
   std::cout << "LAST_EXPAND:           " << LAST_EXPAND << std::endl;
@@ -83,18 +89,28 @@ int main(int argc, char** argv) {
   Timer timer;
 
   // Put
+  LatencyRecorder load_lat(LatencyRecorder::Now(), SERIES_MS*1000);
   timer.Record("start");
-  for (size_t i = 0; i < LAST_EXPAND; ++i)
+  for (size_t i = 0; i < LAST_EXPAND; ++i) {
+    auto t = LatencyRecorder::Now();
     assert(tree->Put(key[i], key[i]) == true);
+    load_lat.Record(t, LatencyRecorder::Now());
+  }
   timer.Record("mid");
-  for (size_t i = LAST_EXPAND; i < TEST_SIZE; ++i)
+  LatencyRecorder put_lat(LatencyRecorder::Now(), SERIES_MS*1000);
+  for (size_t i = LAST_EXPAND; i < TEST_SIZE; ++i) {
+    auto t = LatencyRecorder::Now();
     assert(tree->Put(key[i], key[i]) == true);
+    put_lat.Record(t, LatencyRecorder::Now());
+  }
   timer.Record("stop");
 
   uint64_t total_time = timer.Microsecond("mid", "start");
   std::cout << "load: " << total_time/1000000.0 << " " << (double)TEST_SIZE/total_time*1000000.0 << std::endl;
   uint64_t mid_time = timer.Microsecond("stop", "mid");
   std::cout << "put:  " << mid_time/1000000.0 << " " << (double)(TEST_SIZE-LAST_EXPAND)/mid_time*1000000.0 << std::endl;
+  load_lat.Print("load");
+  put_lat.Print("put");
 
   std::cout << "clevel time:    " << tree->CLevelTime()/1000000.0 << std::endl;
 
@@ -106,29 +122,63 @@ int main(int argc, char** argv) {
   std::cout << "size:           " << tree->Size() << std::endl;
   std::cout << "usage:          " << human_readable(tree->Usage()) << std::endl;
   std::cout << "bytes-per-pair: " << (double)tree->Usage() / tree->Size() << std::endl;
+#ifdef STATISTICS
+  ComboTree::Stats stats = tree->GetStats();
+  std::cout << "flush:          " << stats.flush << std::endl;
+  std::cout << "fence:          " << stats.fence << std::endl;
+  std::cout << "flush clevel:   " << stats.flush_to_clevel << std::endl;
+  std::cout << "clevel split:   " << stats.clevel_split << std::endl;
+  std::cout << "alloc:          " << human_readable(stats.alloc_bytes) << std::endl;
+  std::cout << "expansion:      " << stats.expansion << " " << stats.expansion_time_us/1000000.0 << "s" << std::endl;
+  std::cout << "expand wait:    " << stats.expand_wait << std::endl;
+  std::cout << "put retry:      " << stats.put_retry << std::endl;
+#endif
   tree->BLevelCompression();
 
   // Get
+  LatencyRecorder get_lat(LatencyRecorder::Now(), SERIES_MS*1000);
   timer.Clear();
   timer.Record("start");
   for (int i = 0; i < GET_SIZE; ++i) {
     uint64_t target = key[i];
+    auto t = LatencyRecorder::Now();
     assert(tree->Get(target, value) == true);
+    get_lat.Record(t, LatencyRecorder::Now());
     assert(value == target);
   }
   timer.Record("stop");
   total_time = timer.Microsecond("stop", "start");
   std::cout << "get: " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
+  get_lat.Print("get");
 
   for (uint64_t i = TEST_SIZE; i < TEST_SIZE+10000; ++i) {
     assert(tree->Get(i, value) == false);
   }
 
+  // MultiGet
+  {
+    const int batch = 64;
+    uint64_t values[batch];
+    bool found[batch];
+    timer.Clear();
+    timer.Record("start");
+    for (int i = 0; i + batch <= GET_SIZE; i += batch) {
+      tree->MultiGet(&key[i], batch, values, found);
+      for (int j = 0; j < batch; ++j)
+        assert(found[j] && values[j] == key[i+j]);
+    }
+    timer.Record("stop");
+    total_time = timer.Microsecond("stop", "start");
+    std::cout << "multiget " << batch << ": " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
+  }
+
   // scan
+  LatencyRecorder scan_lat(LatencyRecorder::Now(), SERIES_MS*1000);
   timer.Clear();
   timer.Record("start");
   for (int i = 0; i < SCAN_TEST_SIZE; ++i) {
     uint64_t start_key = key[i];
+    auto t = LatencyRecorder::Now();
     ComboTree::Iter iter(tree, start_key);
     for (int j = 0; j < SCAN_SIZE; ++j) {
       assert(iter.key() == start_key + j);
@@ -136,10 +186,12 @@ int main(int argc, char** argv) {
       if (!iter.next())
         break;
     }
+    scan_lat.Record(t, LatencyRecorder::Now());
   }
   timer.Record("stop");
   total_time = timer.Microsecond("stop", "start");
   std::cout << "scan " << SCAN_SIZE << ": " << total_time/1000000.0 << " " << (double)SCAN_TEST_SIZE/(double)total_time*1000000.0 << std::endl;
+  scan_lat.Print("scan");
 
   // Delete
   // for (auto& k : key) {
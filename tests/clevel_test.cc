@@ -4,6 +4,8 @@
 #include <cstdlib>
 #include <cassert>
 #include <vector>
+#include <algorithm>
+#include <thread>
 #include "clevel.h"
 #include "random.h"
 
@@ -80,5 +82,121 @@ int main(void) {
     assert(value == i);
   }
 
+  for (uint64_t i = 0; i < TEST_SIZE / 2; ++i)
+    assert(clevel.Delete(&mem, i, nullptr) == false);
+
+  // merged leaves are reused
+  assert(mem.FreeNodes() > 0);
+  uint64_t usage = mem.Usage();
+  for (uint64_t i = 0; i < TEST_SIZE / 2; ++i)
+    assert(clevel.Put(&mem, i, i) == true);
+  assert(mem.Usage() < usage + usage / 2);
+
+  CLevel::Iter riter(&clevel, &mem, 0);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    assert(riter.key() == i);
+    assert(riter.value() == i);
+    riter.next();
+  }
+  assert(riter.end());
+
+  // batches of sorted keys, every other batch is put again as update
+  void* batch_addr = malloc(TEST_SIZE * 40);
+  CLevel::MemControl batch_mem(batch_addr, TEST_SIZE * 40);
+  CLevel batch_clevel;
+  batch_clevel.Setup(&batch_mem, 4);
+  for (int i = 0; i < TEST_SIZE; i += 11) {
+    int n = std::min(11, TEST_SIZE - i);
+    std::vector<uint64_t> batch(key.begin() + i, key.begin() + i + n);
+    std::sort(batch.begin(), batch.end());
+    std::vector<uint64_t> values(batch);
+    batch_clevel.PutBatch(&batch_mem, batch.data(), values.data(), n);
+    for (auto& v : values)
+      v += 1;
+    if (i % 2)
+      batch_clevel.PutBatch(&batch_mem, batch.data(), values.data(), n);
+  }
+  for (int i = 0; i < TEST_SIZE; ++i) {
+    uint64_t value;
+    assert(batch_clevel.Get(&batch_mem, key[i], value) == true);
+    assert(value == key[i] + (i / 11) % 2);
+  }
+  CLevel::Iter biter(&batch_clevel, &batch_mem, 0);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    assert(biter.key() == i);
+    biter.next();
+  }
+  assert(biter.end());
+
+  // Put fails without change when memory runs out
+  void* small_addr = malloc(64 * 1024);
+  CLevel::MemControl small_mem(small_addr, 64 * 1024);
+  CLevel small_clevel;
+  assert(small_clevel.Setup(&small_mem, 4));
+  int put = 0;
+  while (small_clevel.Put(&small_mem, key[put], key[put]))
+    put++;
+  assert(put > 0 && put < TEST_SIZE);
+  assert(small_mem.NoSpace());
+  assert(small_clevel.Size(&small_mem) == (size_t)put);
+  for (int i = 0; i <= put; ++i) {
+    uint64_t value;
+    assert(small_clevel.Get(&small_mem, key[i], value) == (i < put));
+  }
+  // updates need no new node
+  for (int i = 0; i < put; ++i)
+    assert(small_clevel.Update(&small_mem, key[i], key[i] + 1));
+
+#if CLEVEL_ARENA_SIZE > 0
+  // a thread keeps one chunk for each MemControl it allocates from
+  const int nr_mems = 5;
+  std::vector<void*> mem_addrs;
+  std::vector<CLevel::MemControl*> mems;
+  std::vector<CLevel> clevels(nr_mems);
+  for (int m = 0; m < nr_mems; ++m) {
+    mem_addrs.push_back(malloc(TEST_SIZE * 40));
+    mems.push_back(new CLevel::MemControl(mem_addrs[m], TEST_SIZE * 40));
+    assert(clevels[m].Setup(mems[m], 4));
+  }
+  for (int i = 0; i < 1000; ++i)
+    for (int m = 0; m < nr_mems; ++m)
+      assert(clevels[m].Put(mems[m], i, i));
+  for (int m = 0; m < nr_mems; ++m)
+    assert(mems[m]->Usage() <= CLEVEL_ARENA_SIZE);
+
+  // nodes left in the chunk of an exited thread are reused
+  void* thread_addr = malloc(TEST_SIZE * 40);
+  CLevel::MemControl thread_mem(thread_addr, TEST_SIZE * 40);
+  CLevel thread_clevel;
+  std::thread([&](){
+    assert(thread_clevel.Setup(&thread_mem, 4));
+    for (int i = 0; i < 200; ++i)
+      assert(thread_clevel.Put(&thread_mem, i, i));
+  }).join();
+  assert(thread_mem.FreeNodes() > 0);
+  uint64_t thread_usage = thread_mem.Usage();
+  for (int i = 200; i < 1000; ++i)
+    assert(thread_clevel.Put(&thread_mem, i, i));
+  assert(thread_mem.Usage() == thread_usage);
+  for (auto m : mems)
+    delete m;
+#endif
+
+#ifdef USE_LIBPMEM
+  // file grows when full
+  CLevel::MemControl file_mem(CLEVEL_PMEM_FILE, (size_t)1024*1024);
+  CLevel file_clevel;
+  file_clevel.Setup(&file_mem, 4);
+  for (int i = 0; i < TEST_SIZE; ++i)
+    assert(file_clevel.Put(&file_mem, i, i) == true);
+  assert(file_mem.Usage() > 1024*1024);
+  for (int i = 0; i < TEST_SIZE; ++i) {
+    uint64_t value;
+    assert(file_clevel.Get(&file_mem, i, value) == true);
+    assert(value == (uint64_t)i);
+  }
+  file_mem.RemoveFile();
+#endif
+
   return 0;
 }
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include <cassert>
 #include <iomanip>
 #include <map>
+#include <thread>
+#include <random>
+#include <algorithm>
 #include "combotree/combotree.h"
 #include "combotree_config.h"
 #include "random.h"
@@ -15,9 +18,9 @@ using combotree::Random;
 
 int main(void) {
 #ifdef SERVER
-  ComboTree* tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
 #else
-  ComboTree* tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
 #endif
 
 #ifdef NDEBUG
@@ -41,6 +44,18 @@ static_assert(0, "NDEBUG!");
     tree->Put(key, value);
   }
 
+  // Stats
+  {
+    ComboTree::Stats stats = tree->GetStats();
+#ifdef STATISTICS
+    assert(stats.flush > 0 && stats.fence > 0);
+    assert(stats.flush_to_clevel > 0 && stats.alloc_bytes > 0);
+    assert(stats.expansion > 0);
+#else
+    assert(stats.flush == 0 && stats.expansion == 0);
+#endif
+  }
+
   uint64_t value;
 
   // Get
@@ -92,6 +107,83 @@ static_assert(0, "NDEBUG!");
     }
   }
 
+  // Scan
+  {
+    combotree::Pair* results = new combotree::Pair[1000];
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t start_key = rnd.Next();
+      size_t max_size = rnd.Next() % 1000 + 1;
+      size_t cnt = tree->Scan(start_key, UINT64_MAX, max_size, results);
+      auto right_iter = right_kv.lower_bound(start_key);
+      for (size_t j = 0; j < cnt; ++j) {
+        assert(right_iter != right_kv.end());
+        assert(right_iter->first == results[j].key);
+        assert(right_iter->second == results[j].value);
+        right_iter++;
+      }
+      assert(cnt == max_size || right_iter == right_kv.end());
+    }
+    delete[] results;
+
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t start_key = rnd.Next();
+      uint64_t end_key = start_key + rnd.Next() % (UINT64_MAX / TEST_SIZE * 100);
+      if (end_key < start_key)
+        end_key = UINT64_MAX;
+      kv.clear();
+      size_t cnt = tree->Scan(start_key, end_key, SIZE_MAX, kv);
+      assert(cnt == kv.size());
+      auto right_iter = right_kv.lower_bound(start_key);
+      for (auto& pair : kv) {
+        assert(right_iter->first == pair.first);
+        assert(right_iter->second == pair.second);
+        right_iter++;
+      }
+      assert(right_iter == right_kv.end() || right_iter->first > end_key);
+    }
+  }
+
+  // MultiGet and MultiPut
+  {
+    const size_t batch = 100;
+    uint64_t keys[batch], values[batch];
+    bool found[batch];
+    for (int i = 0; i < 1000; ++i) {
+      auto right_iter = right_kv.lower_bound(rnd.Next());
+      for (size_t j = 0; j < batch; ++j) {
+        // mix existing and absent keys
+        if (j % 4 == 0 || right_iter == right_kv.end()) {
+          keys[j] = rnd.Next();
+        } else {
+          keys[j] = right_iter->first;
+          right_iter++;
+        }
+      }
+      tree->MultiGet(keys, batch, values, found);
+      for (size_t j = 0; j < batch; ++j) {
+        assert(found[j] == (right_kv.count(keys[j]) == 1));
+        if (found[j])
+          assert(values[j] == right_kv[keys[j]]);
+      }
+    }
+
+    for (int i = 0; i < 1000; ++i) {
+      for (size_t j = 0; j < batch; ++j) {
+        keys[j] = rnd.Next();
+        while (right_kv.count(keys[j]))
+          keys[j] = rnd.Next();
+        values[j] = rnd.Next();
+        right_kv[keys[j]] = values[j];
+      }
+      tree->MultiPut(keys, values, batch);
+    }
+    for (auto& kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+    }
+  }
+
   // NoSort Scan
   {
     ComboTree::NoSortIter no_sort_iter(tree, 100);
@@ -110,5 +202,130 @@ static_assert(0, "NDEBUG!");
     }
   }
 
+  // BulkLoad
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
+#endif
+    std::vector<combotree::Pair> sorted;
+    for (auto& kv : right_kv)
+      sorted.push_back({kv.first, kv.second});
+    std::vector<combotree::Pair> unsorted(sorted.rbegin(), sorted.rend());
+    assert(tree->BulkLoad(unsorted.data(), unsorted.size()) == false);
+    assert(tree->BulkLoad(sorted.begin(), sorted.end()) == true);
+    assert(tree->Size() == right_kv.size());
+    // not empty any more
+    assert(tree->BulkLoad(sorted.data(), sorted.size()) == false);
+
+    for (auto& kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+    }
+    ComboTree::Iter iter(tree);
+    for (auto& kv : right_kv) {
+      assert(!iter.end());
+      assert(iter.key() == kv.first && iter.value() == kv.second);
+      iter.next();
+    }
+    assert(iter.end());
+
+    // put after bulk load
+    for (int i = 0; i < 100000; ++i) {
+      uint64_t key = rnd.Next();
+      if (right_kv.count(key))
+        continue;
+      right_kv.emplace(key, key);
+      assert(tree->Put(key, key) == true);
+    }
+    for (auto& kv : right_kv) {
+      assert(tree->Get(kv.first, value) == true);
+      assert(value == kv.second);
+    }
+  }
+
+  // BulkLoad racing with writers either loads or leaves the tree writable
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
+#endif
+    std::vector<combotree::Pair> sorted;
+    std::vector<uint64_t> written;
+    for (auto& kv : right_kv) {
+      if (written.size() < 1000 && kv.first % 2)
+        written.push_back(kv.first);
+      else
+        sorted.push_back({kv.first, kv.second});
+    }
+    std::thread writer([&](){
+      for (auto k : written)
+        assert(tree->Put(k, k) == true);
+    });
+    bool loaded = tree->BulkLoad(sorted.data(), sorted.size());
+    writer.join();
+    for (auto k : written) {
+      assert(tree->Get(k, value) == true);
+      assert(value == k);
+    }
+    assert(tree->Size() == written.size() + (loaded ? sorted.size() : 0));
+    uint64_t new_key = 0;
+    while (right_kv.count(new_key))
+      new_key++;
+    assert(tree->Put(new_key, 1) == true);
+  }
+
+  // writes and deletes racing with migration from pmemkv are kept
+  {
+    delete tree;
+#ifdef SERVER
+    tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
+#else
+    tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
+#endif
+    const int threads = 4;
+    const size_t per_thread = 50000;
+    std::vector<uint64_t> keys;
+    for (auto& kv : right_kv) {
+      if (keys.size() == PMEMKV_THRESHOLD - 100 + threads * per_thread)
+        break;
+      keys.push_back(kv.first);
+    }
+    // random order, sorted inserts are too skewed for expansion
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(0));
+    for (size_t i = 0; i < PMEMKV_THRESHOLD - 100; ++i)
+      assert(tree->Put(keys[i], keys[i]) == true);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+      writers.emplace_back([&, t](){
+        // interleaved, so every thread writes during migration
+        for (size_t i = PMEMKV_THRESHOLD - 100 + t; i < keys.size(); i += threads) {
+          assert(tree->Put(keys[i], keys[i]) == true);
+          if (i % 3 == 0)
+            assert(tree->Delete(keys[i]) == true);
+          else if (i % 3 == 1)
+            assert(tree->Update(keys[i], keys[i] + 1) == true);
+        }
+      });
+    }
+    for (auto& w : writers)
+      w.join();
+    while (tree->IsExpanding()) ;
+    size_t expect = PMEMKV_THRESHOLD - 100;
+    for (size_t i = PMEMKV_THRESHOLD - 100; i < keys.size(); ++i) {
+      bool found = tree->Get(keys[i], value);
+      assert(found == (i % 3 != 0));
+      if (found) {
+        assert(value == keys[i] + (i % 3 == 1));
+        expect++;
+      }
+    }
+    assert(tree->Size() == expect);
+  }
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+namespace combotree {
+
+// HDR-style latency histogram in nanoseconds. values are bucketed by
+// power of two, each power of two is split into SUB_BUCKETS linear
+// sub-buckets, so relative error is below 1/SUB_BUCKETS. a histogram is
+// owned by one thread and merged at phase end, recording needs no lock.
+class Histogram {
+ public:
+  static constexpr int SUB_BITS = 5;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr int MAGNITUDES = 64 - SUB_BITS;
+
+  Histogram() { Clear(); }
+
+  void Clear() {
+    std::fill(count_, count_ + MAGNITUDES * SUB_BUCKETS, 0);
+    total_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+  void Record(uint64_t ns) {
+    count_[Index_(ns)]++;
+    total_++;
+    sum_ += ns;
+    max_ = std::max(max_, ns);
+  }
+
+  void Merge(const Histogram& other) {
+    for (int i = 0; i < MAGNITUDES * SUB_BUCKETS; ++i)
+      count_[i] += other.count_[i];
+    total_ += other.total_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  // p in [0, 100], upper bound of the bucket holding the p-th value
+  uint64_t Percentile(double p) const {
+    if (total_ == 0)
+      return 0;
+    uint64_t target = std::max<uint64_t>(1, (uint64_t)(total_ * p / 100.0 + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < MAGNITUDES * SUB_BUCKETS; ++i) {
+      seen += count_[i];
+      if (seen >= target)
+        return std::min(UpperBound_(i), max_);
+    }
+    return max_;
+  }
+
+  uint64_t Count() const { return total_; }
+  uint64_t Max() const { return max_; }
+  double Mean() const { return total_ ? (double)sum_ / total_ : 0; }
+
+ private:
+  uint64_t count_[MAGNITUDES * SUB_BUCKETS];
+  uint64_t total_;
+  uint64_t sum_;
+  uint64_t max_;
+
+  // values below SUB_BUCKETS go to magnitude 0 one by one
+  static int Index_(uint64_t v) {
+    if (v < SUB_BUCKETS)
+      return v;
+    int msb = 63 - __builtin_clzll(v);
+    int magnitude = msb - SUB_BITS + 1;
+    int sub = (v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return magnitude * SUB_BUCKETS + sub;
+  }
+
+  static uint64_t UpperBound_(int idx) {
+    int magnitude = idx / SUB_BUCKETS;
+    uint64_t sub = idx % SUB_BUCKETS;
+    if (magnitude == 0)
+      return sub;
+    int shift = magnitude - 1;
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+  }
+};
+
+// per thread latency recorder of one operation type, optionally keeps a
+// time series of ops and max latency per window to show stalls.
+class LatencyRecorder {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Window {
+    uint64_t ops = 0;
+    uint64_t max = 0;
+  };
+
+  // window_us == 0 disables time series
+  explicit LatencyRecorder(Clock::time_point begin = Clock::now(), uint64_t window_us = 0)
+    : begin_(begin), window_ns_(window_us * 1000) {}
+
+  static Clock::time_point Now() { return Clock::now(); }
+
+  void Record(Clock::time_point start, Clock::time_point stop) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    hist_.Record(ns);
+    if (window_ns_) {
+      size_t w = std::chrono::duration_cast<std::chrono::nanoseconds>(start - begin_).count() / window_ns_;
+      if (w >= series_.size())
+        series_.resize(w + 1);
+      series_[w].ops++;
+      series_[w].max = std::max(series_[w].max, ns);
+    }
+  }
+
+  void Merge(const LatencyRecorder& other) {
+    hist_.Merge(other.hist_);
+    if (other.series_.size() > series_.size())
+      series_.resize(other.series_.size());
+    for (size_t i = 0; i < other.series_.size(); ++i) {
+      series_[i].ops += other.series_[i].ops;
+      series_[i].max = std::max(series_[i].max, other.series_[i].max);
+    }
+  }
+
+  const Histogram& Hist() const { return hist_; }
+
+  void Print(const std::string& name) const {
+    if (hist_.Count() == 0)
+      return;
+    std::cout << std::fixed << std::setprecision(2)
+              << name << " latency(us):"
+              << " avg " << hist_.Mean() / 1000.0
+              << " p50 " << hist_.Percentile(50) / 1000.0
+              << " p90 " << hist_.Percentile(90) / 1000.0
+              << " p99 " << hist_.Percentile(99) / 1000.0
+              << " p99.9 " << hist_.Percentile(99.9) / 1000.0
+              << " max " << hist_.Max() / 1000.0 << std::endl;
+    for (size_t i = 0; i < series_.size(); ++i)
+      std::cout << name << " series: " << i * window_ns_ / 1000000.0 << "ms"
+                << " ops " << series_[i].ops
+                << " max " << series_[i].max / 1000.0 << "us" << std::endl;
+  }
+
+ private:
+  Histogram hist_;
+  Clock::time_point begin_;
+  uint64_t window_ns_;
+  std::vector<Window> series_;
+};
+
+} // namespace combotree
@@ -1,9 +1,57 @@
+#undef NDEBUG
+
+#include <iostream>
+#include <cassert>
 #include "../src/kvbuffer.h"
+#include "random.h"
 
 using namespace combotree;
+using combotree::Random;
+
+int main(void) {
+  Random rnd(0, UINT64_MAX - 1);
+
+  for (int suffix_bytes = 1; suffix_bytes <= 8; ++suffix_bytes) {
+    for (int round = 0; round < 10000; ++round) {
+      KVBuffer<112,8> buf;
+      buf.prefix_bytes = 8 - suffix_bytes;
+      buf.suffix_bytes = suffix_bytes;
+      buf.entries = 0;
+      buf.max_entries = buf.MaxEntries();
+      memset(buf.buf, 0, sizeof(buf.buf));
+
+      uint64_t mask = suffix_bytes == 8 ? UINT64_MAX : (1UL << (8*suffix_bytes)) - 1;
+      uint64_t keys[16];
+      int entries = rnd.Next() % (buf.max_entries + 1);
+      for (int i = 0; i < entries; ++i) {
+        // small key space to get duplicate keys and partially matched bytes
+        keys[i] = (round & 1) ? (rnd.Next() & mask) : (rnd.Next() % 4) * 0x0101010101010101UL & mask;
+        buf.Put(buf.entries, keys[i], i);
+      }
+
+      for (int i = 0; i < 32; ++i) {
+        uint64_t target = (i < entries) ? keys[i] : (rnd.Next() % 4) * 0x0101010101010101UL;
+        int expect = -1;
+        for (int j = entries - 1; j >= 0; --j) {
+          if (keys[j] == (target & mask)) {
+            expect = j;
+            break;
+          }
+        }
+        bool find;
+        int pos = buf.Find(target, find);
+        if (expect == -1) {
+          assert(!find);
+          assert(pos == entries);
+        } else {
+          assert(find);
+          assert(pos == expect);
+          assert(buf.value(pos) == (uint64_t)expect);
+        }
+      }
+    }
+  }
 
-int test(void) {
-  KVBuffer<112,6> buf;
-  volatile int a = buf.value(0);
+  std::cout << "kvbuffer test passed" << std::endl;
   return 0;
-}
\ No newline at end of file
+}
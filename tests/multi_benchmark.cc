@@ -2,6 +2,7 @@
 #include <fstream>
 #include <cassert>
 #include <iomanip>
+#include <algorithm>
 #include <sstream>
 #include <thread>
 #include <getopt.h>
@@ -10,6 +11,7 @@
 #include "combotree_config.h"
 #include "random.h"
 #include "timer.h"
+#include "histogram.h"
 
 size_t LOAD_SIZE   = 10000000;
 size_t PUT_SIZE    = 6000000;
@@ -19,12 +21,29 @@ size_t SCAN_TEST_SIZE = 500000000;
 
 int thread_num        = 4;
 bool use_data_file    = false;
+bool bulk_load        = false;
+int series_ms         = 0;
 std::vector<size_t> scan_size;
 std::vector<size_t> sort_scan_size;
+std::vector<size_t> range_scan_size;
 
 using combotree::ComboTree;
 using combotree::Random;
 using combotree::Timer;
+using combotree::LatencyRecorder;
+
+// per thread latency recorders of one phase
+std::vector<LatencyRecorder> new_latency() {
+  return std::vector<LatencyRecorder>(thread_num,
+      LatencyRecorder(LatencyRecorder::Now(), series_ms*1000));
+}
+
+// merge per thread recorders and print
+void print_latency(const std::string& name, std::vector<LatencyRecorder>& lat) {
+  for (size_t i = 1; i < lat.size(); ++i)
+    lat[0].Merge(lat[i]);
+  lat[0].Print(name);
+}
 
 // return human readable string of size
 std::string human_readable(double size) {
@@ -63,7 +82,10 @@ void show_help(char* prog) {
     "    --scan-test-size         SCAN_TEST_SIZE" << std::endl <<
     "    --scan[-s]               add scan" << std::endl <<
     "    --sort-scan              add sort scan" << std::endl <<
+    "    --range-scan             add range scan (ComboTree::Scan)" << std::endl <<
     "    --use-data-file[-d]      use data file" << std::endl <<
+    "    --latency-series         latency time series window in ms" << std::endl <<
+    "    --bulk-load              load with ComboTree::BulkLoad" << std::endl <<
     "    --help[-h]               show help" << std::endl;
 }
 
@@ -78,8 +100,11 @@ int main(int argc, char** argv) {
     {"scan-test-size",  required_argument, NULL, 0},
     {"scan",            required_argument, NULL, 's'},
     {"sort-scan",       required_argument, NULL, 0},
+    {"range-scan",      required_argument, NULL, 0},
     {"use-data-file",   no_argument,       NULL, 'd'},
     {"help",            no_argument,       NULL, 'h'},
+    {"latency-series",  required_argument, NULL, 0},
+    {"bulk-load",       no_argument,       NULL, 0},
     {NULL, 0, NULL, 0}
   };
 
@@ -97,8 +122,11 @@ int main(int argc, char** argv) {
           case 5: SCAN_TEST_SIZE = atoi(optarg); break;
           case 6: scan_size.push_back(atoi(optarg)); break;
           case 7: sort_scan_size.push_back(atoi(optarg)); break;
-          case 8: use_data_file = true; break;
-          case 9: show_help(argv[0]); return 0;
+          case 8: range_scan_size.push_back(atoi(optarg)); break;
+          case 9: use_data_file = true; break;
+          case 10: show_help(argv[0]); return 0;
+          case 11: series_ms = atoi(optarg); break;
+          case 12: bulk_load = true; break;
           default: std::cerr << "Parse Argument Error!" << std::endl; abort();
         }
         break;
@@ -130,6 +158,8 @@ int main(int argc, char** argv) {
     std::cout << "SCAN:                  " << sz << std::endl;
   for (auto &sz : sort_scan_size)
     std::cout << "SORT_SCAN:             " << sz << std::endl;
+  for (auto &sz : range_scan_size)
+    std::cout << "RANGE_SCAN:            " << sz << std::endl;
   std::cout << std::endl;
 
   std::vector<uint64_t> key;
@@ -155,9 +185,9 @@ int main(int argc, char** argv) {
   }
 
 #ifdef SERVER
-  ComboTree* tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
 #else
-  ComboTree* tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
 #endif
 
   Timer timer;
@@ -175,38 +205,58 @@ int main(int argc, char** argv) {
   }
 
   // Load
+  auto lat = new_latency();
   per_thread_size = LOAD_SIZE / thread_num;
-  timer.Record("start");
-  for (int i = 0; i < thread_num; ++i) {
-    threads.emplace_back([=,&key](){
-      size_t start_pos = i*per_thread_size;
-      size_t size = (i == thread_num-1) ? LOAD_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
-      for (size_t j = 0; j < size; ++j) {
-        bool ret = tree->Put(key[start_pos+j], key[start_pos+j]);
-        if (ret != true) {
-          std::cout << "load error!" << std::endl;
-          assert(0);
+  if (bulk_load) {
+    std::vector<combotree::Pair> sorted;
+    for (size_t i = 0; i < LOAD_SIZE; ++i)
+      sorted.push_back({key[i], key[i]});
+    std::sort(sorted.begin(), sorted.end(),
+              [](const combotree::Pair& a, const combotree::Pair& b) { return a.key < b.key; });
+    timer.Record("start");
+    if (tree->BulkLoad(sorted.data(), sorted.size()) != true) {
+      std::cout << "bulk load error!" << std::endl;
+      assert(0);
+    }
+  } else {
+    timer.Record("start");
+    for (int i = 0; i < thread_num; ++i) {
+      threads.emplace_back([=,&key,&lat](){
+        size_t start_pos = i*per_thread_size;
+        size_t size = (i == thread_num-1) ? LOAD_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
+        for (size_t j = 0; j < size; ++j) {
+          auto t = LatencyRecorder::Now();
+          bool ret = tree->Put(key[start_pos+j], key[start_pos+j]);
+          lat[i].Record(t, LatencyRecorder::Now());
+          if (ret != true) {
+            std::cout << "load error!" << std::endl;
+            assert(0);
+          }
         }
-      }
-    });
+      });
+    }
+    for (auto& t : threads)
+      t.join();
   }
-  for (auto& t : threads)
-    t.join();
   timer.Record("stop");
   threads.clear();
   uint64_t total_time = timer.Microsecond("stop", "start");
   std::cout << "load: " << total_time/1000000.0 << " " << (double)LOAD_SIZE/(double)total_time*1000000.0 << std::endl;
+  print_latency("load", lat);
 
   // Put
+  lat = new_latency();
   per_thread_size = PUT_SIZE / thread_num;
   timer.Clear();
   timer.Record("start");
   for (int i = 0; i < thread_num; ++i) {
-    threads.emplace_back([=,&key](){
+    threads.emplace_back([=,&key,&lat](){
       size_t start_pos = i*per_thread_size+LOAD_SIZE;
       size_t size = (i == thread_num-1) ? PUT_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
       for (size_t j = 0; j < size; ++j) {
+        auto t = LatencyRecorder::Now();
         bool ret = tree->Put(key[start_pos+j], key[start_pos+j]);
+        lat[i].Record(t, LatencyRecorder::Now());
         if (ret != true) {
           std::cout << "put error!" << std::endl;
           assert(0);
@@ -220,6 +270,7 @@ int main(int argc, char** argv) {
   threads.clear();
   total_time = timer.Microsecond("stop", "start");
   std::cout << "put:  " << total_time/1000000.0 << " " << (double)PUT_SIZE/(double)total_time*1000000.0 << std::endl;
+  print_latency("put", lat);
 
   // statistic
   std::cout << "clevel time:    " << tree->CLevelTime()/1000000.0 << std::endl;
@@ -229,6 +280,17 @@ int main(int argc, char** argv) {
   std::cout << "size:           " << tree->Size() << std::endl;
   std::cout << "usage:          " << human_readable(tree->Usage()) << std::endl;
   std::cout << "bytes-per-pair: " << (double)tree->Usage() / tree->Size() << std::endl;
+#ifdef STATISTICS
+  ComboTree::Stats stats = tree->GetStats();
+  std::cout << "flush:          " << stats.flush << std::endl;
+  std::cout << "fence:          " << stats.fence << std::endl;
+  std::cout << "flush clevel:   " << stats.flush_to_clevel << std::endl;
+  std::cout << "clevel split:   " << stats.clevel_split << std::endl;
+  std::cout << "alloc:          " << human_readable(stats.alloc_bytes) << std::endl;
+  std::cout << "expansion:      " << stats.expansion << " " << stats.expansion_time_us/1000000.0 << "s" << std::endl;
+  std::cout << "expand wait:    " << stats.expand_wait << std::endl;
+  std::cout << "put retry:      " << stats.put_retry << std::endl;
+#endif
   tree->BLevelCompression();
 
   sprintf(cmd_buf, "pmap %d > ./usage_after.txt", pid);
@@ -241,16 +303,19 @@ int main(int argc, char** argv) {
   Random get_rnd(0, GET_SIZE-1);
   for (size_t i = 0; i < GET_SIZE; ++i)
     std::swap(key[i],key[get_rnd.Next()]);
+  lat = new_latency();
   per_thread_size = GET_SIZE / thread_num;
   timer.Clear();
   timer.Record("start");
   for (int i = 0; i < thread_num; ++i) {
-    threads.emplace_back([=,&key](){
+    threads.emplace_back([=,&key,&lat](){
       size_t start_pos = i*per_thread_size;
       size_t size = (i == thread_num-1) ? GET_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
       size_t value;
       for (size_t j = 0; j < size; ++j) {
+        auto t = LatencyRecorder::Now();
         bool ret = tree->Get(key[start_pos+j], value);
+        lat[i].Record(t, LatencyRecorder::Now());
         if (ret != true) {
           std::cout << "get error!" << std::endl;
           assert(0);
@@ -264,19 +329,22 @@ int main(int argc, char** argv) {
   threads.clear();
   total_time = timer.Microsecond("stop", "start");
   std::cout << "get: " << total_time/1000000.0 << " " << (double)GET_SIZE/(double)total_time*1000000.0 << std::endl;
+  print_latency("get", lat);
 
   // scan
   for (auto scan : scan_size) {
     size_t total_size = std::min(SCAN_TEST_SIZE / scan, LOAD_SIZE+PUT_SIZE);
+    lat = new_latency();
     per_thread_size = total_size / thread_num;
     timer.Clear();
     timer.Record("start");
     for (int i = 0; i < thread_num; ++i) {
-      threads.emplace_back([=,&key](){
+      threads.emplace_back([=,&key,&lat](){
         size_t start_pos = i*per_thread_size;
         size_t size = (i == thread_num-1) ? total_size-(thread_num-1)*per_thread_size : per_thread_size;
         for (size_t j = 0; j < size; ++j) {
           uint64_t start_key = key[start_pos+j];
+          auto t = LatencyRecorder::Now();
           ComboTree::NoSortIter iter(tree, start_key);
           if (iter.end())
             continue;
@@ -288,6 +356,7 @@ int main(int argc, char** argv) {
             if (!iter.next())
               break;
           }
+          lat[i].Record(t, LatencyRecorder::Now());
         }
       });
     }
@@ -297,20 +366,23 @@ int main(int argc, char** argv) {
     threads.clear();
     total_time = timer.Microsecond("stop", "start");
     std::cout << "scan " << scan << ": " << total_time/1000000.0 << " " << (double)total_size/(double)total_time*1000000.0 << std::endl;
+    print_latency("scan " + std::to_string(scan), lat);
   }
 
   // sort_scan
   for (auto scan : sort_scan_size) {
     size_t total_size = std::min(SCAN_TEST_SIZE / scan, LOAD_SIZE+PUT_SIZE);
+    lat = new_latency();
     per_thread_size = total_size / thread_num;
     timer.Clear();
     timer.Record("start");
     for (int i = 0; i < thread_num; ++i) {
-      threads.emplace_back([=,&key](){
+      threads.emplace_back([=,&key,&lat](){
         size_t start_pos = i*per_thread_size;
         size_t size = (i == thread_num-1) ? total_size-(thread_num-1)*per_thread_size : per_thread_size;
         for (size_t j = 0; j < size; ++j) {
           uint64_t start_key = key[start_pos+j];
+          auto t = LatencyRecorder::Now();
           ComboTree::Iter iter(tree, start_key);
           if (iter.end())
             continue;
@@ -326,6 +398,7 @@ int main(int argc, char** argv) {
             if (!iter.next())
               break;
           }
+          lat[i].Record(t, LatencyRecorder::Now());
         }
       });
     }
@@ -335,21 +408,62 @@ int main(int argc, char** argv) {
     threads.clear();
     total_time = timer.Microsecond("stop", "start");
     std::cout << "sort scan " << scan << ": " << total_time/1000000.0 << " " << (double)total_size/(double)total_time*1000000.0 << std::endl;
+    print_latency("sort scan " + std::to_string(scan), lat);
+  }
+
+  // range_scan
+  for (auto scan : range_scan_size) {
+    size_t total_size = std::min(SCAN_TEST_SIZE / scan, LOAD_SIZE+PUT_SIZE);
+    lat = new_latency();
+    per_thread_size = total_size / thread_num;
+    timer.Clear();
+    timer.Record("start");
+    for (int i = 0; i < thread_num; ++i) {
+      threads.emplace_back([=,&key,&lat](){
+        size_t start_pos = i*per_thread_size;
+        size_t size = (i == thread_num-1) ? total_size-(thread_num-1)*per_thread_size : per_thread_size;
+        combotree::Pair* results = new combotree::Pair[scan];
+        for (size_t j = 0; j < size; ++j) {
+          uint64_t start_key = key[start_pos+j];
+          auto t = LatencyRecorder::Now();
+          size_t cnt = tree->Scan(start_key, UINT64_MAX, scan, results);
+          lat[i].Record(t, LatencyRecorder::Now());
+          for (size_t k = 0; k < cnt; ++k) {
+            if (results[k].key != start_key + k || results[k].value != start_key + k) {
+              std::cout << "range scan error!" << std::endl;
+              assert(0);
+            }
+          }
+        }
+        delete[] results;
+      });
+    }
+    for (auto& t : threads)
+      t.join();
+    timer.Record("stop");
+    threads.clear();
+    total_time = timer.Microsecond("stop", "start");
+    std::cout << "range scan " << scan << ": " << total_time/1000000.0 << " " << (double)total_size/(double)total_time*1000000.0 << std::endl;
+    print_latency("range scan " + std::to_string(scan), lat);
   }
 
   // Delete
   Random delete_rnd(0, DELETE_SIZE-1);
   for (size_t i = 0; i < DELETE_SIZE; ++i)
     std::swap(key[i],key[delete_rnd.Next()]);
+  lat = new_latency();
   per_thread_size = DELETE_SIZE / thread_num;
   timer.Clear();
   timer.Record("start");
   for (int i = 0; i < thread_num; ++i) {
-    threads.emplace_back([=,&key](){
+    threads.emplace_back([=,&key,&lat](){
       size_t start_pos = i*per_thread_size;
       size_t size = (i == thread_num-1) ? DELETE_SIZE-(thread_num-1)*per_thread_size : per_thread_size;
       for (size_t j = 0; j < size; ++j) {
-        if (tree->Delete(key[start_pos+j]) != true) {
+        auto t = LatencyRecorder::Now();
+        bool ret = tree->Delete(key[start_pos+j]);
+        lat[i].Record(t, LatencyRecorder::Now());
+        if (ret != true) {
           std::cout << "delete error!" << std::endl;
           assert(0);
         }
@@ -362,6 +476,7 @@ int main(int argc, char** argv) {
   threads.clear();
   total_time = timer.Microsecond("stop", "start");
   std::cout << "delete: " << total_time/1000000.0 << " " << (double)DELETE_SIZE/(double)total_time*1000000.0 << std::endl;
+  print_latency("delete", lat);
 
   delete tree;
 
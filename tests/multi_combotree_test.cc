@@ -4,6 +4,7 @@
 #include <cassert>
 #include <iomanip>
 #include <thread>
+#include <atomic>
 #include <map>
 #include "combotree/combotree.h"
 #include "combotree_config.h"
@@ -18,9 +19,9 @@ int thread_num = 8;
 
 int main(void) {
 #ifdef SERVER
-  ComboTree* tree = new ComboTree("/pmem0/combotree/", (1024*1024*1024*100UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
 #else
-  ComboTree* tree = new ComboTree("/mnt/pmem0/", (1024*1024*512UL), true);
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
 #endif
 
   std::cout << "TEST_SIZE:             " << TEST_SIZE << std::endl;
@@ -37,12 +38,66 @@ int main(void) {
   std::vector<std::thread> threads;
   size_t per_thread_size = TEST_SIZE / thread_num;
 
-  // PUT
+  // PUT, and Scan and Get during expansion
+  std::atomic<bool> put_finish(false);
+  std::vector<std::atomic<size_t>> put_progress(thread_num);
+  std::thread scan_thread([&](){
+    std::vector<std::pair<uint64_t,uint64_t>> kv;
+    Random scan_rnd(0, TEST_SIZE-1);
+    while (!put_finish.load()) {
+      kv.clear();
+      tree->Scan(scan_rnd.Next(), UINT64_MAX, 100, kv);
+      for (size_t j = 0; j < kv.size(); ++j) {
+        assert(kv[j].first == kv[j].second);
+        assert(j == 0 || kv[j].first > kv[j-1].first);
+      }
+    }
+  });
+  // keys put before progress must be found
+  std::thread get_thread([&](){
+    Random get_rnd(0, TEST_SIZE-1);
+    uint64_t value;
+    while (!put_finish.load()) {
+      int t = get_rnd.Next() % thread_num;
+      size_t progress = put_progress[t].load();
+      if (progress == 0)
+        continue;
+      uint64_t k = key[t*per_thread_size + get_rnd.Next() % progress];
+      assert(tree->Get(k, value) == true);
+      assert(value == k);
+    }
+  });
   for (int i = 0; i < thread_num; ++i) {
-    threads.emplace_back([=,&key](){
+    threads.emplace_back([=,&key,&put_progress](){
       uint64_t start_pos = i*per_thread_size;
-      for (size_t j = 0; j < per_thread_size; ++j)
+      for (size_t j = 0; j < per_thread_size; ++j) {
         assert(tree->Put(key[start_pos+j], key[start_pos+j]) == true);
+        put_progress[i].store(j+1);
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+  put_finish.store(true);
+  scan_thread.join();
+  get_thread.join();
+
+  // Scan
+  for (int i = 0; i < thread_num; ++i) {
+    threads.emplace_back([=](){
+      std::vector<std::pair<uint64_t,uint64_t>> kv;
+      Random scan_rnd(0, TEST_SIZE-1);
+      for (int j = 0; j < 10000; ++j) {
+        uint64_t start_key = scan_rnd.Next();
+        kv.clear();
+        tree->Scan(start_key, UINT64_MAX, 100, kv);
+        assert(kv.size() == std::min<uint64_t>(100, TEST_SIZE - start_key));
+        for (size_t k = 0; k < kv.size(); ++k) {
+          assert(kv[k].first == start_key + k);
+          assert(kv[k].second == start_key + k);
+        }
+      }
     });
   }
   for (auto& t : threads)
@@ -0,0 +1,190 @@
+#undef NDEBUG
+
+#include <iostream>
+#include <cassert>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <filesystem>
+#include "combotree/combotree.h"
+#include "pmemkv.h"
+#include "combotree_config.h"
+#include "random.h"
+
+#define TEST_SIZE   1000000
+
+using combotree::ComboTree;
+using combotree::Random;
+
+#define POOL_DIR  PMEM_DIR
+#ifdef SERVER
+#define POOL_SIZE (1024*1024*1024*100UL)
+#else
+#define POOL_SIZE (1024*1024*512UL)
+#endif
+
+void Check(ComboTree* tree, const std::map<uint64_t, uint64_t>& right_kv) {
+  uint64_t value;
+  assert(tree->Size() == right_kv.size());
+  for (auto& kv : right_kv) {
+    assert(tree->Get(kv.first, value) == true);
+    assert(value == kv.second);
+  }
+
+  std::vector<std::pair<uint64_t, uint64_t>> results;
+  assert(tree->Scan(0, UINT64_MAX, UINT64_MAX, results) == right_kv.size());
+  auto right_iter = right_kv.begin();
+  for (auto& kv : results) {
+    assert(kv.first == right_iter->first);
+    assert(kv.second == right_iter->second);
+    right_iter++;
+  }
+}
+
+int main(void) {
+#ifdef NDEBUG
+static_assert(0, "NDEBUG!");
+#endif // NDEBUG
+
+  std::cout << "TEST_SIZE:             " << TEST_SIZE << std::endl;
+
+  std::map<uint64_t, uint64_t> right_kv;
+  int cnt;
+  Random rnd(0, UINT64_MAX - 1);
+
+  // small tree stage, recovered from its log
+  ComboTree* tree = new ComboTree(POOL_DIR, POOL_SIZE, true);
+  for (uint64_t i = 0; i < PMEMKV_THRESHOLD / 2; ++i) {
+    uint64_t key = rnd.Next();
+    right_kv[key] = key;
+    tree->Put(key, key);
+  }
+  cnt = 0;
+  for (auto iter = right_kv.begin(); iter != right_kv.end();) {
+    if (cnt % 3 == 0) {
+      assert(tree->Delete(iter->first) == true);
+      iter = right_kv.erase(iter);
+    } else {
+      if (cnt % 3 == 1) {
+        iter->second++;
+        assert(tree->Update(iter->first, iter->second) == true);
+      }
+      iter++;
+    }
+    cnt++;
+  }
+  Check(tree, right_kv);
+  delete tree;
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, false);
+  Check(tree, right_kv);
+  delete tree;
+  right_kv.clear();
+
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, true);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    uint64_t key = rnd.Next();
+    if (right_kv.count(key)) {
+      i--;
+      continue;
+    }
+    uint64_t value = rnd.Next();
+    right_kv.emplace(key, value);
+    tree->Put(key, value);
+  }
+  // delete every third key
+  cnt = 0;
+  for (auto iter = right_kv.begin(); iter != right_kv.end();) {
+    if (cnt++ % 3 == 0) {
+      assert(tree->Delete(iter->first) == true);
+      iter = right_kv.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+  Check(tree, right_kv);
+  delete tree;
+
+  // reopen
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, false);
+  Check(tree, right_kv);
+
+  // expansion still works after recovery
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    uint64_t key = rnd.Next();
+    if (right_kv.count(key)) {
+      i--;
+      continue;
+    }
+    uint64_t value = rnd.Next();
+    right_kv.emplace(key, value);
+    tree->Put(key, value);
+  }
+  while (tree->IsExpanding()) ;
+  Check(tree, right_kv);
+  delete tree;
+
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, false);
+  Check(tree, right_kv);
+  delete tree;
+
+  // reopen in a new process, nothing of the creating process is left
+  for (bool combo_tree : {false, true}) {
+    right_kv.clear();
+    std::vector<uint64_t> keys;
+    while (right_kv.size() < (combo_tree ? TEST_SIZE : PMEMKV_THRESHOLD / 2)) {
+      uint64_t key = rnd.Next();
+      if (right_kv.emplace(key, key + 1).second)
+        keys.push_back(key);
+    }
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      tree = new ComboTree(POOL_DIR, POOL_SIZE, true);
+      for (auto key : keys)
+        tree->Put(key, key + 1);
+      while (tree->IsExpanding()) ;
+      delete tree;
+      _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    tree = new ComboTree(POOL_DIR, POOL_SIZE, false);
+    Check(tree, right_kv);
+    delete tree;
+  }
+
+  // updates of one key never fill the small tree stage log
+  {
+    std::string path = std::string(POOL_DIR) + "pmemkv_compact";
+    combotree::PmemKV::SetWriteValid();
+    combotree::PmemKV::SetReadValid();
+    combotree::PmemKV* kv = new combotree::PmemKV(path, 64 * 1024, true);
+    for (uint64_t i = 0; i < 100000; ++i) {
+      assert(kv->Put(1, i) == true);
+      assert(kv->Put(i % 100 + 2, i) == true);
+      if (i % 3 == 0)
+        assert(kv->Delete(i % 100 + 2) == true);
+    }
+    size_t size = 1;
+    for (uint64_t i = 100000 - 100; i < 100000; ++i)
+      size += (i % 3 != 0);
+    assert(kv->Size() == size);
+    delete kv;
+    kv = new combotree::PmemKV(path, 64 * 1024, false);
+    uint64_t value;
+    assert(kv->Size() == size);
+    assert(kv->Get(1, value) == true && value == 99999);
+    for (uint64_t i = 100000 - 100; i < 100000; ++i) {
+      assert(kv->Get(i % 100 + 2, value) == (i % 3 != 0));
+      if (i % 3 != 0)
+        assert(value == i);
+    }
+    delete kv;
+    std::filesystem::remove(path);
+  }
+
+  std::cout << "test finished" << std::endl;
+  return 0;
+}
@@ -47,5 +47,83 @@ int main(void) {
     assert(value == i);
   }
 
+  // slots filled in sorted order, then copied into a bigger buffer
+  SortBuffer<104, 8> small;
+  small.suffix_bytes = 2;
+  small.prefix_bytes = 6;
+  small.max_entries  = small.MaxEntries();
+  for (int i = 0; i < 5; ++i) {
+    uint64_t key = i * 2;
+    memcpy(small.pkey(i), &key, 2);
+    memcpy(small.pvalue(i), &key, 8);
+  }
+  small.SetSorted(5);
+  // keys after existing ones take free slots
+  small.Put(2, 3, 3);
+  small.Put(6, 9, 9);
+  assert(small.entries == 7);
+
+  SortBuffer<112, 8> big;
+  big.suffix_bytes = 2;
+  big.prefix_bytes = 6;
+  big.max_entries  = big.MaxEntries();
+  big.FromSortBuffer(small);
+  uint64_t right[] = {0, 2, 3, 4, 6, 8, 9};
+  assert(big.entries == 7);
+  for (int i = 0; i < 7; ++i) {
+    assert(small.sort_key(i, 0) == right[i]);
+    assert(big.sort_key(i, 0) == right[i]);
+    assert(big.sort_value(i) == right[i]);
+  }
+  big.Put(7, 10, 10);
+  assert(big.sort_key(7, 0) == 10);
+
+  // bigger keys appended in one header store
+  SortBuffer<112, 8> tail;
+  tail.suffix_bytes = 2;
+  tail.prefix_bytes = 6;
+  tail.max_entries  = tail.MaxEntries();
+  tail.entries = 0;
+  tail.Put(0, 12, 12);
+  tail.Put(0, 11, 11);
+  big.Append(tail);
+  assert(big.entries == 10);
+  for (int i = 8; i < 10; ++i) {
+    assert(big.sort_key(i, 0) == (uint64_t)i + 3);
+    assert(big.sort_value(i) == (uint64_t)i + 3);
+  }
+
+  // sorted puts leave the old pairs intact until the header is published
+  SortBuffer<112, 8> batch;
+  batch.suffix_bytes = 2;
+  batch.prefix_bytes = 6;
+  batch.max_entries  = batch.MaxEntries();
+  batch.entries = 0;
+  for (int i = 0; i < 4; ++i)
+    batch.Put(i, i * 2, i * 2);
+  uint64_t old_header = batch.header;
+  uint64_t batch_keys[] = {1, 2, 5, 6};
+  uint64_t batch_values[] = {101, 102, 105, 106};
+  assert(batch.PutSorted(batch_keys, batch_values, 4) == 4);
+  uint64_t batch_right[][2] = {{0, 0}, {1, 101}, {2, 102}, {4, 4}, {5, 105}, {6, 106}};
+  assert(batch.entries == 6);
+  for (int i = 0; i < 6; ++i) {
+    assert(batch.sort_key(i, 0) == batch_right[i][0]);
+    assert(batch.sort_value(i) == batch_right[i][1]);
+  }
+  SortBuffer<112, 8> crashed = batch;
+  crashed.header = old_header;
+  assert(crashed.entries == 4);
+  for (int i = 0; i < 4; ++i) {
+    assert(crashed.sort_key(i, 0) == (uint64_t)i * 2);
+    assert(crashed.sort_value(i) == (uint64_t)i * 2);
+  }
+  // the last free slot is not taken
+  uint64_t more_keys[] = {7, 8, 9, 10, 11, 12};
+  assert(batch.PutSorted(more_keys, more_keys, 6) == batch.max_entries - 1 - 6);
+  assert(batch.entries == batch.max_entries - 1);
+  for (int i = 0; i < batch.entries; ++i)
+    assert(batch.sort_key(i, 0) < batch.sort_key(i + 1, 0) || i == batch.entries - 1);
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,177 @@
+#undef NDEBUG
+
+#include <iostream>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <map>
+#include "combotree/combotree.h"
+#include "combotree_config.h"
+#include "random.h"
+
+#define TEST_SIZE   200000
+#define BIG_CHAIN   20000
+
+using combotree::ComboTree;
+using combotree::Random;
+
+#define POOL_DIR  PMEM_DIR
+#ifdef SERVER
+#define POOL_SIZE (1024*1024*1024*100UL)
+#else
+#define POOL_SIZE (1024*1024*512UL)
+#endif
+
+// short strings are inline, long ones share a 7-byte prefix in groups
+// of up to 4. bytes cover the whole range, including '\0'.
+std::string MakeKey(Random& rnd, uint64_t i) {
+  uint64_t r = rnd.Next();
+  if (i % 3 == 0)
+    return std::string((const char*)&r, 1 + r % 7);
+  static std::string prefix;
+  if (i % 3 == 1 || prefix.empty())
+    prefix.assign((const char*)&r, 7);
+  return prefix + std::to_string(r % 100000) + std::string(r % 3, '\0');
+}
+
+void Check(ComboTree* tree, const std::map<std::string, uint64_t>& right_kv) {
+  uint64_t value;
+  for (auto& kv : right_kv) {
+    assert(tree->GetString(kv.first, value) == true);
+    assert(value == kv.second);
+  }
+
+  // strings come out in order, across inline keys and chains
+  std::vector<std::pair<std::string, uint64_t>> results;
+  assert(tree->ScanString("", SIZE_MAX, results) == right_kv.size());
+  auto iter = right_kv.begin();
+  for (auto& kv : results) {
+    assert(kv.first == iter->first && kv.second == iter->second);
+    iter++;
+  }
+
+  // start in the middle of a chain
+  for (auto& kv : right_kv) {
+    if (kv.first.size() <= 7 || kv.first.back() == '\0')
+      continue;
+    std::string min_key = kv.first + '\0';
+    results.clear();
+    assert(tree->ScanString(min_key, 100, results) <= 100);
+    auto right = right_kv.lower_bound(min_key);
+    for (auto& r : results) {
+      assert(r.first == right->first && r.second == right->second);
+      right++;
+    }
+    assert(results.size() == 100 || right == right_kv.end());
+    break;
+  }
+}
+
+int main(void) {
+#ifdef NDEBUG
+static_assert(0, "NDEBUG!");
+#endif // NDEBUG
+
+  std::cout << "TEST_SIZE:             " << TEST_SIZE << std::endl;
+
+  ComboTree::Options options;
+  options.value_log_size = 128 * 1024 * 1024UL;
+  options.string_keys = true;
+  ComboTree* tree = new ComboTree(POOL_DIR, POOL_SIZE, true, options);
+
+  std::map<std::string, uint64_t> right_kv;
+  Random rnd(0, UINT64_MAX - 1);
+  for (uint64_t i = 0; i < TEST_SIZE; ++i) {
+    std::string key = MakeKey(rnd, i);
+    if (right_kv.count(key))
+      continue;
+    right_kv[key] = rnd.Next();
+    assert(tree->PutString(key, right_kv[key]) == true);
+  }
+  // one prefix with more strings than a value log segment holds
+  for (uint64_t i = 0; i < BIG_CHAIN; ++i) {
+    std::string key = "bigpref" + std::to_string(1000000 + i) + std::string(240, 'x');
+    right_kv[key] = i;
+    assert(tree->PutString(key, i) == true);
+  }
+  // strings of one prefix put out of order, nodes are split in the middle.
+  // half of them tie on the 8 bytes after the prefix.
+  for (uint64_t i = 0; i < 2000; ++i) {
+    uint64_t r = rnd.Next();
+    std::string chunk = i % 2 ? std::string((const char*)&r, 8) : "tiedtied";
+    std::string key = "shuffle" + chunk + std::to_string(r % 100000);
+    if (right_kv.count(key))
+      continue;
+    right_kv[key] = r;
+    assert(tree->PutString(key, r) == true);
+  }
+  // a long key whose prefix has a chain but is not in it
+  uint64_t value;
+  for (auto& kv : right_kv) {
+    if (kv.first.size() > 7) {
+      std::string key = kv.first + "missing";
+      assert(tree->GetString(key, value) == false);
+      assert(tree->UpdateString(key, 1) == false);
+      assert(tree->DeleteString(key) == false);
+      // not an upsert
+      assert(tree->PutString(kv.first, 1) == false);
+      assert(tree->PutString(key, 1) == true);
+      assert(tree->PutString(key, 2) == false);
+      right_kv[key] = 1;
+      break;
+    }
+  }
+  Check(tree, right_kv);
+
+  // deletes leave dead records for gc
+  for (int round = 1; round <= 3; ++round) {
+    int cnt = 0;
+    for (auto iter = right_kv.begin(); iter != right_kv.end();) {
+      if (cnt++ % 4 == 0 && round == 3) {
+        assert(tree->DeleteString(iter->first) == true);
+        iter = right_kv.erase(iter);
+      } else {
+        iter->second = rnd.Next();
+        assert(tree->UpdateString(iter->first, iter->second) == true);
+        iter++;
+      }
+    }
+  }
+  Check(tree, right_kv);
+
+  // most of the big chain is dead, gc moves the rest while reading
+  int cnt = 0;
+  for (auto iter = right_kv.lower_bound("bigpref");
+       iter != right_kv.end() && iter->first.compare(0, 7, "bigpref") == 0;) {
+    if (cnt++ % 4 != 0) {
+      assert(tree->DeleteString(iter->first) == true);
+      iter = right_kv.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+  Check(tree, right_kv);
+
+  // chains are found again from the tree
+  delete tree;
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, false, options);
+  Check(tree, right_kv);
+  for (auto& kv : right_kv) {
+    kv.second = rnd.Next();
+    assert(tree->UpdateString(kv.first, kv.second) == true);
+  }
+  Check(tree, right_kv);
+  delete tree;
+
+  // long strings need the value log
+  options.value_log_size = 0;
+  options.string_keys = false;
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, true, options);
+  assert(tree->PutString("short", 1) == true);
+  assert(tree->PutString("longer string", 1) == false);
+  assert(tree->GetString("longer string", value) == false);
+  delete tree;
+
+  std::cout << "test finished" << std::endl;
+  return 0;
+}
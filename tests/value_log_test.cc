@@ -0,0 +1,129 @@
+#undef NDEBUG
+
+#include <iostream>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <map>
+#include <thread>
+#include <chrono>
+#include "combotree/combotree.h"
+#include "combotree_config.h"
+#include "random.h"
+
+#define TEST_SIZE   200000
+
+using combotree::ComboTree;
+using combotree::Random;
+
+#define POOL_DIR  PMEM_DIR
+#ifdef SERVER
+#define POOL_SIZE (1024*1024*1024*100UL)
+#else
+#define POOL_SIZE (1024*1024*512UL)
+#endif
+
+// 32 to 512 bytes, filled from key and version
+std::string MakeValue(uint64_t key, int version) {
+  std::string value(32 + (key + version) % 481, '\0');
+  for (size_t i = 0; i < value.size(); ++i)
+    value[i] = (char)(key * 31 + version * 7 + i);
+  return value;
+}
+
+void Check(ComboTree* tree, const std::map<uint64_t, std::string>& right_kv) {
+  ComboTree::ValueRef value;
+  assert(tree->Size() == right_kv.size());
+  for (auto& kv : right_kv) {
+    assert(tree->GetValue(kv.first, value) == true);
+    assert(value.size() == kv.second.size());
+    assert(memcmp(value.data(), kv.second.data(), value.size()) == 0);
+  }
+}
+
+int main(void) {
+#ifdef NDEBUG
+static_assert(0, "NDEBUG!");
+#endif // NDEBUG
+
+  std::cout << "TEST_SIZE:             " << TEST_SIZE << std::endl;
+
+  ComboTree::Options options;
+  // about 58MB per version of all values, later versions need gc
+  options.value_log_size = 192 * 1024 * 1024UL;
+  ComboTree* tree = new ComboTree(POOL_DIR, POOL_SIZE, true, options);
+
+  std::map<uint64_t, std::string> right_kv;
+  Random rnd(0, UINT64_MAX - 1);
+  for (int i = 0; i < TEST_SIZE; ++i) {
+    uint64_t key = rnd.Next();
+    if (right_kv.count(key)) {
+      i--;
+      continue;
+    }
+    right_kv[key] = MakeValue(key, 0);
+    assert(tree->PutValue(key, right_kv[key].data(), right_kv[key].size()) == true);
+  }
+  // not an upsert
+  assert(tree->PutValue(right_kv.begin()->first, "x", 1) == false);
+  Check(tree, right_kv);
+
+  // updates and deletes leave dead records for gc, views pin their space
+  ComboTree::ValueRef pinned;
+  assert(tree->GetValue(right_kv.begin()->first, pinned) == true);
+  std::string pinned_value = right_kv.begin()->second;
+  for (int round = 1; round <= 3; ++round) {
+    int cnt = 0;
+    for (auto iter = right_kv.begin(); iter != right_kv.end();) {
+      if (cnt++ % 4 == 0 && round == 3) {
+        assert(tree->DeleteValue(iter->first) == true);
+        iter = right_kv.erase(iter);
+      } else {
+        iter->second = MakeValue(iter->first, round);
+        assert(tree->UpdateValue(iter->first, iter->second.data(), iter->second.size()) == true);
+        iter++;
+      }
+    }
+  }
+  assert(tree->DeleteValue(UINT64_MAX) == false);
+  assert(memcmp(pinned.data(), pinned_value.data(), pinned.size()) == 0);
+  pinned.Reset();
+  Check(tree, right_kv);
+
+  // live records are found again from the tree
+  delete tree;
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, false, options);
+  Check(tree, right_kv);
+  for (auto& kv : right_kv) {
+    kv.second = MakeValue(kv.first, 4);
+    assert(tree->UpdateValue(kv.first, kv.second.data(), kv.second.size()) == true);
+  }
+  Check(tree, right_kv);
+  delete tree;
+
+  // writers can not take the last free segment, gc moves victims of a
+  // full log into it
+  options.value_log_size = 4 * VALUE_LOG_SEGMENT_SIZE;
+  tree = new ComboTree(POOL_DIR, POOL_SIZE, true, options);
+  std::string big(4000, 'v');
+  uint64_t n = 0;
+  while (tree->PutValue(n, big.data(), big.size()))
+    n++;
+  for (uint64_t i = 0; i < n; ++i)
+    if (i % 4 != 0)
+      assert(tree->DeleteValue(i) == true);
+  for (int tries = 0; !tree->PutValue(n, big.data(), big.size()); ++tries) {
+    assert(tries < 1000);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ComboTree::ValueRef value;
+  for (uint64_t i = 0; i <= n; i += 4) {
+    assert(tree->GetValue(i, value) == true);
+    assert(value.size() == big.size());
+  }
+  value.Reset();
+  delete tree;
+
+  std::cout << "test finished" << std::endl;
+  return 0;
+}
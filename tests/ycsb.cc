@@ -0,0 +1,290 @@
+#include <iostream>
+#include <cassert>
+#include <iomanip>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <getopt.h>
+#include "combotree/combotree.h"
+#include "combotree_config.h"
+#include "timer.h"
+#include "histogram.h"
+#include "ycsb.h"
+
+// YCSB-style workload driver: load RECORD_COUNT items, then run OP_COUNT
+// operations of the chosen mix on every thread's own operation stream,
+// throughput is reported every interval.
+
+size_t RECORD_COUNT = 10000000;
+size_t OP_COUNT     = 10000000;
+
+int thread_num      = 4;
+int interval_ms     = 1000;
+int series_ms       = 0;
+
+using combotree::ComboTree;
+using combotree::Timer;
+using combotree::LatencyRecorder;
+using namespace combotree::ycsb;
+
+// per thread counters, padded to avoid false sharing
+struct alignas(64) ThreadStat {
+  std::atomic<uint64_t> ops{0};
+  uint64_t read_miss = 0;
+  std::vector<LatencyRecorder> lat;  // indexed by Op
+};
+
+const char* op_name[] = {"read", "update", "insert", "scan", "rmw"};
+
+void show_help(char* prog) {
+  std::cout <<
+    "Usage: " << prog << " [options]" << std::endl <<
+    std::endl <<
+    "  Option:" << std::endl <<
+    "    --thread[-t]             thread number" << std::endl <<
+    "    --workload[-w]           YCSB workload a-f (default a)" << std::endl <<
+    "    --record-count           RECORD_COUNT" << std::endl <<
+    "    --op-count               OP_COUNT" << std::endl <<
+    "    --dist                   uniform|zipfian|scrambled|latest|hotspot" << std::endl <<
+    "    --read                   read proportion" << std::endl <<
+    "    --update                 update proportion" << std::endl <<
+    "    --insert                 insert proportion" << std::endl <<
+    "    --scan                   scan proportion" << std::endl <<
+    "    --rmw                    read-modify-write proportion" << std::endl <<
+    "    --max-scan               max scan length" << std::endl <<
+    "    --interval[-i]           report interval in ms" << std::endl <<
+    "    --latency-series         latency time series window in ms" << std::endl <<
+    "    --help[-h]               show help" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  static struct option opts[] = {
+  /* NAME               HAS_ARG            FLAG  SHORTNAME*/
+    {"thread",          required_argument, NULL, 't'},
+    {"workload",        required_argument, NULL, 'w'},
+    {"record-count",    required_argument, NULL, 0},
+    {"op-count",        required_argument, NULL, 0},
+    {"dist",            required_argument, NULL, 0},
+    {"read",            required_argument, NULL, 0},
+    {"update",          required_argument, NULL, 0},
+    {"insert",          required_argument, NULL, 0},
+    {"scan",            required_argument, NULL, 0},
+    {"rmw",             required_argument, NULL, 0},
+    {"max-scan",        required_argument, NULL, 0},
+    {"interval",        required_argument, NULL, 'i'},
+    {"help",            no_argument,       NULL, 'h'},
+    {"latency-series",  required_argument, NULL, 0},
+    {NULL, 0, NULL, 0}
+  };
+
+  Workload w;
+  GetWorkload('a', w);
+  // overrides are applied after workload is chosen
+  char workload_name = 'a';
+  std::string dist_name;
+  double read = -1, update = -1, insert = -1, scan = -1, rmw = -1;
+  int max_scan = -1;
+
+  int c;
+  int opt_idx;
+  while ((c = getopt_long(argc, argv, "t:w:i:h", opts, &opt_idx)) != -1) {
+    switch (c) {
+      case 0:
+        switch (opt_idx) {
+          case 0: thread_num = atoi(optarg); break;
+          case 1: workload_name = optarg[0]; break;
+          case 2: RECORD_COUNT = atol(optarg); break;
+          case 3: OP_COUNT = atol(optarg); break;
+          case 4: dist_name = optarg; break;
+          case 5: read = atof(optarg); break;
+          case 6: update = atof(optarg); break;
+          case 7: insert = atof(optarg); break;
+          case 8: scan = atof(optarg); break;
+          case 9: rmw = atof(optarg); break;
+          case 10: max_scan = atoi(optarg); break;
+          case 11: interval_ms = atoi(optarg); break;
+          case 12: show_help(argv[0]); return 0;
+          case 13: series_ms = atoi(optarg); break;
+          default: std::cerr << "Parse Argument Error!" << std::endl; abort();
+        }
+        break;
+      case 't': thread_num = atoi(optarg); break;
+      case 'w': workload_name = optarg[0]; break;
+      case 'i': interval_ms = atoi(optarg); break;
+      case 'h': show_help(argv[0]); return 0;
+      case '?': break;
+      default:  std::cout << (char)c << std::endl; abort();
+    }
+  }
+
+  if (!GetWorkload(workload_name, w)) {
+    std::cerr << "unknown workload " << workload_name << std::endl;
+    return -1;
+  }
+  if (!dist_name.empty() && !ParseDistribution(dist_name, w.dist)) {
+    std::cerr << "unknown distribution " << dist_name << std::endl;
+    return -1;
+  }
+  if (read >= 0)   w.read = read;
+  if (update >= 0) w.update = update;
+  if (insert >= 0) w.insert = insert;
+  if (scan >= 0)   w.scan = scan;
+  if (rmw >= 0)    w.rmw = rmw;
+  if (max_scan > 0) w.max_scan = max_scan;
+  if (w.read + w.update + w.insert + w.scan + w.rmw <= 0 || RECORD_COUNT == 0) {
+    std::cerr << "empty workload!" << std::endl;
+    return -1;
+  }
+
+  std::cout << "THREAD NUMBER:         " << thread_num << std::endl;
+  std::cout << "WORKLOAD:              " << workload_name << std::endl;
+  std::cout << "RECORD_COUNT:          " << RECORD_COUNT << std::endl;
+  std::cout << "OP_COUNT:              " << OP_COUNT << std::endl;
+  std::cout << "DISTRIBUTION:          " << DistributionName(w.dist) << std::endl;
+  std::cout << "READ/UPDATE/INSERT/SCAN/RMW: " << w.read << "/" << w.update << "/"
+            << w.insert << "/" << w.scan << "/" << w.rmw << std::endl;
+  std::cout << "MAX_SCAN:              " << w.max_scan << std::endl;
+  std::cout << std::endl;
+
+#ifdef SERVER
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*1024*100UL), true);
+#else
+  ComboTree* tree = new ComboTree(PMEM_DIR, (1024*1024*512UL), true);
+#endif
+
+  Timer timer;
+  std::vector<std::thread> threads;
+  size_t per_thread_size;
+
+  std::cout << std::fixed << std::setprecision(2);
+
+  // Load
+  per_thread_size = RECORD_COUNT / thread_num;
+  timer.Record("start");
+  for (int i = 0; i < thread_num; ++i) {
+    threads.emplace_back([=](){
+      size_t start_pos = i*per_thread_size;
+      size_t size = (i == thread_num-1) ? RECORD_COUNT-(thread_num-1)*per_thread_size : per_thread_size;
+      for (size_t j = start_pos; j < start_pos+size; ++j) {
+        if (tree->Put(KeyOf(j), j) != true) {
+          std::cout << "load error!" << std::endl;
+          assert(0);
+        }
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  timer.Record("stop");
+  threads.clear();
+  uint64_t total_time = timer.Microsecond("stop", "start");
+  std::cout << "load: " << total_time/1000000.0 << " " << (double)RECORD_COUNT/(double)total_time*1000000.0 << std::endl;
+
+  // Run
+  AcknowledgedCounter insert_count(RECORD_COUNT, OP_COUNT);
+  std::vector<ThreadStat> stat(thread_num);
+  for (auto& s : stat)
+    s.lat.assign(5, LatencyRecorder(LatencyRecorder::Now(), series_ms*1000));
+  std::atomic<int> running(thread_num);
+
+  per_thread_size = OP_COUNT / thread_num;
+  timer.Clear();
+  timer.Record("start");
+  for (int i = 0; i < thread_num; ++i) {
+    threads.emplace_back([=,&insert_count,&stat,&running,&timer](){
+      size_t size = (i == thread_num-1) ? OP_COUNT-(thread_num-1)*per_thread_size : per_thread_size;
+      std::unique_ptr<Generator> gen(NewGenerator(w.dist, i+1, insert_count.Limit()));
+      UniformGenerator scan_len(i+1);
+      OpChooser chooser(w, (i+1)*7919);
+      combotree::Pair* results = new combotree::Pair[w.max_scan];
+      ThreadStat& s = stat[i];
+      uint64_t value;
+      for (size_t j = 0; j < size; ++j) {
+        Op op = chooser.Next();
+        auto t = LatencyRecorder::Now();
+        if (op == Op::INSERT) {
+          uint64_t item = insert_count.Next();
+          if (tree->Put(KeyOf(item), item) != true) {
+            std::cout << "insert error!" << std::endl;
+            assert(0);
+          }
+          insert_count.Acknowledge(item);
+        } else {
+          uint64_t item = gen->Next(insert_count.Limit());
+          uint64_t key = KeyOf(item);
+          switch (op) {
+            case Op::READ:
+              if (!tree->Get(key, value))
+                s.read_miss++;
+              break;
+            case Op::UPDATE:
+              if (tree->Update(key, item) != true) {
+                std::cout << "update error!" << std::endl;
+                assert(0);
+              }
+              break;
+            case Op::SCAN:
+              tree->Scan(key, UINT64_MAX, 1 + scan_len.Next(w.max_scan), results);
+              break;
+            case Op::RMW:
+              if (!tree->Get(key, value))
+                s.read_miss++;
+              if (tree->Update(key, value + 1) != true) {
+                std::cout << "update error!" << std::endl;
+                assert(0);
+              }
+              break;
+            default:
+              assert(0);
+          }
+        }
+        s.lat[(int)op].Record(t, LatencyRecorder::Now());
+        s.ops.store(s.ops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      }
+      delete[] results;
+      // last thread stops the timer, reporter may still be sleeping
+      if (running.fetch_sub(1) == 1)
+        timer.Record("stop");
+    });
+  }
+
+  // throughput over time
+  uint64_t last_ops = 0;
+  auto last = std::chrono::steady_clock::now();
+  auto begin = last;
+  while (running.load() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+    auto now = std::chrono::steady_clock::now();
+    uint64_t ops = 0;
+    for (auto& s : stat)
+      ops += s.ops.load(std::memory_order_relaxed);
+    double elapsed = std::chrono::duration<double>(now - begin).count();
+    double span = std::chrono::duration<double>(now - last).count();
+    std::cout << "time " << elapsed << " ops " << ops << " throughput "
+              << (ops - last_ops) / span << std::endl;
+    last_ops = ops;
+    last = now;
+  }
+
+  for (auto& t : threads)
+    t.join();
+  threads.clear();
+  total_time = timer.Microsecond("stop", "start");
+
+  uint64_t read_miss = 0;
+  for (auto& s : stat)
+    read_miss += s.read_miss;
+  std::cout << "run: " << total_time/1000000.0 << " " << (double)OP_COUNT/(double)total_time*1000000.0 << std::endl;
+  std::cout << "inserted:  " << insert_count.Inserted() << std::endl;
+  std::cout << "read miss: " << read_miss << std::endl;
+  for (int op = 0; op < 5; ++op) {
+    for (int i = 1; i < thread_num; ++i)
+      stat[0].lat[op].Merge(stat[i].lat[op]);
+    stat[0].lat[op].Print(op_name[op]);
+  }
+  std::cout << "size:      " << tree->Size() << std::endl;
+
+  delete tree;
+
+  return 0;
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+
+namespace combotree {
+namespace ycsb {
+
+// key generators of YCSB core workloads, every generator returns an item
+// number, which is mapped to a key by KeyOf(). generators are not thread
+// safe, each thread owns its own generators.
+
+// FNV-1a hash of item number
+inline uint64_t FNVHash64(uint64_t val) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (int i = 0; i < 8; ++i) {
+    hash ^= val & 0xFF;
+    hash *= 1099511628211ULL;
+    val >>= 8;
+  }
+  return hash;
+}
+
+// spread item numbers over the whole key space, so keys inserted later
+// do not always go to the tail of ComboTree
+inline uint64_t KeyOf(uint64_t item) {
+  return FNVHash64(item);
+}
+
+class Generator {
+ public:
+  explicit Generator(uint64_t seed) : rng_(seed), real_(0.0, 1.0) {}
+  virtual ~Generator() = default;
+
+  // item number in [0, items)
+  virtual uint64_t Next(uint64_t items) = 0;
+
+ protected:
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> real_;
+
+  double NextDouble() { return real_(rng_); }
+};
+
+class UniformGenerator : public Generator {
+ public:
+  explicit UniformGenerator(uint64_t seed) : Generator(seed) {}
+
+  uint64_t Next(uint64_t items) override {
+    return rng_() % items;
+  }
+};
+
+// Gray et al. "Quickly Generating Billion-Record Synthetic Databases",
+// item 0 is the most popular one. zeta is updated incrementally when
+// items grows, items never shrinks.
+class ZipfianGenerator : public Generator {
+ public:
+  static constexpr double ZIPFIAN_CONSTANT = 0.99;
+
+  ZipfianGenerator(uint64_t seed, uint64_t items, double theta = ZIPFIAN_CONSTANT)
+    : Generator(seed), items_(0), theta_(theta), zetan_(0)
+  {
+    alpha_ = 1.0 / (1.0 - theta_);
+    zeta2_ = Zeta(0, 2, 0);
+    Resize_(items);
+  }
+
+  uint64_t Next(uint64_t items) override {
+    if (items > items_)
+      Resize_(items);
+    double u = NextDouble();
+    double uz = u * zetan_;
+    if (uz < 1.0)
+      return 0;
+    if (uz < 1.0 + std::pow(0.5, theta_))
+      return 1;
+    uint64_t ret = items_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+    return ret < items ? ret : items - 1;
+  }
+
+ private:
+  uint64_t items_;
+  double theta_;
+  double alpha_;
+  double zeta2_;
+  double zetan_;
+  double eta_;
+
+  double Zeta(uint64_t from, uint64_t to, double sum) const {
+    for (uint64_t i = from; i < to; ++i)
+      sum += 1.0 / std::pow(i + 1, theta_);
+    return sum;
+  }
+
+  void Resize_(uint64_t items) {
+    zetan_ = Zeta(items_, items, zetan_);
+    items_ = items;
+    eta_ = (1 - std::pow(2.0 / items_, 1 - theta_)) / (1 - zeta2_ / zetan_);
+  }
+};
+
+// zipfian, but popular items are scattered over the item space
+class ScrambledZipfianGenerator : public Generator {
+ public:
+  ScrambledZipfianGenerator(uint64_t seed, uint64_t items)
+    : Generator(seed), zipf_(seed, items) {}
+
+  uint64_t Next(uint64_t items) override {
+    return FNVHash64(zipf_.Next(items)) % items;
+  }
+
+ private:
+  ZipfianGenerator zipf_;
+};
+
+// most recently inserted items are the most popular ones
+class LatestGenerator : public Generator {
+ public:
+  LatestGenerator(uint64_t seed, uint64_t items)
+    : Generator(seed), zipf_(seed, items) {}
+
+  uint64_t Next(uint64_t items) override {
+    return items - 1 - zipf_.Next(items);
+  }
+
+ private:
+  ZipfianGenerator zipf_;
+};
+
+// hot_fraction of items get hot_op_fraction of operations
+class HotspotGenerator : public Generator {
+ public:
+  HotspotGenerator(uint64_t seed, double hot_fraction = 0.2, double hot_op_fraction = 0.8)
+    : Generator(seed), hot_fraction_(hot_fraction), hot_op_fraction_(hot_op_fraction) {}
+
+  uint64_t Next(uint64_t items) override {
+    uint64_t hot_items = std::max<uint64_t>(1, items * hot_fraction_);
+    if (hot_items >= items || NextDouble() < hot_op_fraction_)
+      return rng_() % hot_items;
+    return hot_items + rng_() % (items - hot_items);
+  }
+
+ private:
+  double hot_fraction_;
+  double hot_op_fraction_;
+};
+
+// item numbers handed out to inserts, Limit() only covers items whose
+// insert has finished, so reads and updates never see a missing key.
+class AcknowledgedCounter {
+ public:
+  // start: items already loaded, max_inserts: max items handed out
+  AcknowledgedCounter(uint64_t start, size_t max_inserts)
+    : start_(start), next_(start), limit_(start),
+      ack_(new std::atomic<bool>[max_inserts+1]())
+  {}
+
+  uint64_t Next() {
+    return next_.fetch_add(1);
+  }
+
+  void Acknowledge(uint64_t item) {
+    ack_[item - start_].store(true, std::memory_order_release);
+    // whoever holds the lock moves limit forward
+    if (lock_.try_lock()) {
+      uint64_t limit = limit_.load(std::memory_order_relaxed);
+      while (limit < next_.load() && ack_[limit - start_].load(std::memory_order_acquire))
+        limit++;
+      limit_.store(limit, std::memory_order_release);
+      lock_.unlock();
+    }
+  }
+
+  // items [0, Limit()) are inserted
+  uint64_t Limit() const {
+    return limit_.load(std::memory_order_acquire);
+  }
+
+  uint64_t Inserted() const {
+    return next_.load() - start_;
+  }
+
+ private:
+  uint64_t start_;
+  std::atomic<uint64_t> next_;
+  std::atomic<uint64_t> limit_;
+  std::unique_ptr<std::atomic<bool>[]> ack_;
+  std::mutex lock_;
+};
+
+enum class Distribution {
+  UNIFORM,
+  ZIPFIAN,
+  SCRAMBLED_ZIPFIAN,
+  LATEST,
+  HOTSPOT,
+};
+
+inline bool ParseDistribution(const std::string& name, Distribution& dist) {
+  if (name == "uniform")        dist = Distribution::UNIFORM;
+  else if (name == "zipfian")   dist = Distribution::ZIPFIAN;
+  else if (name == "scrambled") dist = Distribution::SCRAMBLED_ZIPFIAN;
+  else if (name == "latest")    dist = Distribution::LATEST;
+  else if (name == "hotspot")   dist = Distribution::HOTSPOT;
+  else return false;
+  return true;
+}
+
+inline const char* DistributionName(Distribution dist) {
+  switch (dist) {
+    case Distribution::UNIFORM:           return "uniform";
+    case Distribution::ZIPFIAN:           return "zipfian";
+    case Distribution::SCRAMBLED_ZIPFIAN: return "scrambled";
+    case Distribution::LATEST:            return "latest";
+    case Distribution::HOTSPOT:           return "hotspot";
+  }
+  return "unknown";
+}
+
+inline Generator* NewGenerator(Distribution dist, uint64_t seed, uint64_t items) {
+  switch (dist) {
+    case Distribution::UNIFORM:           return new UniformGenerator(seed);
+    case Distribution::ZIPFIAN:           return new ZipfianGenerator(seed, items);
+    case Distribution::SCRAMBLED_ZIPFIAN: return new ScrambledZipfianGenerator(seed, items);
+    case Distribution::LATEST:            return new LatestGenerator(seed, items);
+    case Distribution::HOTSPOT:           return new HotspotGenerator(seed);
+  }
+  return nullptr;
+}
+
+// operation mix, proportions need not sum to 1
+struct Workload {
+  double read;
+  double update;
+  double insert;
+  double scan;
+  double rmw;   // read-modify-write
+  Distribution dist;
+  int max_scan;
+};
+
+// YCSB core workloads A-F
+inline bool GetWorkload(char name, Workload& w) {
+  switch (name) {
+    case 'a': case 'A': w = {0.50, 0.50, 0,    0,    0,    Distribution::ZIPFIAN, 100}; break;
+    case 'b': case 'B': w = {0.95, 0.05, 0,    0,    0,    Distribution::ZIPFIAN, 100}; break;
+    case 'c': case 'C': w = {1.00, 0,    0,    0,    0,    Distribution::ZIPFIAN, 100}; break;
+    case 'd': case 'D': w = {0.95, 0,    0.05, 0,    0,    Distribution::LATEST,  100}; break;
+    case 'e': case 'E': w = {0,    0,    0.05, 0.95, 0,    Distribution::ZIPFIAN, 100}; break;
+    case 'f': case 'F': w = {0.50, 0,    0,    0,    0.50, Distribution::ZIPFIAN, 100}; break;
+    default: return false;
+  }
+  return true;
+}
+
+enum class Op {
+  READ,
+  UPDATE,
+  INSERT,
+  SCAN,
+  RMW,
+};
+
+// pick operations by workload proportions
+class OpChooser {
+ public:
+  OpChooser(const Workload& w, uint64_t seed) : rng_(seed), real_(0.0, 1.0) {
+    double total = w.read + w.update + w.insert + w.scan + w.rmw;
+    cdf_[0] = w.read / total;
+    cdf_[1] = cdf_[0] + w.update / total;
+    cdf_[2] = cdf_[1] + w.insert / total;
+    cdf_[3] = cdf_[2] + w.scan / total;
+  }
+
+  Op Next() {
+    double r = real_(rng_);
+    if (r < cdf_[0]) return Op::READ;
+    if (r < cdf_[1]) return Op::UPDATE;
+    if (r < cdf_[2]) return Op::INSERT;
+    if (r < cdf_[3]) return Op::SCAN;
+    return Op::RMW;
+  }
+
+ private:
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> real_;
+  double cdf_[4];
+};
+
+} // namespace ycsb
+} // namespace combotree